@@ -87,72 +87,114 @@ trie * trie_new(size_t startingSize) {
 		// All tries have a root node
 		a->size = 1;
 		a->capacity = startingSize;
+
+		a->prepared = false;
+		a->class_count = 0;
+		a->edge_start = NULL;
+		a->edge_class = NULL;
+		a->edge_target = NULL;
 	}
 
 	return a;
 }
 
 
+/// Free search tables from ac_trie_prepare()
+static void ac_trie_free_tables(trie * a) {
+	free(a->edge_start);
+	free(a->edge_class);
+	free(a->edge_target);
+
+	a->edge_start = NULL;
+	a->edge_class = NULL;
+	a->edge_target = NULL;
+
+	a->prepared = false;
+}
+
+
 void trie_free(trie * a) {
+	ac_trie_free_tables(a);
 	free(a->node);
 	free(a);
 }
 
 
-bool trie_node_insert(trie * a, size_t s, const unsigned char * key, unsigned short match_type, unsigned short depth) {
-	// Get node for state s
-	trie_node * n = &a->node[s];
+/// Find child of state s for character c in the sibling list (0 if none)
+static trie_state trie_node_child(trie * a, trie_state s, unsigned char c) {
+	trie_state i = a->node[s].child;
+
+	// Siblings are sorted, so we can stop early
+	while (i && (a->node[i].c < c)) {
+		i = a->node[i].sibling;
+	}
+
+	return (i && (a->node[i].c == c)) ? i : 0;
+}
 
-	size_t i;
 
-	if (key[0] == '\0') {
-		// We've hit end of key
-		n->match_type = match_type;
-		n->len = depth;
-		return true;		// Success
+bool trie_insert(trie * a, const char * key, unsigned short match_type) {
+	if (!(a && key && (key[0] != '\0'))) {
+		return false;
 	}
 
-	if (n->child[key[0]] != 0) {
-		// First character already in trie, advance forward
-		return trie_node_insert(a, n->child[key[0]], key + 1, match_type, ++depth);
-	} else {
-		// Create new node
+	const unsigned char * c = (const unsigned char *)key;
+	trie_state s = 0;
+	trie_state * link;
+	trie_state i;
+	unsigned short depth = 0;
 
-		// Ensure capacity
-		if (a->size == a->capacity) {
-			a->capacity *= 2;
-			a->node = realloc(a->node, a->capacity * sizeof(trie_node));
+	while (*c) {
+		// Find insertion point in sorted sibling list
+		link = &a->node[s].child;
 
-			// Set n to new location
-			n = &(a->node[s]);
+		while (*link && (a->node[*link].c < *c)) {
+			link = &a->node[*link].sibling;
 		}
 
-		// Current node points to next node
-		i = a->size;
-		n->child[key[0]] = i;
+		if (*link && (a->node[*link].c == *c)) {
+			// Character already in trie, advance forward
+			s = *link;
+		} else {
+			// Create new node
 
-		// Initialize new node to 0
-		n = &a->node[i];
-		memset(n, 0, sizeof(trie_node));
+			// Ensure capacity
+			if (a->size == a->capacity) {
+				// Remember where link lives, since node may move
+				size_t link_offset = (char *)link - (char *)a->node;
 
-		// Set char for new node
-		n->c = key[0];
+				a->capacity *= 2;
+				a->node = realloc(a->node, a->capacity * sizeof(trie_node));
 
-		// Incremement size
-		a->size++;
+				link = (trie_state *)((char *)a->node + link_offset);
+			}
 
-		// Advance forward
-		return trie_node_insert(a, i, key + 1, match_type, ++depth);
-	}
-}
+			// Initialize new node to 0
+			i = a->size;
+			memset(&a->node[i], 0, sizeof(trie_node));
 
+			// Set char for new node, and splice into sibling list
+			a->node[i].c = *c;
+			a->node[i].sibling = *link;
+			*link = i;
 
-bool trie_insert(trie * a, const char * key, unsigned short match_type) {
-	if (a && key && (key[0] != '\0')) {
-		return trie_node_insert(a, 0, (const unsigned char *)key, match_type, 0);
+			// Incremement size
+			a->size++;
+
+			s = i;
+		}
+
+		c++;
+		depth++;
 	}
 
-	return false;
+	a->node[s].match_type = match_type;
+	a->node[s].len = depth;
+
+	// Search tables are now out of date
+	a->prepared = false;
+
+	return true;
 }
 
 
@@ -167,17 +209,17 @@ void Test_trie_insert(CuTest * tc) {
 
 	trie_node * n = &a->node[0];
 	CuAssertIntEquals(tc, 0, n->match_type);
-	CuAssertIntEquals(tc, 1, n->child['f']);
+	CuAssertIntEquals(tc, 1, trie_node_child(a, 0, 'f'));
 	CuAssertIntEquals(tc, '\0', n->c);
 
 	n = &a->node[1];
 	CuAssertIntEquals(tc, 0, n->match_type);
-	CuAssertIntEquals(tc, 2, n->child['o']);
+	CuAssertIntEquals(tc, 2, trie_node_child(a, 1, 'o'));
 	CuAssertIntEquals(tc, 'f', n->c);
 
 	n = &a->node[2];
 	CuAssertIntEquals(tc, 0, n->match_type);
-	CuAssertIntEquals(tc, 3, n->child['o']);
+	CuAssertIntEquals(tc, 3, trie_node_child(a, 2, 'o'));
 	CuAssertIntEquals(tc, 'o', n->c);
 
 	n = &a->node[3];
@@ -185,33 +227,53 @@ void Test_trie_insert(CuTest * tc) {
 	CuAssertIntEquals(tc, 3, n->len);
 	CuAssertIntEquals(tc, 'o', n->c);
 
+	// Siblings stay sorted regardless of insertion order
+	trie_insert(a, "fa", 1);
+	trie_insert(a, "fz", 2);
+	trie_insert(a, "fm", 3);
+
+	CuAssertIntEquals(tc, 4, a->node[1].child);
+	CuAssertIntEquals(tc, 6, a->node[4].sibling);
+	CuAssertIntEquals(tc, 2, a->node[6].sibling);
+	CuAssertIntEquals(tc, 5, a->node[2].sibling);
+	CuAssertIntEquals(tc, 0, a->node[5].sibling);
+
+	// Grow past starting capacity
+	char key[3] = "xx";
+
+	for (int i = 1; i < 256; ++i) {
+		key[1] = i;
+		trie_insert(a, key, i);
+	}
+
+	CuAssertIntEquals(tc, 263, a->size);
+	CuAssertIntEquals(tc, 200, a->node[trie_node_child(a, trie_node_child(a, 0, 'x'), 200)].match_type);
+
 	trie_free(a);
 }
 #endif
 
 
-size_t trie_node_search(trie * a, size_t s, const char * query) {
-	if (query[0] == '\0') {
-		// Found matching state
-		return s;
+size_t trie_search(trie * a, const char * query) {
+	if (!(a && query)) {
+		return 0;
 	}
 
-	if (a->node[s].child[(unsigned char)query[0]] == 0) {
-		// Failed to match
-		return -1;
-	}
+	trie_state s = 0;
 
-	// Partial match, keep going
-	return trie_node_search(a, a->node[s].child[(unsigned char)query[0]], query + 1);
-}
+	while (query[0] != '\0') {
+		s = trie_node_child(a, s, (unsigned char)query[0]);
 
+		if (s == 0) {
+			// Failed to match
+			return -1;
+		}
 
-size_t trie_search(trie * a, const char * query) {
-	if (a && query) {
-		return trie_node_search(a, 0, query);
+		query++;
 	}
 
-	return 0;
+	// Found matching state
+	return s;
 }
 
 
@@ -251,61 +313,142 @@ void Test_trie_search(CuTest * tc) {
 #endif
 
 
-void ac_trie_node_prepare(trie * a, size_t s, char * buffer, unsigned short depth, size_t last_match_state) {
+/// Transition from state s (not root) for byte class c, using packed edges
+static inline trie_state ac_trie_goto(trie * a, trie_state s, unsigned char c) {
+	trie_state lo = a->edge_start[s];
+	trie_state hi = a->edge_start[s + 1];
 
-	buffer[depth] = '\0';
-	buffer[depth + 1] = '\0';
+	// Most nodes have only a few children; use binary search for the rest
+	while (hi - lo > 8) {
+		trie_state mid = lo + (hi - lo) / 2;
 
-	// Current node
-	trie_node * n = &(a->node[s]);
+		if (a->edge_class[mid] < c) {
+			lo = mid + 1;
+		} else {
+			// mid may be the match, so keep it in range
+			hi = mid + 1;
+		}
+	}
 
-	char * suffix = buffer;
+	for (; lo < hi; ++lo) {
+		if (a->edge_class[lo] >= c) {
+			return (a->edge_class[lo] == c) ? a->edge_target[lo] : 0;
+		}
+	}
 
-	// Longest match seen so far??
-	suffix += 1;
+	return 0;
+}
 
-	// Find valid suffixes for failure path
-	while ((suffix[0] != '\0') && (n->ac_fail == 0)) {
-		n->ac_fail = trie_search(a, suffix);
 
-		if (n->ac_fail == -1) {
-			n->ac_fail = 0;
-		}
+/// Prepare trie for Aho-Corasick search algorithm by mapping failure connections
+/// and packing transitions into compact search tables:
+///
+/// * Bytes are mapped to classes -- only bytes that appear in a key get one
+/// * Transitions out of the root are a dense table indexed by class
+/// * All other transitions are packed by node, sorted by class
+void ac_trie_prepare(trie * a) {
+	ac_trie_free_tables(a);
 
-		if (n->ac_fail == s) {
-			// Something went wrong
-			fprintf(stderr, "Recursive trie fallback detected at state %lu('%c') - suffix:'%s'!\n", s, n->c, suffix);
-			n->ac_fail = 0;
-		}
+	// Assign byte classes in byte order, so that sorted sibling lists are
+	// also sorted by class
+	bool used[256] = { false };
 
-		suffix++;
+	for (size_t i = 1; i < a->size; ++i) {
+		used[a->node[i].c] = true;
 	}
 
+	a->class_count = 0;
 
-	// Prepare children
 	for (int i = 0; i < 256; ++i) {
-		if ((n->child[i] != 0) &&
-				(n->child[i] != s)) {
-			buffer[depth] = i;
+		a->byte_class[i] = used[i] ? ++a->class_count : 0;
+	}
 
-			ac_trie_node_prepare(a, n->child[i], buffer, depth + 1, last_match_state);
-		}
+	// Pack edges
+	a->edge_start = malloc(sizeof(trie_state) * (a->size + 1));
+	a->edge_class = malloc(a->size);
+	a->edge_target = malloc(sizeof(trie_state) * a->size);
+
+	if (!(a->edge_start && a->edge_class && a->edge_target)) {
+		ac_trie_free_tables(a);
+		return;
 	}
-}
 
-/// Prepare trie for Aho-Corasick search algorithm by mapping failure connections
-void ac_trie_prepare(trie * a) {
-	// Clear old pointers
+	trie_state edges = 0;
+	trie_state child;
+
 	for (size_t i = 0; i < a->size; ++i) {
-		a->node[i].ac_fail = 0;
+		a->edge_start[i] = edges;
+
+		for (child = a->node[i].child; child; child = a->node[child].sibling) {
+			a->edge_class[edges] = a->byte_class[a->node[child].c];
+			a->edge_target[edges] = child;
+			edges++;
+		}
 	}
 
-	// Create a buffer to use
-	char buffer[a->capacity];
+	a->edge_start[a->size] = edges;
 
-	ac_trie_node_prepare(a, 0, buffer, 0, 0);
-}
+	// Dense root
+	memset(a->root, 0, sizeof(a->root));
+
+	for (child = a->node[0].child; child; child = a->node[child].sibling) {
+		a->root[a->byte_class[a->node[child].c]] = child;
+	}
+
+	// Map failure connections breadth first, so that each node's failure
+	// target is finished before we need it
+	trie_state * queue = malloc(sizeof(trie_state) * a->size);
+
+	if (!queue) {
+		ac_trie_free_tables(a);
+		return;
+	}
+
+	size_t head = 0;
+	size_t tail = 0;
+	trie_state s, f, next;
+	unsigned char c;
+
+	a->node[0].ac_fail = 0;
+	a->node[0].ac_output = 0;
+
+	for (child = a->node[0].child; child; child = a->node[child].sibling) {
+		a->node[child].ac_fail = 0;
+		a->node[child].ac_output = 0;
+		queue[tail++] = child;
+	}
+
+	while (head < tail) {
+		s = queue[head++];
+
+		for (child = a->node[s].child; child; child = a->node[child].sibling) {
+			c = a->byte_class[a->node[child].c];
 
+			// Longest proper suffix that is also in the trie
+			f = a->node[s].ac_fail;
+			next = 0;
+
+			while (f && !(next = ac_trie_goto(a, f, c))) {
+				f = a->node[f].ac_fail;
+			}
+
+			if (f == 0) {
+				next = a->root[c];
+			}
+
+			a->node[child].ac_fail = next;
+
+			// Shortcut to the next match along the failure path
+			a->node[child].ac_output = a->node[next].match_type ? next : a->node[next].ac_output;
+
+			queue[tail++] = child;
+		}
+	}
+
+	free(queue);
+
+	a->prepared = true;
+}
 
 
 #ifdef TEST
@@ -319,6 +462,44 @@ void Test_trie_prepare(CuTest * tc) {
 
 	ac_trie_prepare(a);
 
+	CuAssertTrue(tc, a->prepared);
+	CuAssertIntEquals(tc, 1, a->class_count);
+	CuAssertIntEquals(tc, 1, a->byte_class['a']);
+	CuAssertIntEquals(tc, 0, a->byte_class['b']);
+	CuAssertIntEquals(tc, 1, a->root[1]);
+
+	// "aaaa" fails to "aaa", and so on
+	CuAssertIntEquals(tc, 3, a->node[4].ac_fail);
+	CuAssertIntEquals(tc, 3, a->node[4].ac_output);
+	CuAssertIntEquals(tc, 0, a->node[1].ac_fail);
+	CuAssertIntEquals(tc, 0, a->node[1].ac_output);
+
+	// Inserting again invalidates search tables
+	trie_insert(a, "ab", 5);
+	CuAssertTrue(tc, !a->prepared);
+
+	ac_trie_prepare(a);
+	CuAssertIntEquals(tc, 2, a->class_count);
+	CuAssertIntEquals(tc, 5, ac_trie_goto(a, 1, a->byte_class['b']));
+	CuAssertIntEquals(tc, 0, ac_trie_goto(a, 5, a->byte_class['b']));
+
+	trie_free(a);
+
+	// Wide nodes use binary search
+	a = trie_new(0);
+	char key[3] = "xx";
+
+	for (int i = 'A'; i <= 'z'; ++i) {
+		key[1] = i;
+		trie_insert(a, key, i);
+	}
+
+	ac_trie_prepare(a);
+
+	for (int i = 'A'; i <= 'z'; ++i) {
+		CuAssertIntEquals(tc, i, a->node[ac_trie_goto(a, 1, a->byte_class[i])].match_type);
+	}
+
 	trie_free(a);
 }
 #endif
@@ -366,48 +547,60 @@ match * match_add(match * last, size_t start, size_t len, unsigned short match_t
 match * ac_trie_search(trie * a, const char * source, size_t start, size_t len) {
 
 	// Store results in a linked list
-//	match * result = match_new(0, 0, 0);
 	match * result = NULL;
 	match * m = result;
 
+	if (!a->prepared) {
+		ac_trie_prepare(a);
+
+		if (!a->prepared) {
+			return NULL;
+		}
+	}
+
 	// Keep track of our state
-	size_t state = 0;
-	size_t temp_state;
+	trie_state state = 0;
+	trie_state temp_state;
+	trie_state next = 0;
 
-	// Character being compared
+	// Class of character being compared
 	unsigned char test_value;
 	size_t counter = start;
 	size_t stop = start + len;
 
 	while ((counter < stop) && (source[counter] != '\0')) {
 		// Read next character
-		test_value = (unsigned char)source[counter++];
+		test_value = a->byte_class[(unsigned char)source[counter++]];
+
+		if (test_value == 0) {
+			// This character isn't in any key, so start over
+			state = 0;
+			continue;
+		}
 
 		// Check for path that allows us to match next character
-		while (state != 0 && a->node[state].child[test_value] == 0) {
+		while (state != 0 && !(next = ac_trie_goto(a, state, test_value))) {
 			state = a->node[state].ac_fail;
 		}
 
 		// Advance state for the next character
-		state = a->node[state].child[test_value];
+		state = state ? next : a->root[test_value];
 
 		// Check for partial matches
-		temp_state = state;
+		temp_state = a->node[state].match_type ? state : a->node[state].ac_output;
 
 		while (temp_state != 0) {
-			if (a->node[temp_state].match_type) {
-				// This is a match
-				if (!m) {
-					result = match_new(0, 0, 0);
-					m = result;
-				}
-
-				m = match_add(m, counter - a->node[temp_state].len,
-							  a->node[temp_state].len, a->node[temp_state].match_type);
+			// This is a match
+			if (!m) {
+				result = match_new(0, 0, 0);
+				m = result;
 			}
 
+			m = match_add(m, counter - a->node[temp_state].len,
+						  a->node[temp_state].len, a->node[temp_state].match_type);
+
 			// Iterate to find shorter matches
-			temp_state = a->node[temp_state].ac_fail;
+			temp_state = a->node[temp_state].ac_output;
 		}
 	}
 
@@ -551,11 +744,15 @@ void Test_aho_trie_search(CuTest * tc) {
 
 	m = ac_trie_search(a, "ABCDEFGGGAZABCABCDZABCABCZ", 0, 26);
 	fprintf(stderr, "Finish with %d matches\n", match_count(m));
+	CuAssertIntEquals(tc, 28, match_count(m));
 	match_set_describe(m, "ABCDEFGGGAZABCABCDZABCABCZ");
 	match_free(m);
 
 	m = ac_trie_leftmost_longest_search(a, "ABCDEFGGGAZABCABCDZABCABCZ", 0, 26);
 	fprintf(stderr, "Finish with %d matches\n", match_count(m));
+	CuAssertIntEquals(tc, 7, match_count(m));
+	CuAssertIntEquals(tc, 18, m->next->next->next->next->next->next->next->start);
+	CuAssertIntEquals(tc, 9, m->next->next->next->next->next->next->next->match_type);
 	match_set_describe(m, "ABCDEFGGGAZABCABCDZABCABCZ");
 	match_free(m);
 
@@ -570,20 +767,15 @@ void trie_node_to_graphviz(trie * a, size_t s) {
 	trie_node * n = &a->node[s];
 
 	if (n->match_type) {
-		fprintf(stderr, "\"%lu\" [shape=doublecircle]\n", s);
+		fprintf(stderr, "\"%lu\" [shape=doublecircle]\n", (unsigned long) s);
 	}
 
-	for (int i = 0; i < 256; ++i) {
-		if (n->child[i]) {
-			switch (i) {
-				default:
-					fprintf(stderr, "\"%lu\" -> \"%lu\" [label=\"%c\"]\n", s, n->child[i], (char)i);
-			}
-		}
+	for (trie_state child = n->child; child; child = a->node[child].sibling) {
+		fprintf(stderr, "\"%lu\" -> \"%lu\" [label=\"%c\"]\n", (unsigned long) s, (unsigned long) child, (char) a->node[child].c);
 	}
 
 	if (n->ac_fail) {
-		fprintf(stderr, "\"%lu\" -> \"%lu\" [label=\"fail\"]\n", s, n->ac_fail);
+		fprintf(stderr, "\"%lu\" -> \"%lu\" [label=\"fail\"]\n", (unsigned long) s, (unsigned long) n->ac_fail);
 	}
 }
 
@@ -597,4 +789,3 @@ void trie_to_graphviz(trie * a) {
 
 	fprintf(stderr, "}\n");
 }
-
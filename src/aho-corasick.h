@@ -56,14 +56,26 @@
 #ifndef AC_TEMPLATE_H
 #define AC_TEMPLATE_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
+
+/// Index of a node in a trie
+typedef uint32_t trie_state;
+
+
+/// Nodes are stored sparsely -- each node points to its first child, and
+/// children are kept in a sorted sibling list.  ac_trie_prepare() then packs
+/// the edges into a compact table for searching.
 struct trie_node {
-	char				c;					// Character for this node
+	trie_state			child;				// First child (0 = none)
+	trie_state			sibling;			// Next child of our parent (0 = none)
+	trie_state			ac_fail;			// Where should we go if we fail?
+	trie_state			ac_output;			// Next state on failure path that is a match
 	unsigned short		match_type;			// 0 = no match, otherwise what have we matched?
 	unsigned short		len;				// Length of string matched
-	size_t				child[256];			// Where should we go next?
-	size_t				ac_fail;			// Where should we go if we fail?
+	unsigned char		c;					// Character for this node
 };
 
 typedef struct trie_node trie_node;
@@ -74,6 +86,15 @@ struct trie {
 	size_t				capacity;			// How many nodes can we hold
 
 	trie_node 	*		node;				// Pointer to stack of nodes
+
+	// Search tables, built by ac_trie_prepare()
+	bool				prepared;			// Are the search tables current?
+	unsigned short		class_count;		// Number of byte classes in use
+	unsigned char		byte_class[256];	// Byte -> class (0 = byte not in any key)
+	trie_state			root[256];			// Dense transitions out of root, by class
+	trie_state		*	edge_start;			// Node -> first edge (size + 1 entries)
+	unsigned char	*	edge_class;			// Edge label, sorted within each node
+	trie_state		*	edge_target;		// Edge destination
 };
 
 typedef struct trie trie;
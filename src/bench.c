@@ -0,0 +1,710 @@
+/**
+
+	MultiMarkdown 6 -- Lightweight markup processor to produce HTML, LaTeX, and more.
+
+	@file bench.c
+
+	@brief Benchmark libMultiMarkdown across corpora, output formats, and
+	extensions, and report the results as JSON.
+
+
+	@author	Fletcher T. Penney
+	@bug
+
+
+**/
+
+/*
+
+	Copyright © 2016 - 2017 Fletcher T. Penney.
+
+
+	The `MultiMarkdown 6` project is released under the MIT License..
+
+	GLibFacade.c and GLibFacade.h are from the MultiMarkdown v4 project:
+
+		https://github.com/fletcher/MultiMarkdown-4/
+
+	MMD 4 is released under both the MIT License and GPL.
+
+
+	CuTest is released under the zlib/libpng license. See CuTest.c for the text
+	of the license.
+
+
+	## The MIT License ##
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(__WIN32)
+	#include <sys/resource.h>
+#endif
+
+#include "argtable3.h"
+#include "d_string.h"
+#include "file.h"
+#include "libMultiMarkdown.h"
+#include "stack.h"
+#include "thread.h"
+#include "token.h"
+#include "version.h"
+
+#ifndef kBenchSourceDirectory
+	#define kBenchSourceDirectory "."	//!< Where to find `tests/MMD6Tests`
+#endif
+
+#define kDefaultIterations 3			// How many times to convert each corpus
+#define kDefaultConcatenations 64		// Copies of "Markdown Syntax.text" in the large corpus
+#define kDefaultNesting 65535			// Same size as tools/pathological_tests.sh
+
+
+// argtable structs
+struct arg_lit * a_help, * a_version;
+struct arg_str * a_corpus, * a_format, * a_extensions;
+struct arg_int * a_iterations, * a_concat, * a_nesting;
+struct arg_file * a_tests, * a_file, * a_o;
+struct arg_end * a_end;
+
+
+/// A named set of documents to be converted
+struct corpus {
+	char 			*		name;
+	stack 			*		documents;			//!< DString for each document
+	size_t					bytes;				//!< Total size of all documents
+};
+
+typedef struct corpus corpus;
+
+
+/// Output formats, using the same names as `multimarkdown -t`
+static const struct {
+	const char 	*	name;
+	short			format;
+} bench_formats[] = {
+	{ "html",		FORMAT_HTML },
+	{ "epub",		FORMAT_EPUB },
+	{ "latex",		FORMAT_LATEX },
+	{ "beamer",		FORMAT_BEAMER },
+	{ "memoir",		FORMAT_MEMOIR },
+	{ "fodt",		FORMAT_FODT },
+	{ "odt",		FORMAT_ODT },
+	{ "bundle",		FORMAT_TEXTBUNDLE },
+	{ "bundlezip",	FORMAT_TEXTBUNDLE_COMPRESSED },
+	{ "opml",		FORMAT_OPML },
+	{ "itmz",		FORMAT_ITMZ },
+	{ "mmd",		FORMAT_MMD },
+	{ "htmlassets",	FORMAT_HTML_WITH_ASSETS },
+};
+
+#define kNumberOfFormats (sizeof(bench_formats) / sizeof(bench_formats[0]))
+
+
+/// Extension masks matching the `multimarkdown` command line options
+/// (transclusion is left out since it depends on the file system)
+#define kDefaultExtensions (EXT_SMART | EXT_NOTES | EXT_CRITIC)
+
+static const struct {
+	const char 	*	name;
+	unsigned long	extensions;
+} bench_extensions[] = {
+	{ "default",	kDefaultExtensions },
+	{ "compat",		EXT_COMPATIBILITY | EXT_NO_LABELS | EXT_OBFUSCATE | EXT_NO_METADATA },
+	{ "complete",	kDefaultExtensions | EXT_COMPLETE },
+	{ "nosmart",	kDefaultExtensions & ~EXT_SMART },
+	{ "accept",		kDefaultExtensions | EXT_CRITIC_ACCEPT },
+	{ "reject",		kDefaultExtensions | EXT_CRITIC_REJECT },
+};
+
+#define kNumberOfExtensions (sizeof(bench_extensions) / sizeof(bench_extensions[0]))
+
+
+/// Pathological inputs from tools/pathological_tests.sh, as
+/// `seq -s separator -f pattern` repeated `nesting` times
+static const struct {
+	const char 	*	pattern;
+	const char 	*	separator;
+	const char 	*	suffix;					//!< Text between two halves of the file
+	const char 	*	pattern2;				//!< Optional second half
+} bench_pathological[] = {
+	{ "*a **a",				"\n",	"b ",	"a** a*" },
+	{ "a_",					"\n",	NULL,	NULL },
+	{ "_a",					"\n",	NULL,	NULL },
+	{ "a]",					"\n",	NULL,	NULL },
+	{ "[a",					"\n",	NULL,	NULL },
+	{ "*a_",				"\n",	NULL,	NULL },
+	{ "[ a_",				"\n",	NULL,	NULL },
+	{ "**x [*b**c*](d)",	"\n",	NULL,	NULL },
+	{ "[",					" ",	NULL,	"]" },
+};
+
+#define kNumberOfPathological (sizeof(bench_pathological) / sizeof(bench_pathological[0]))
+
+
+/// strdup() not available on all platforms
+static char * my_strdup(const char * source) {
+	if (source == NULL) {
+		return NULL;
+	}
+
+	char * result = malloc(strlen(source) + 1);
+
+	if (result) {
+		strcpy(result, source);
+	}
+
+	return result;
+}
+
+
+static corpus * corpus_new(const char * name) {
+	corpus * c = malloc(sizeof(corpus));
+
+	if (c) {
+		c->name = my_strdup(name);
+		c->documents = stack_new(0);
+		c->bytes = 0;
+	}
+
+	return c;
+}
+
+
+static void corpus_free(corpus * c) {
+	while (c->documents->size) {
+		d_string_free(stack_pop(c->documents), true);
+	}
+
+	stack_free(c->documents);
+	free(c->name);
+	free(c);
+}
+
+
+static void corpus_add(corpus * c, DString * d) {
+	stack_push(c->documents, d);
+	c->bytes += d->currentStringLength;
+}
+
+
+static int compare_strings(const void * a, const void * b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/// Load the `*.text` files from a directory, in a predictable order
+static corpus * corpus_from_directory(const char * name, const char * directory) {
+	DIR * dir = opendir(directory);
+
+	if (dir == NULL) {
+		fprintf(stderr, "Unable to open directory '%s'\n", directory);
+		return NULL;
+	}
+
+	stack * names = stack_new(0);
+	struct dirent * entry;
+	size_t len;
+
+	while ((entry = readdir(dir))) {
+		len = strlen(entry->d_name);
+
+		if ((len > 5) && (strcmp(&entry->d_name[len - 5], ".text") == 0)) {
+			stack_push(names, my_strdup(entry->d_name));
+		}
+	}
+
+	closedir(dir);
+
+	qsort(names->element, names->size, sizeof(void *), compare_strings);
+
+	corpus * c = corpus_new(name);
+	DString * path = d_string_new("");
+	DString * text;
+
+	for (int i = 0; i < names->size; ++i) {
+		d_string_erase(path, 0, -1);
+		d_string_append(path, directory);
+		add_trailing_sep(path);
+		d_string_append(path, stack_peek_index(names, i));
+
+		text = scan_file(path->str);
+
+		if (text) {
+			corpus_add(c, text);
+		}
+
+		free(stack_peek_index(names, i));
+	}
+
+	d_string_free(path, true);
+	stack_free(names);
+
+	return c;
+}
+
+
+/// Load specific files given on the command line
+static corpus * corpus_from_files(const char * name, const char ** files, int count) {
+	corpus * c = corpus_new(name);
+	DString * text;
+
+	for (int i = 0; i < count; ++i) {
+		text = scan_file(files[i]);
+
+		if (text) {
+			corpus_add(c, text);
+		} else {
+			fprintf(stderr, "Unable to read file '%s'\n", files[i]);
+		}
+	}
+
+	return c;
+}
+
+
+/// Build the pathological inputs in memory
+static corpus * corpus_pathological(int nesting) {
+	corpus * c = corpus_new("pathological");
+	DString * d;
+
+	for (int i = 0; i < kNumberOfPathological; ++i) {
+		d = d_string_new("");
+
+		for (int j = 0; j < nesting; ++j) {
+			d_string_append(d, bench_pathological[i].pattern);
+			d_string_append(d, (j < nesting - 1) ? bench_pathological[i].separator : "\n");
+		}
+
+		if (bench_pathological[i].suffix) {
+			d_string_append(d, bench_pathological[i].suffix);
+		}
+
+		if (bench_pathological[i].pattern2) {
+			for (int j = 0; j < nesting; ++j) {
+				d_string_append(d, bench_pathological[i].pattern2);
+				d_string_append(d, (j < nesting - 1) ? bench_pathological[i].separator : "\n");
+			}
+		}
+
+		corpus_add(c, d);
+	}
+
+	return c;
+}
+
+
+/// One large document made of many copies of a smaller one
+static corpus * corpus_concatenated(const char * directory, int copies) {
+	DString * path = d_string_new(directory);
+	add_trailing_sep(path);
+	d_string_append(path, "Markdown Syntax.text");
+
+	DString * text = scan_file(path->str);
+
+	if (text == NULL) {
+		fprintf(stderr, "Unable to read file '%s'\n", path->str);
+		d_string_free(path, true);
+		return NULL;
+	}
+
+	corpus * c = corpus_new("large");
+	DString * d = d_string_new("");
+
+	for (int i = 0; i < copies; ++i) {
+		d_string_append_c_array(d, text->str, text->currentStringLength);
+	}
+
+	corpus_add(c, d);
+
+	d_string_free(text, true);
+	d_string_free(path, true);
+
+	return c;
+}
+
+
+/// Peak resident memory for this process so far, in KB
+static long peak_rss_kb(void) {
+#if !defined(__WIN32)
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+		// macOS reports bytes
+		return usage.ru_maxrss / 1024;
+#else
+		return usage.ru_maxrss;
+#endif
+	}
+
+#endif
+
+	return 0;
+}
+
+
+static int compare_doubles(const void * a, const void * b) {
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+/// Nearest-rank percentile of sorted values
+static double percentile(const double * sorted, size_t count, double p) {
+	if (count == 0) {
+		return 0;
+	}
+
+	size_t rank = (size_t)(p * count + 0.999999);
+
+	if (rank < 1) {
+		rank = 1;
+	}
+
+	if (rank > count) {
+		rank = count;
+	}
+
+	return sorted[rank - 1];
+}
+
+
+/// Convert a single document the same way the command line tool would, and
+/// add the time spent in each phase to phase_time
+static void convert_document(DString * text, unsigned long extensions, short format, double * phase_time) {
+	DString * source = d_string_new_borrowed(text->str, text->currentStringLength);
+
+	if (extensions & EXT_CRITIC_ACCEPT) {
+		mmd_critic_markup_accept(source);
+	}
+
+	if (extensions & EXT_CRITIC_REJECT) {
+		mmd_critic_markup_reject(source);
+	}
+
+	mmd_engine * e = mmd_engine_create_with_dstring(source, extensions);
+	mmd_engine_set_stats_enabled(e, true);
+
+	DString * result = mmd_engine_convert_to_data(e, format, NULL);
+
+	for (short i = 0; i < PHASE_COUNT; ++i) {
+		phase_time[i] += mmd_engine_stats(e)->phase_time[i];
+	}
+
+	d_string_free(result, true);
+	mmd_engine_free(e, true);
+}
+
+
+static void print_json_string(FILE * out, const char * str) {
+	fputc('"', out);
+
+	for (const char * c = str; *c; ++c) {
+		switch (*c) {
+			case '"':
+			case '\\':
+				fputc('\\', out);
+				fputc(*c, out);
+				break;
+
+			default:
+				if ((unsigned char) * c < 0x20) {
+					fprintf(out, "\\u%04x", *c);
+				} else {
+					fputc(*c, out);
+				}
+
+				break;
+		}
+	}
+
+	fputc('"', out);
+}
+
+
+/// Time one corpus/format/extensions combination and print the JSON result
+static void run_case(FILE * out, corpus * c, int format_index, const char * ext_name, unsigned long extensions, int iterations, bool first) {
+	size_t count = c->documents->size * iterations;
+	double * latency = malloc(sizeof(double) * (count ? count : 1));
+	double total = 0;
+	double start;
+	size_t n = 0;
+	double phase_time[PHASE_COUNT] = { 0 };
+
+	for (int i = 0; i < iterations; ++i) {
+		for (int j = 0; j < c->documents->size; ++j) {
+			start = mmd_clock_seconds();
+			convert_document(stack_peek_index(c->documents, j), extensions, bench_formats[format_index].format, phase_time);
+			latency[n] = mmd_clock_seconds() - start;
+			total += latency[n++];
+		}
+	}
+
+	qsort(latency, n, sizeof(double), compare_doubles);
+
+	double bytes = (double) c->bytes * iterations;
+
+	fprintf(out, "%s\n\t\t{ \"corpus\": ", first ? "" : ",");
+	print_json_string(out, c->name);
+	fprintf(out, ", \"format\": \"%s\", \"extensions\": ", bench_formats[format_index].name);
+	print_json_string(out, ext_name);
+	fprintf(out, ", \"mask\": %lu, \"documents\": %lu, \"bytes\": %lu, \"iterations\": %d,",
+			extensions, (unsigned long) c->documents->size, (unsigned long) c->bytes, iterations);
+	fprintf(out, " \"seconds\": %.6f, \"mb_per_s\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"peak_rss_kb\": %ld",
+			total, (total > 0) ? bytes / (1024 * 1024) / total : 0,
+			percentile(latency, n, 0.50) * 1000, percentile(latency, n, 0.99) * 1000, peak_rss_kb());
+
+	// Milliseconds per pass through the corpus
+	fprintf(out, ",\n\t\t  \"phase_ms\": {");
+
+	for (short i = 0; i < PHASE_COUNT; ++i) {
+		fprintf(out, "%s \"%s\": %.3f", i ? "," : "", mmd_stats_phase_name(i), phase_time[i] * 1000 / iterations);
+	}
+
+	fprintf(out, " } }");
+	fflush(out);
+
+	free(latency);
+}
+
+
+static int format_index_for_name(const char * name) {
+	for (int i = 0; i < kNumberOfFormats; ++i) {
+		if (strcmp(name, bench_formats[i].name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+/// Extensions can be given by preset name, or as a numeric mask
+static bool extensions_for_name(const char * name, unsigned long * extensions) {
+	for (int i = 0; i < kNumberOfExtensions; ++i) {
+		if (strcmp(name, bench_extensions[i].name) == 0) {
+			*extensions = bench_extensions[i].extensions;
+			return true;
+		}
+	}
+
+	char * end;
+	*extensions = strtoul(name, &end, 0);
+
+	return (*name != '\0') && (*end == '\0');
+}
+
+
+int main(int argc, char ** argv) {
+	int exitcode = EXIT_SUCCESS;
+	FILE * out = stdout;
+
+	void * argtable[] = {
+		a_help			= arg_lit0(NULL, "help", "display this help and exit"),
+		a_version		= arg_lit0(NULL, "version", "display version info and exit"),
+
+		a_corpus		= arg_strn("c", "corpus", "NAME", 0, 8, "corpus to run, NAME = tests|pathological|large (default all)"),
+		a_format		= arg_strn("t", "to", "FORMAT", 0, kNumberOfFormats, "output format, FORMAT = html|latex|beamer|memoir|mmd|odt|fodt|epub|opml|itmz|bundle|bundlezip|htmlassets (default all)"),
+		a_extensions	= arg_strn("x", "extensions", "EXT", 0, 32, "extensions, EXT = default|compat|complete|nosmart|accept|reject or a numeric mask (default all presets)"),
+		a_iterations	= arg_int0("n", "iterations", "N", "convert each corpus N times (default 3)"),
+		a_concat		= arg_int0(NULL, "concat", "N", "number of copies in the large corpus (default 64)"),
+		a_nesting		= arg_int0(NULL, "nesting", "N", "size of the pathological inputs (default 65535)"),
+		a_tests			= arg_file0(NULL, "tests", "DIR", "directory containing the test suite"),
+		a_o				= arg_file0("o", "output", "FILE", "send JSON results to FILE"),
+
+		a_file 			= arg_filen(NULL, NULL, "<FILE>", 0, argc + 2, "benchmark these files instead of the built-in corpora"),
+
+		a_end 			= arg_end(20),
+	};
+
+	int nerrors = arg_parse(argc, argv, argtable);
+
+	if (a_help->count > 0) {
+		printf("\nMultiMarkdown 6 Benchmark v%s\n\n", LIBMULTIMARKDOWN_VERSION);
+		printf("Usage: mmd-bench");
+		arg_print_syntax(stdout, argtable, "\n\n");
+		printf("Options:\n");
+		arg_print_glossary(stdout, argtable, "\t%-25s %s\n");
+		printf("\n");
+		goto exit;
+	}
+
+	if (nerrors > 0) {
+		arg_print_errors(stdout, a_end, "mmd-bench");
+		printf("Try 'mmd-bench --help' for more information.\n");
+		exitcode = 1;
+		goto exit;
+	}
+
+	if (a_version->count > 0) {
+		printf("\nMultiMarkdown 6 Benchmark v%s\n", LIBMULTIMARKDOWN_VERSION);
+		printf("%s\n\n", LIBMULTIMARKDOWN_COPYRIGHT);
+		goto exit;
+	}
+
+	int iterations = (a_iterations->count) ? a_iterations->ival[0] : kDefaultIterations;
+	int copies = (a_concat->count) ? a_concat->ival[0] : kDefaultConcatenations;
+	int nesting = (a_nesting->count) ? a_nesting->ival[0] : kDefaultNesting;
+
+	DString * tests_dir = d_string_new((a_tests->count) ? a_tests->filename[0] : kBenchSourceDirectory);
+
+	if (a_tests->count == 0) {
+		add_trailing_sep(tests_dir);
+		d_string_append(tests_dir, "tests/MMD6Tests");
+	}
+
+	// Which formats?
+	int formats[kNumberOfFormats];
+	int format_count = 0;
+
+	if (a_format->count == 0) {
+		for (int i = 0; i < kNumberOfFormats; ++i) {
+			formats[format_count++] = i;
+		}
+	} else {
+		for (int i = 0; i < a_format->count; ++i) {
+			formats[format_count] = format_index_for_name(a_format->sval[i]);
+
+			if (formats[format_count] < 0) {
+				fprintf(stderr, "Unknown format '%s'\n", a_format->sval[i]);
+				exitcode = 1;
+				goto exit2;
+			}
+
+			format_count++;
+		}
+	}
+
+	// Which extensions?
+	const char * ext_names[32];
+	unsigned long ext_masks[32];
+	int ext_count = 0;
+
+	if (a_extensions->count == 0) {
+		for (int i = 0; i < kNumberOfExtensions; ++i) {
+			ext_names[ext_count] = bench_extensions[i].name;
+			ext_masks[ext_count++] = bench_extensions[i].extensions;
+		}
+	} else {
+		for (int i = 0; i < a_extensions->count; ++i) {
+			ext_names[ext_count] = a_extensions->sval[i];
+
+			if (!extensions_for_name(a_extensions->sval[i], &ext_masks[ext_count])) {
+				fprintf(stderr, "Unknown extensions '%s'\n", a_extensions->sval[i]);
+				exitcode = 1;
+				goto exit2;
+			}
+
+			ext_count++;
+		}
+	}
+
+	// Which corpora?
+	stack * corpora = stack_new(0);
+	corpus * c;
+
+	if (a_file->count > 0) {
+		stack_push(corpora, corpus_from_files("files", a_file->filename, a_file->count));
+	} else {
+		static const char * all_corpora[] = { "tests", "pathological", "large" };
+
+		for (int i = 0; i < ((a_corpus->count) ? a_corpus->count : 3); ++i) {
+			const char * name = (a_corpus->count) ? a_corpus->sval[i] : all_corpora[i];
+
+			if (strcmp(name, "tests") == 0) {
+				c = corpus_from_directory("tests", tests_dir->str);
+			} else if (strcmp(name, "pathological") == 0) {
+				c = corpus_pathological(nesting);
+			} else if (strcmp(name, "large") == 0) {
+				c = corpus_concatenated(tests_dir->str, copies);
+			} else {
+				fprintf(stderr, "Unknown corpus '%s'\n", name);
+				c = NULL;
+			}
+
+			if (c == NULL) {
+				exitcode = 1;
+				goto exit3;
+			}
+
+			stack_push(corpora, c);
+		}
+	}
+
+	if (a_o->count > 0) {
+		out = fopen(a_o->filename[0], "w");
+
+		if (out == NULL) {
+			perror(a_o->filename[0]);
+			exitcode = 1;
+			goto exit3;
+		}
+	}
+
+	fprintf(out, "{\n\t\"version\": \"%s\",\n", LIBMULTIMARKDOWN_VERSION);
+#ifdef kUseCompactTokens
+	fprintf(out, "\t\"compact_tokens\": true,\n");
+#else
+	fprintf(out, "\t\"compact_tokens\": false,\n");
+#endif
+	fprintf(out, "\t\"results\": [");
+
+	bool first = true;
+
+	for (int i = 0; i < corpora->size; ++i) {
+		c = stack_peek_index(corpora, i);
+
+		for (int j = 0; j < format_count; ++j) {
+			for (int k = 0; k < ext_count; ++k) {
+				run_case(out, c, formats[j], ext_names[k], ext_masks[k], iterations, first);
+				first = false;
+			}
+		}
+	}
+
+	fprintf(out, "\n\t],\n\t\"peak_rss_kb\": %ld\n}\n", peak_rss_kb());
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+exit3:
+
+	while (corpora->size) {
+		corpus_free(stack_pop(corpora));
+	}
+
+	stack_free(corpora);
+
+exit2:
+	d_string_free(tests_dir, true);
+
+exit:
+	arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+
+	return exitcode;
+}
@@ -60,42 +60,121 @@
 
 #include "aho-corasick.h"
 #include "critic_markup.h"
+#include "object_pool.h"
 #include "stack.h"
+#include "thread.h"
 #include "token_pairs.h"
 
 
-token * mmd_critic_tokenize_string(const char * source, size_t start, size_t len) {
-	trie * ac = trie_new(0);
+/// Which CriticMarkup tokens can be paired
+static const token_pair_engine critic_pairings = {
+	.can_open_pair = {
+		[CM_ADD_OPEN] = 1, [CM_DEL_OPEN] = 1, [CM_SUB_OPEN] = 1, [CM_HI_OPEN] = 1, [CM_COM_OPEN] = 1,
+	},
+	.can_close_pair = {
+		[CM_ADD_CLOSE] = 1, [CM_DEL_CLOSE] = 1, [CM_SUB_CLOSE] = 1, [CM_HI_CLOSE] = 1, [CM_COM_CLOSE] = 1,
+	},
+	.pair_type = {
+		[CM_ADD_OPEN] = { [CM_ADD_CLOSE] = CM_ADD_PAIR },
+		[CM_DEL_OPEN] = { [CM_DEL_CLOSE] = CM_DEL_PAIR },
+		[CM_SUB_OPEN] = { [CM_SUB_CLOSE] = CM_SUB_PAIR },
+		[CM_HI_OPEN]  = { [CM_HI_CLOSE]  = CM_HI_PAIR },
+		[CM_COM_OPEN] = { [CM_COM_CLOSE] = CM_COM_PAIR },
+	},
+	.empty_allowed = {
+		[CM_ADD_PAIR] = true, [CM_DEL_PAIR] = true, [CM_SUB_PAIR] = true, [CM_HI_PAIR] = true, [CM_COM_PAIR] = true,
+	},
+	.should_prune = {
+		[CM_ADD_PAIR] = true, [CM_DEL_PAIR] = true, [CM_SUB_PAIR] = true, [CM_HI_PAIR] = true, [CM_COM_PAIR] = true,
+	},
+};
+
+
+/// Tokens recognized by the CriticMarkup automaton
+static const struct {
+	const char *	key;
+	unsigned short	match_type;
+} critic_keys[] = {
+	{ "{++", CM_ADD_OPEN },
+	{ "++}", CM_ADD_CLOSE },
+
+	{ "{--", CM_DEL_OPEN },
+	{ "--}", CM_DEL_CLOSE },
+
+	{ "{~~", CM_SUB_OPEN },
+	{ "~>", CM_SUB_DIV },
+	{ "~~}", CM_SUB_CLOSE },
+
+	{ "{==", CM_HI_OPEN },
+	{ "==}", CM_HI_CLOSE },
+
+	{ "{>>", CM_COM_OPEN },
+	{ "<<}", CM_COM_CLOSE },
+
+	{ "\\{", CM_PLAIN_TEXT },
+	{ "\\}", CM_PLAIN_TEXT },
+	{ "\\+", CM_PLAIN_TEXT },
+	{ "\\-", CM_PLAIN_TEXT },
+	{ "\\~", CM_PLAIN_TEXT },
+	{ "\\>", CM_PLAIN_TEXT },
+	{ "\\=", CM_PLAIN_TEXT },
+};
+
+
+/// Aho-Corasick automaton for CriticMarkup tokens, built at first use.  It
+/// is prepared before it is shared, so searching it never modifies it and
+/// all threads can use it at once.
+static trie * critic_trie = NULL;
+
+static mmd_mutex critic_trie_lock = kMutexInitializer;
+
+
+/// Return the shared CriticMarkup automaton, building it if necessary
+static trie * critic_trie_shared(void) {
+	mmd_mutex_lock(&critic_trie_lock);
+
+	if (critic_trie == NULL) {
+		trie * ac = trie_new(0);
+
+		for (int i = 0; i < sizeof(critic_keys) / sizeof(critic_keys[0]); ++i) {
+			trie_insert(ac, critic_keys[i].key, critic_keys[i].match_type);
+		}
 
-	trie_insert(ac, "{++", CM_ADD_OPEN);
-	trie_insert(ac, "++}", CM_ADD_CLOSE);
+		ac_trie_prepare(ac);
 
-	trie_insert(ac, "{--", CM_DEL_OPEN);
-	trie_insert(ac, "--}", CM_DEL_CLOSE);
+		critic_trie = ac;
+	}
 
-	trie_insert(ac, "{~~", CM_SUB_OPEN);
-	trie_insert(ac, "~>", CM_SUB_DIV);
-	trie_insert(ac, "~~}", CM_SUB_CLOSE);
+	mmd_mutex_unlock(&critic_trie_lock);
 
-	trie_insert(ac, "{==", CM_HI_OPEN);
-	trie_insert(ac, "==}", CM_HI_CLOSE);
+	return critic_trie;
+}
 
-	trie_insert(ac, "{>>", CM_COM_OPEN);
-	trie_insert(ac, "<<}", CM_COM_CLOSE);
 
-	trie_insert(ac, "\\{", CM_PLAIN_TEXT);
-	trie_insert(ac, "\\}", CM_PLAIN_TEXT);
-	trie_insert(ac, "\\{", CM_PLAIN_TEXT);
-	trie_insert(ac, "\\+", CM_PLAIN_TEXT);
-	trie_insert(ac, "\\-", CM_PLAIN_TEXT);
-	trie_insert(ac, "\\~", CM_PLAIN_TEXT);
-	trie_insert(ac, "\\>", CM_PLAIN_TEXT);
-	trie_insert(ac, "\\=", CM_PLAIN_TEXT);
+#ifdef TEST
+void Test_critic_trie(CuTest * tc) {
+	trie * ac = critic_trie_shared();
 
+	CuAssertTrue(tc, ac->prepared);
+	CuAssertPtrEquals(tc, ac, critic_trie_shared());
 
-	ac_trie_prepare(ac);
+	const char * source = "a {++b++} \\{c";
+	match * m = ac_trie_leftmost_longest_search(ac, source, 0, strlen(source));
+
+	CuAssertPtrNotNull(tc, m);
+	CuAssertIntEquals(tc, CM_ADD_OPEN, m->next->match_type);
+	CuAssertIntEquals(tc, 2, m->next->start);
+	CuAssertIntEquals(tc, CM_ADD_CLOSE, m->next->next->match_type);
+	CuAssertIntEquals(tc, CM_PLAIN_TEXT, m->next->next->next->match_type);
+	CuAssertPtrEquals(tc, NULL, m->next->next->next->next);
+
+	match_free(m);
+}
+#endif
 
-	match * m = ac_trie_leftmost_longest_search(ac, source, start, len);
+
+token * mmd_critic_tokenize_string(const char * source, size_t start, size_t len) {
+	match * m = ac_trie_leftmost_longest_search(critic_trie_shared(), source, start, len);
 
 	token * root = NULL;
 
@@ -127,8 +206,6 @@ token * mmd_critic_tokenize_string(const char * source, size_t start, size_t len
 		match_free(m);
 	}
 
-	trie_free(ac);
-
 	return root;
 }
 
@@ -138,53 +215,123 @@ token * critic_parse_substring(const char * source, size_t start, size_t len) {
 	token * chain = mmd_critic_tokenize_string(source, start, len);
 
 	if (chain) {
-		token_pair_engine * e = token_pair_engine_new();
-
-		token_pair_engine_add_pairing(e, CM_ADD_OPEN, CM_ADD_CLOSE, CM_ADD_PAIR, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e, CM_DEL_OPEN, CM_DEL_CLOSE, CM_DEL_PAIR, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e, CM_SUB_OPEN, CM_SUB_CLOSE, CM_SUB_PAIR, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e, CM_HI_OPEN,  CM_HI_CLOSE,  CM_HI_PAIR,  PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e, CM_COM_OPEN, CM_COM_CLOSE, CM_COM_PAIR, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-
 		stack * s = stack_new(0);
 
-		token_pairs_match_pairs_inside_token(chain, e, s, 0);
+		token_pairs_match_pairs_inside_token(chain, &critic_pairings, s);
 
 		stack_free(s);
-		token_pair_engine_free(e);
 	}
 
 	return chain;
 }
 
 
-void accept_token_tree(DString * d, token * t);
-void accept_token(DString * d, token * t);
+/// Could this range contain CriticMarkup that changes when accepted or rejected?
+/// Everything but a stray `~>` needs an opening `{`, so we only need to look
+/// for those two bytes (and memchr() is vectorized on most platforms).
+static bool critic_markup_possible(DString * d, size_t start, size_t len) {
+	if (start >= d->currentStringLength) {
+		return false;
+	}
+
+	if (len > d->currentStringLength - start) {
+		len = d->currentStringLength - start;
+	}
+
+	return memchr(&d->str[start], '{', len) || memchr(&d->str[start], '~', len);
+}
+
+
+/// A range of text to be removed
+struct cut {
+	size_t				start;
+	size_t				len;
+};
+
+typedef struct cut cut;
+
+
+/// Text to be removed when accepting or rejecting changes.  The token tree is
+/// walked back to front, so cuts are added in descending order.  Rather than
+/// erasing each one from the string (moving the rest of the text every time),
+/// the text that remains is copied into a new buffer once at the end.
+struct cut_list {
+	cut 		*		cuts;
+	size_t				count;
+	size_t				size;			//!< Cuts allocated
+	size_t				len;			//!< Total length of cuts
+};
+
+typedef struct cut_list cut_list;
+
+
+static void cut_list_add(cut_list * l, size_t start, size_t len) {
+	if (l->count == l->size) {
+		l->size = (l->size) ? l->size * 2 : 64;
+		l->cuts = realloc(l->cuts, sizeof(cut) * l->size);
+	}
+
+	l->cuts[l->count].start = start;
+	l->cuts[l->count].len = len;
+	l->count++;
+	l->len += len;
+}
+
+
+/// Remove cuts from the string (and free them)
+static void cut_list_apply(cut_list * l, DString * d) {
+	if (l->count == 0) {
+		return;
+	}
+
+	size_t len = d->currentStringLength - l->len;
+	char * str = malloc(len + 1);
+	char * out = str;
+	size_t from = 0;
+
+	// Copy text between cuts, front to back
+	for (size_t i = l->count; i-- > 0;) {
+		memcpy(out, &d->str[from], l->cuts[i].start - from);
+		out += l->cuts[i].start - from;
+		from = l->cuts[i].start + l->cuts[i].len;
+	}
+
+	memcpy(out, &d->str[from], d->currentStringLength - from);
+	str[len] = '\0';
+
+	d_string_adopt(d, str, len, len + 1);
+
+	free(l->cuts);
+}
+
+
+void accept_token_tree(cut_list * cuts, token * t);
+void accept_token(cut_list * cuts, token * t);
 
 
-void accept_token_tree_sub(DString * d, token * t) {
+void accept_token_tree_sub(cut_list * cuts, token * t) {
 	while (t) {
 		if (t->type == CM_SUB_DIV) {
 			while (t) {
-				d_string_erase(d, t->start, t->len);
+				cut_list_add(cuts, t->start, t->len);
 				t = t->prev;
 			}
 
 			return;
 		}
 
-		accept_token(d, t);
+		accept_token(cuts, t);
 
 		t = t->prev;
 	}
 }
 
 
-void accept_token(DString * d, token * t) {
+void accept_token(cut_list * cuts, token * t) {
 	switch (t->type) {
 		case CM_SUB_CLOSE:
 			if (t->mate) {
-				d_string_erase(d, t->start, t->len);
+				cut_list_add(cuts, t->start, t->len);
 			}
 
 			break;
@@ -202,14 +349,14 @@ void accept_token(DString * d, token * t) {
 		case CM_DEL_PAIR:
 		case CM_COM_PAIR:
 			// Erase these
-			d_string_erase(d, t->start, t->len);
+			cut_list_add(cuts, t->start, t->len);
 			break;
 
 		case CM_SUB_PAIR:
 
 			// Erase old version and markers
 			if (t->child) {
-				accept_token_tree_sub(d, t->child->mate);
+				accept_token_tree_sub(cuts, t->child->mate);
 			}
 
 			break;
@@ -219,7 +366,7 @@ void accept_token(DString * d, token * t) {
 
 			// Check children
 			if (t->child) {
-				accept_token_tree(d, t->child->mate);
+				accept_token_tree(cuts, t->child->mate);
 			}
 
 			break;
@@ -227,9 +374,9 @@ void accept_token(DString * d, token * t) {
 }
 
 
-void accept_token_tree(DString * d, token * t) {
+void accept_token_tree(cut_list * cuts, token * t) {
 	while (t) {
-		accept_token(d, t);
+		accept_token(cuts, t);
 
 		// Iterate backwards so offsets are right
 		t = t->prev;
@@ -238,13 +385,32 @@ void accept_token_tree(DString * d, token * t) {
 
 
 void mmd_critic_markup_accept_range(DString * d, size_t start, size_t len) {
+	if (!critic_markup_possible(d, start, len)) {
+		// Nearly all documents have no CriticMarkup
+		return;
+	}
+
+#ifdef kUseObjectPool
+	// Use a private pool so that this is safe to call on any thread
+	pool * p = pool_new(sizeof(token));
+	struct pool * previous_pool = token_pool_swap(p);
+#endif
+
 	token * t = critic_parse_substring(d->str, start, len);
+	cut_list cuts = {0};
 
 	if (t && t->child) {
-		accept_token_tree(d, t->child->tail);
+		accept_token_tree(&cuts, t->child->tail);
 	}
 
 	token_free(t);
+
+	cut_list_apply(&cuts, d);
+
+#ifdef kUseObjectPool
+	token_pool_swap(previous_pool);
+	pool_free(p);
+#endif
 }
 
 
@@ -253,30 +419,30 @@ void mmd_critic_markup_accept(DString * d) {
 }
 
 
-void reject_token_tree(DString * d, token * t);
-void reject_token(DString * d, token * t);
+void reject_token_tree(cut_list * cuts, token * t);
+void reject_token(cut_list * cuts, token * t);
 
 
-void reject_token_tree_sub(DString * d, token * t) {
+void reject_token_tree_sub(cut_list * cuts, token * t) {
 	while (t && t->type != CM_SUB_DIV) {
-		d_string_erase(d, t->start, t->len);
+		cut_list_add(cuts, t->start, t->len);
 		t = t->prev;
 	}
 
 	while (t) {
 
-		reject_token(d, t);
+		reject_token(cuts, t);
 
 		t = t->prev;
 	}
 }
 
 
-void reject_token(DString * d, token * t) {
+void reject_token(cut_list * cuts, token * t) {
 	switch (t->type) {
 		case CM_SUB_CLOSE:
 			if (t->mate) {
-				d_string_erase(d, t->start, t->len);
+				cut_list_add(cuts, t->start, t->len);
 			}
 
 			break;
@@ -294,14 +460,14 @@ void reject_token(DString * d, token * t) {
 		case CM_ADD_PAIR:
 		case CM_COM_PAIR:
 			// Erase these
-			d_string_erase(d, t->start, t->len);
+			cut_list_add(cuts, t->start, t->len);
 			break;
 
 		case CM_SUB_PAIR:
 
 			// Erase new version and markers
 			if (t->child) {
-				reject_token_tree_sub(d, t->child->mate);
+				reject_token_tree_sub(cuts, t->child->mate);
 			}
 
 			break;
@@ -311,7 +477,7 @@ void reject_token(DString * d, token * t) {
 
 			// Check children
 			if (t->child) {
-				reject_token_tree(d, t->child->mate);
+				reject_token_tree(cuts, t->child->mate);
 			}
 
 			break;
@@ -319,9 +485,9 @@ void reject_token(DString * d, token * t) {
 }
 
 
-void reject_token_tree(DString * d, token * t) {
+void reject_token_tree(cut_list * cuts, token * t) {
 	while (t) {
-		reject_token(d, t);
+		reject_token(cuts, t);
 
 		// Iterate backwards so offsets are right
 		t = t->prev;
@@ -330,14 +496,33 @@ void reject_token_tree(DString * d, token * t) {
 
 
 void mmd_critic_markup_reject_range(DString * d, size_t start, size_t len) {
+	if (!critic_markup_possible(d, start, len)) {
+		// Nearly all documents have no CriticMarkup
+		return;
+	}
+
+#ifdef kUseObjectPool
+	// Use a private pool so that this is safe to call on any thread
+	pool * p = pool_new(sizeof(token));
+	struct pool * previous_pool = token_pool_swap(p);
+#endif
+
 	token * t = critic_parse_substring(d->str, start, len);
+	cut_list cuts = {0};
 
 	if (t && t->child) {
-		reject_token_tree(d, t->child->tail);
+		reject_token_tree(&cuts, t->child->tail);
 	}
 
 	token_free(t);
 
+	cut_list_apply(&cuts, d);
+
+#ifdef kUseObjectPool
+	token_pool_swap(previous_pool);
+	pool_free(p);
+#endif
+
 }
 
 
@@ -417,6 +602,23 @@ void Test_critic(CuTest * tc) {
 	mmd_critic_markup_reject(test);
 	CuAssertStrEquals(tc, "", test->str);
 
+	d_string_erase(test, 0, -1);
+	d_string_append(test, "{++foo++} {~~bar~>baz~~}");
+	mmd_critic_markup_accept_range(test, 10, 15);
+	CuAssertStrEquals(tc, "{++foo++} baz", test->str);
+	CuAssertIntEquals(tc, 13, test->currentStringLength);
+
+	d_string_free(test, true);
+
+	// Borrowed storage is left alone
+	char text[] = "a{--b--}c{++d++}";
+	test = d_string_new_borrowed(text, strlen(text));
+	mmd_critic_markup_reject(test);
+	CuAssertStrEquals(tc, "abc", test->str);
+	CuAssertStrEquals(tc, "a{--b--}c{++d++}", text);
+
+	d_string_free(test, true);
+
 #ifdef kUseObjectPool
 	// Decrement counter and clean up token pool
 	token_pool_drain();
@@ -64,6 +64,7 @@
 #include <stdarg.h>
 
 #include "d_string.h"
+#include "thread.h"
 
 #ifdef TEST
 	#include "CuTest.h"
@@ -130,8 +131,13 @@ DString * d_string_new(const char * startingString) {
 	size_t startingBufferSize = kStringBufferStartingSize;
 	size_t startingStringSize = strlen(startingString);
 
-	while (startingBufferSize < (startingStringSize + 1)) {
-		startingBufferSize *= kStringBufferGrowthMultiplier;
+	if (startingStringSize < kStringBufferShortSize) {
+		// Short strings don't need a full sized buffer
+		startingBufferSize = kStringBufferShortSize;
+	} else {
+		while (startingBufferSize < (startingStringSize + 1)) {
+			startingBufferSize *= kStringBufferGrowthMultiplier;
+		}
 	}
 
 	newString->str = malloc(startingBufferSize);
@@ -142,7 +148,7 @@ DString * d_string_new(const char * startingString) {
 	}
 
 	newString->currentStringBufferSize = startingBufferSize;
-	strncpy(newString->str, startingString, startingStringSize);
+	memcpy(newString->str, startingString, startingStringSize);
 	newString->str[startingStringSize] = '\0';
 	newString->currentStringLength = startingStringSize;
 
@@ -157,7 +163,7 @@ void Test_d_string_new(CuTest * tc) {
 	DString * result = d_string_new(test);
 
 	CuAssertIntEquals(tc, 3, result->currentStringLength);
-	CuAssertIntEquals(tc, kStringBufferStartingSize, result->currentStringBufferSize);
+	CuAssertIntEquals(tc, kStringBufferShortSize, result->currentStringBufferSize);
 	CuAssertStrEquals(tc, test, result->str);
 	CuAssertIntEquals(tc, '\0', result->str[strlen(test)]);
 
@@ -166,11 +172,90 @@ void Test_d_string_new(CuTest * tc) {
 	result = d_string_new(NULL);
 
 	CuAssertIntEquals(tc, 0, result->currentStringLength);
-	CuAssertIntEquals(tc, kStringBufferStartingSize, result->currentStringBufferSize);
+	CuAssertIntEquals(tc, kStringBufferShortSize, result->currentStringBufferSize);
 	CuAssertStrEquals(tc, "", result->str);
 	CuAssertIntEquals(tc, '\0', 0);
 
 	d_string_free(result, true);
+
+	// Callers may keep `str` itself when they keep the character data
+	result = d_string_new("foo");
+	d_string_append(result, "bar");
+	test = result->str;
+
+	CuAssertPtrEquals(tc, test, d_string_free(result, false));
+	CuAssertStrEquals(tc, "foobar", test);
+	test[0] = 'b';
+	CuAssertStrEquals(tc, "boobar", test);
+	free(test);
+
+	test = "0123456789012345678901234567890123456789";
+
+	result = d_string_new(test);
+
+	CuAssertIntEquals(tc, 40, result->currentStringLength);
+	CuAssertIntEquals(tc, kStringBufferStartingSize, result->currentStringBufferSize);
+	CuAssertStrEquals(tc, test, result->str);
+
+	d_string_free(result, true);
+}
+#endif
+
+
+/// Create a new dynamic string that borrows existing storage instead of
+/// copying it.  A private copy is made the first time the string is modified.
+DString * d_string_new_borrowed(const char * str, size_t len) {
+	DString * newString = malloc(sizeof(DString));
+
+	if (!newString) {
+		return NULL;
+	}
+
+	// A buffer size of 0 marks the storage as borrowed
+	newString->str = (char *) str;
+	newString->currentStringBufferSize = 0;
+	newString->currentStringLength = len;
+
+	return newString;
+}
+
+
+#ifdef TEST
+void Test_d_string_new_borrowed(CuTest * tc) {
+	char test[] = "foobar";
+
+	DString * result = d_string_new_borrowed(test, 6);
+
+	CuAssertPtrEquals(tc, test, result->str);
+	CuAssertIntEquals(tc, 6, result->currentStringLength);
+	CuAssertIntEquals(tc, 0, result->currentStringBufferSize);
+
+	d_string_erase(result, 0, 3);
+	CuAssertStrEquals(tc, "bar", result->str);
+	CuAssertStrEquals(tc, "foobar", test);
+	CuAssertIntEquals(tc, kStringBufferShortSize, result->currentStringBufferSize);
+
+	d_string_free(result, true);
+
+	result = d_string_new_borrowed(test, 6);
+
+	d_string_append(result, "baz");
+	CuAssertStrEquals(tc, "foobarbaz", result->str);
+	CuAssertStrEquals(tc, "foobar", test);
+
+	d_string_free(result, true);
+
+	// Freeing unmodified string must leave storage alone
+	result = d_string_new_borrowed(test, 6);
+	d_string_free(result, true);
+	CuAssertStrEquals(tc, "foobar", test);
+
+	// Keeping the character data gives the caller a copy it can free
+	result = d_string_new_borrowed(test, 6);
+	char * kept = d_string_free(result, false);
+	CuAssertTrue(tc, kept != test);
+	CuAssertStrEquals(tc, "foobar", kept);
+	free(kept);
 }
 #endif
 
@@ -184,11 +269,21 @@ char * d_string_free(DString * ripString, bool freeCharacterData) {
 	char * returnedString = ripString->str;
 
 	if (freeCharacterData) {
-		if (ripString->str != NULL) {
+		// Borrowed storage isn't ours to free
+		if ((ripString->str != NULL) && (ripString->currentStringBufferSize != 0)) {
 			free(ripString->str);
 		}
 
 		returnedString = NULL;
+	} else if ((ripString->str != NULL) && (ripString->currentStringBufferSize == 0)) {
+		// Caller gets to free() what we return, so hand back a copy of
+		// borrowed storage
+		returnedString = malloc(ripString->currentStringLength + 1);
+
+		if (returnedString) {
+			memcpy(returnedString, ripString->str, ripString->currentStringLength);
+			returnedString[ripString->currentStringLength] = '\0';
+		}
 	}
 
 	free(ripString);
@@ -197,6 +292,44 @@ char * d_string_free(DString * ripString, bool freeCharacterData) {
 }
 
 
+/// Number of times a buffer had to grow on this thread
+static kThreadLocal size_t string_reallocation_count = 0;
+
+
+/// How many string buffers have had to grow on the current thread
+size_t d_string_reallocations(void) {
+	return string_reallocation_count;
+}
+
+
+/// Move dynamic string into a buffer of the specified size
+static void resizeStringBuffer(DString * baseString, size_t newBufferSize) {
+	char * temp;
+
+	if (baseString->currentStringBufferSize == 0) {
+		// Borrowed storage -- we'll need a buffer of our own
+		temp = malloc(newBufferSize);
+
+		if (temp) {
+			memcpy(temp, baseString->str, baseString->currentStringLength);
+			temp[baseString->currentStringLength] = '\0';
+		}
+	} else {
+		temp = realloc(baseString->str, newBufferSize);
+	}
+
+	if (temp == NULL) {
+		/* realloc failed */
+		fprintf(stderr, "Error reallocating memory for d_string. Current buffer size %lu.\n", baseString->currentStringBufferSize);
+
+		exit(1);
+	}
+
+	baseString->str = temp;
+	baseString->currentStringBufferSize = newBufferSize;
+}
+
+
 /// Ensure that dynamic string has specified capacity
 static void ensureStringBufferCanHold(DString * baseString, size_t newStringSize) {
 	if (baseString) {
@@ -205,6 +338,14 @@ static void ensureStringBufferCanHold(DString * baseString, size_t newStringSize
 		if (newBufferSizeNeeded > baseString->currentStringBufferSize) {
 			size_t newBufferSize = baseString->currentStringBufferSize;
 
+			if ((newBufferSize == 0) && (newBufferSizeNeeded <= kStringBufferShortSize)) {
+				// Borrowed storage -- a short private copy will do
+				newBufferSize = kStringBufferShortSize;
+			} else if (newBufferSize < kStringBufferStartingSize) {
+				// Borrowed or short buffer -- grow to a full sized one
+				newBufferSize = kStringBufferStartingSize;
+			}
+
 			while (newBufferSizeNeeded > newBufferSize) {
 				if (newBufferSize > kStringBufferMaxIncrement) {
 					newBufferSize += kStringBufferMaxIncrement;
@@ -213,18 +354,9 @@ static void ensureStringBufferCanHold(DString * baseString, size_t newStringSize
 				}
 			}
 
-			char * temp;
-			temp = realloc(baseString->str, newBufferSize);
-
-			if (temp == NULL) {
-				/* realloc failed */
-				fprintf(stderr, "Error reallocating memory for d_string. Current buffer size %lu.\n", baseString->currentStringBufferSize);
-
-				exit(1);
-			}
+			resizeStringBuffer(baseString, newBufferSize);
 
-			baseString->str = temp;
-			baseString->currentStringBufferSize = newBufferSize;
+			string_reallocation_count++;
 		}
 	}
 }
@@ -259,6 +391,106 @@ void Test_ensureStringBufferCanHold(CuTest * tc) {
 #endif
 
 
+/// Make sure dynamic string can hold `len` bytes (plus '\0') without growing
+void d_string_reserve(DString * baseString, size_t len) {
+	if (baseString && (len + 1 > baseString->currentStringBufferSize)) {
+		// Size the buffer exactly, since the caller knows what is coming
+		resizeStringBuffer(baseString, len + 1);
+	}
+}
+
+
+#ifdef TEST
+void Test_d_string_reserve(CuTest * tc) {
+	char test[] = "foo";
+
+	DString * result = d_string_new(test);
+	size_t reallocations = d_string_reallocations();
+
+	d_string_reserve(result, 10);
+	CuAssertIntEquals(tc, kStringBufferShortSize, result->currentStringBufferSize);
+
+	d_string_reserve(result, 5000);
+	CuAssertIntEquals(tc, 5001, result->currentStringBufferSize);
+	CuAssertStrEquals(tc, "foo", result->str);
+
+	for (int i = 0; i < 4997; ++i) {
+		d_string_append_c(result, 'x');
+	}
+
+	CuAssertIntEquals(tc, 5000, result->currentStringLength);
+	CuAssertIntEquals(tc, 5001, result->currentStringBufferSize);
+	CuAssertIntEquals(tc, reallocations, d_string_reallocations());
+
+	d_string_free(result, true);
+
+	// Borrowed storage gets a private copy
+	result = d_string_new_borrowed(test, 3);
+
+	d_string_reserve(result, 100);
+	CuAssertIntEquals(tc, 101, result->currentStringBufferSize);
+	CuAssertStrEquals(tc, "foo", result->str);
+	CuAssertTrue(tc, result->str != test);
+
+	d_string_reserve(NULL, 100);
+
+	d_string_free(result, true);
+}
+#endif
+
+
+/// Replace the storage of dynamic string with a malloc'ed buffer, taking
+/// ownership of it.
+void d_string_adopt(DString * baseString, char * str, size_t len, size_t size) {
+	if (baseString) {
+		// Borrowed storage isn't ours to free
+		if ((baseString->str != NULL) && (baseString->currentStringBufferSize != 0)) {
+			free(baseString->str);
+		}
+
+		baseString->str = str;
+		baseString->currentStringLength = len;
+		baseString->currentStringBufferSize = size;
+	}
+}
+
+
+/// Exchange the contents of two dynamic strings
+void d_string_swap(DString * a, DString * b) {
+	if (a && b) {
+		DString temp = *a;
+		*a = *b;
+		*b = temp;
+	}
+}
+
+
+#ifdef TEST
+void Test_d_string_swap(CuTest * tc) {
+	DString * a = d_string_new("foo");
+	DString * b = d_string_new("0123456789012345678901234567890123456789");
+
+	d_string_swap(a, b);
+	CuAssertStrEquals(tc, "0123456789012345678901234567890123456789", a->str);
+	CuAssertStrEquals(tc, "foo", b->str);
+	CuAssertIntEquals(tc, kStringBufferShortSize, b->currentStringBufferSize);
+
+	d_string_free(a, true);
+
+	a = d_string_new("bar");
+
+	d_string_swap(a, b);
+	CuAssertStrEquals(tc, "foo", a->str);
+	CuAssertStrEquals(tc, "bar", b->str);
+
+	d_string_swap(NULL, b);
+
+	d_string_free(a, true);
+	d_string_free(b, true);
+}
+#endif
+
+
 /// Append null-terminated string to end of dynamic string
 void d_string_append(DString * baseString, const char * appendedString) {
 	if (baseString && appendedString) {
@@ -386,16 +618,32 @@ void Test_d_string_append_c_array(CuTest * tc) {
 void d_string_append_printf(DString * baseString, const char * format, ...) {
 	if (baseString && format) {
 		va_list args;
+		va_list retry;
 		va_start(args, format);
+		va_copy(retry, args);
 
-		char * formattedString = NULL;
-		vasprintf(&formattedString, format, args);
+		// Format straight into the spare capacity (never into borrowed storage)
+		size_t spare = 0;
 
-		if (formattedString != NULL) {
-			d_string_append(baseString, formattedString);
-			free(formattedString);
+		if (baseString->currentStringBufferSize > baseString->currentStringLength) {
+			spare = baseString->currentStringBufferSize - baseString->currentStringLength;
 		}
 
+		int bytes = vsnprintf(spare ? baseString->str + baseString->currentStringLength : NULL, spare, format, args);
+
+		if (bytes > 0) {
+			if ((size_t) bytes >= spare) {
+				// Didn't fit -- grow and try again
+				ensureStringBufferCanHold(baseString, baseString->currentStringLength + bytes);
+				vsnprintf(baseString->str + baseString->currentStringLength, bytes + 1, format, retry);
+			}
+
+			baseString->currentStringLength += bytes;
+		} else if (spare) {
+			baseString->str[baseString->currentStringLength] = '\0';
+		}
+
+		va_end(retry);
 		va_end(args);
 	}
 }
@@ -421,6 +669,21 @@ void Test_d_string_append_printf(CuTest * tc) {
 
 	d_string_append_printf(NULL, "foo");
 
+	// Output that doesn't fit in the spare capacity
+	d_string_append_printf(result, "%s%s", "01234567890123456789", "01234567890123456789");
+	CuAssertStrEquals(tc, "foo5bar70123456789012345678901234567890123456789", result->str);
+	CuAssertIntEquals(tc, 48, result->currentStringLength);
+
+	d_string_free(result, true);
+
+	// Borrowed storage must be left alone
+	char borrowed[] = "foo";
+	result = d_string_new_borrowed(borrowed, 3);
+
+	d_string_append_printf(result, "%d", 42);
+	CuAssertStrEquals(tc, "foo42", result->str);
+	CuAssertStrEquals(tc, "foo", borrowed);
+
 	d_string_free(result, true);
 }
 #endif
@@ -611,16 +874,30 @@ void Test_d_string_insert_c_array(CuTest * tc) {
 void d_string_insert_printf(DString * baseString, size_t pos, const char * format, ...) {
 	if (baseString && format) {
 		va_list args;
+		va_list measure;
 		va_start(args, format);
+		va_copy(measure, args);
+
+		int bytes = vsnprintf(NULL, 0, format, measure);
+
+		if (bytes > 0) {
+			if (pos > baseString->currentStringLength) {
+				pos = baseString->currentStringLength;
+			}
+
+			ensureStringBufferCanHold(baseString, baseString->currentStringLength + bytes);
 
-		char * formattedString = NULL;
-		vasprintf(&formattedString, format, args);
+			/* Shift following string to 'right', then format into the gap */
+			memmove(baseString->str + pos + bytes, baseString->str + pos, baseString->currentStringLength - pos + 1);
 
-		if (formattedString != NULL) {
-			d_string_insert(baseString, pos, formattedString);
-			free(formattedString);
+			char displaced = baseString->str[pos + bytes];
+			vsnprintf(baseString->str + pos, bytes + 1, format, args);
+			baseString->str[pos + bytes] = displaced;
+
+			baseString->currentStringLength += bytes;
 		}
 
+		va_end(measure);
 		va_end(args);
 	}
 }
@@ -654,6 +931,9 @@ void d_string_erase(DString * baseString, size_t pos, size_t len) {
 			return;
 		}
 
+		// Make sure we have our own copy before modifying it
+		ensureStringBufferCanHold(baseString, baseString->currentStringLength);
+
 		if ((pos + len) >= baseString->currentStringLength) {
 			len = -1;
 		}
@@ -786,9 +1066,10 @@ long d_string_replace_text_in_range(DString * d, size_t pos, size_t len, const c
 		char * match = strstr(&(d->str[pos]), original);
 
 		while (match && (match - d->str < stop)) {
+			// Erasing may move borrowed storage, so work from offsets
 			pos = match - d->str;
-			d_string_erase(d, match - d->str, len_o);
-			d_string_insert(d, match - d->str, replace);
+			d_string_erase(d, pos, len_o);
+			d_string_insert(d, pos, replace);
 
 			delta += change;
 			stop += change;
@@ -836,6 +1117,18 @@ void Test_d_string_replace_text_in_range(CuTest * tc) {
 	d_string_replace_text_in_range(NULL, 0, -1, "foo", NULL);
 
 	d_string_free(result, true);
+
+	// Borrowed storage is copied by the first change
+	char borrowed[] = "foobarfoobarfoo";
+	result = d_string_new_borrowed(borrowed, strlen(borrowed));
+
+	delta = d_string_replace_text_in_range(result, 0, -1, "foo", "zapz");
+	CuAssertIntEquals(tc, 18, result->currentStringLength);
+	CuAssertStrEquals(tc, "zapzbarzapzbarzapz", result->str);
+	CuAssertStrEquals(tc, "foobarfoobarfoo", borrowed);
+	CuAssertIntEquals(tc, delta, 3);
+
+	d_string_free(result, true);
 }
 #endif
 
@@ -72,10 +72,13 @@
  */
 
 
+#define kStringBufferShortSize 40		//!< Strings shorter than this start with a buffer this big
+
+
 /// Structure for dynamic string
 struct DString {
 	char * str;                             //!< Pointer to UTF-8 byte stream for string
-	unsigned long currentStringBufferSize;  //!< Size of buffer currently allocated
+	unsigned long currentStringBufferSize;  //!< Size of buffer currently allocated (0 if storage is borrowed)
 	unsigned long currentStringLength;      //!< Size of current string
 };
 
@@ -88,13 +91,48 @@ DString * d_string_new(
 );
 
 
-/// Free dynamic string
+/// Create a new dynamic string that borrows existing storage instead of
+/// copying it.  A private copy is made the first time the string is modified.
+/// `str[len]` must be '\0', and `str` must remain valid until the DString is
+/// freed or modified.
+DString * d_string_new_borrowed(
+	const char * str,                       //!< Existing storage (not copied)
+	size_t len                              //!< Length of string in bytes
+);
+
+
+/// Free dynamic string.  If the character data is kept, the returned pointer
+/// must be freed by the caller.
 char * d_string_free(
 	DString * ripString,                    //!< DString to be freed
 	bool freeCharacterData                  //!< Should the underlying str be freed as well?
 );
 
 
+/// Make sure dynamic string can hold `len` bytes (plus '\0') without growing
+void d_string_reserve(
+	DString * baseString,                   //!< DString to be resized
+	size_t len                              //!< Number of bytes that will be needed
+);
+
+
+/// Replace the storage of dynamic string with a malloc'ed buffer, taking
+/// ownership of it.  `size` (non-zero) is the number of bytes allocated.
+void d_string_adopt(
+	DString * baseString,                   //!< DString to be updated
+	char * str,                             //!< New storage
+	size_t len,                             //!< Length of string in bytes
+	size_t size                             //!< Size of allocated buffer
+);
+
+
+/// Exchange the contents of two dynamic strings
+void d_string_swap(
+	DString * a,                            //!< First DString
+	DString * b                             //!< Second DString
+);
+
+
 /// Append null-terminated string to end of dynamic string
 void d_string_append(
 	DString * baseString,                   //!< DString to be appended
@@ -117,7 +155,8 @@ void d_string_append_c_array(
 );
 
 
-/// Append to end of dynamic string using format specifier
+/// Append to end of dynamic string using format specifier.  Arguments must not
+/// point into the DString's own storage.
 void d_string_append_printf(
 	DString * baseString,                   //!< DString to be appended
 	const char * format,                    //!< Format specifier for appending
@@ -157,7 +196,8 @@ void d_string_insert_c_array(
 );
 
 
-/// Insert inside dynamic string using format specifier
+/// Insert inside dynamic string using format specifier.  Arguments must not
+/// point into the DString's own storage.
 void d_string_insert_printf(
 	DString * baseString,                   //!< DString to be appended
 	size_t pos,                             //!< Offset at which to insert string
@@ -192,4 +232,8 @@ long d_string_replace_text_in_range(
 	const char * replace
 );
 
+
+/// How many string buffers have had to grow on the current thread
+size_t d_string_reallocations(void);
+
 #endif
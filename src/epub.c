@@ -82,6 +82,7 @@
 #include "html.h"
 #include "i18n.h"
 #include "miniz.h"
+#include "mmd.h"
 #include "stack.h"
 #include "uuid.h"
 #include "writer.h"
@@ -149,7 +150,7 @@ char * epub_package_document(scratch_pad * scratch) {
 
 	if (m) {
 		print_const("<dc:identifier id=\"pub-id\">urn:uuid:");
-		mmd_print_string_html(out, m->value, false, false);
+		mmd_print_string_html(out, m->value, false);
 		print_const("</dc:identifier>\n");
 	} else {
 		print_const("<dc:identifier id=\"pub-id\">urn:uuid:");
@@ -165,7 +166,7 @@ char * epub_package_document(scratch_pad * scratch) {
 
 	if (m) {
 		print_const("<dc:title>");
-		mmd_print_string_html(out, m->value, false, false);
+		mmd_print_string_html(out, m->value, false);
 		print_const("</dc:title>\n");
 	} else {
 		print_const("<dc:title>Untitled</dc:title>\n");
@@ -176,7 +177,7 @@ char * epub_package_document(scratch_pad * scratch) {
 
 	if (m) {
 		print_const("<dc:creator>");
-		mmd_print_string_html(out, m->value, false, false);
+		mmd_print_string_html(out, m->value, false);
 		print_const("</dc:creator>\n");
 	}
 
@@ -186,7 +187,7 @@ char * epub_package_document(scratch_pad * scratch) {
 
 	if (m) {
 		print_const("<dc:language>");
-		mmd_print_string_html(out, m->value, false, false);
+		mmd_print_string_html(out, m->value, false);
 		print_const("</dc:language>\n");
 	} else {
 		switch (scratch->language) {
@@ -224,11 +225,17 @@ char * epub_package_document(scratch_pad * scratch) {
 
 	if (m) {
 		print_const("<meta property=\"dcterms:modified\">");
-		mmd_print_string_html(out, m->value, false, false);
+		mmd_print_string_html(out, m->value, false);
 		print_const("</meta>\n");
 	} else {
 		time_t t = time(NULL);
+#ifdef _WIN32
+		// Windows uses a separate buffer for each thread
 		struct tm * today = localtime(&t);
+#else
+		struct tm today_struct;
+		struct tm * today = localtime_r(&t, &today_struct);
+#endif
 
 		d_string_append_printf(out, "<meta property=\"dcterms:modified\">%d-%02d-%02d</meta>\n",
 							   today->tm_year + 1900, today->tm_mon + 1, today->tm_mday);
@@ -310,8 +317,13 @@ void epub_export_nav(DString * out, mmd_engine * e, scratch_pad * scratch) {
 
 	int old_label_counter = scratch->label_counter;
 
+	// Labels are built from temporary tokens, which belong to this engine
+	struct pool * previous_pool = mmd_engine_pool_enter(e);
+
 	epub_export_nav_entry(out, e->dstr->str, scratch, &counter, 0);
 
+	mmd_engine_pool_exit(previous_pool);
+
 	scratch->label_counter = old_label_counter;
 }
 
@@ -327,7 +339,7 @@ char * epub_nav(mmd_engine * e, scratch_pad * scratch) {
 	HASH_FIND_STR(scratch->meta_hash, "title", temp);
 
 	if (temp) {
-		mmd_print_string_html(out, temp->value, false, false);
+		mmd_print_string_html(out, temp->value, false);
 	} else {
 		print_const("Untitled");
 	}
@@ -571,14 +583,19 @@ DString * epub_create(DString * body, mmd_engine * e, const char * directory) {
 	scratch_pad_free(scratch);
 
 	// Finalize zip archive and extract data
-	free(result->str);
+	char * archive = NULL;
+	size_t archive_len = 0;
 
-	status = mz_zip_writer_finalize_heap_archive(&zip, (void **) & (result->str), (size_t *) & (result->currentStringLength));
+	status = mz_zip_writer_finalize_heap_archive(&zip, (void **) &archive, &archive_len);
 
 	if (!status) {
 		fprintf(stderr, "Error finalizing zip archive.\n");
+	} else {
+		d_string_adopt(result, archive, archive_len, archive_len);
 	}
 
+	mz_zip_writer_end(&zip);
+
 	return result;
 }
 
@@ -111,11 +111,38 @@
 
 #if defined(__WIN32)
 	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
 #endif
 
 #define kBUFFERSIZE 4096	// How many bytes to read at a time
 
 
+/// How many bytes of byte order marks are at the start of the buffer?
+static size_t bom_length(const char * str, size_t len) {
+	size_t offset = 0;
+
+	// UTF-8 BOM
+	if ((len >= 3) && (memcmp(str, "\xef\xbb\xbf", 3) == 0)) {
+		offset += 3;
+	}
+
+	// UTF-16 BOMs
+	if ((len >= offset + 2) && (memcmp(str + offset, "\xef\xff", 2) == 0)) {
+		offset += 2;
+	}
+
+	if ((len >= offset + 2) && (memcmp(str + offset, "\xff\xfe", 2) == 0)) {
+		offset += 2;
+	}
+
+	return offset;
+}
+
+
 /// Scan file into a DString
 DString * scan_file(const char * fname) {
 	/* Read from stdin and return a DString *
@@ -145,27 +172,138 @@ DString * scan_file(const char * fname) {
 
 	DString * buffer = d_string_new("");
 
+	// Skip BOM(s) in the first chunk rather than erasing them afterwards
+	if ((bytes = fread(chunk, 1, kBUFFERSIZE, file)) > 0) {
+		size_t offset = bom_length(chunk, bytes);
+		d_string_append_c_array(buffer, chunk + offset, bytes - offset);
+	}
+
 	while ((bytes = fread(chunk, 1, kBUFFERSIZE, file)) > 0) {
 		d_string_append_c_array(buffer, chunk, bytes);
 	}
 
-	// Strip UTF-8 BOM
-	if (strncmp(buffer->str, "\xef\xbb\xbf", 3) == 0) {
-		d_string_erase(buffer, 0, 3);
+	fclose(file);
+
+	return buffer;
+}
+
+
+/// Map file into memory for read-only access, falling back to scan_file()
+/// where that isn't possible
+mapped_file * mapped_file_open(const char * fname) {
+	mapped_file * m = calloc(1, sizeof(mapped_file));
+
+	if (!m) {
+		return NULL;
 	}
 
-	// Strip UTF-16 BOMs
-	if (strncmp(buffer->str, "\xef\xff", 2) == 0) {
-		d_string_erase(buffer, 0, 2);
+#if !defined(__WIN32)
+	int fd = open(fname, O_RDONLY);
+
+	if (fd == -1) {
+		free(m);
+		return NULL;
 	}
 
-	if (strncmp(buffer->str, "\xff\xfe", 2) == 0) {
-		d_string_erase(buffer, 0, 2);
+	struct stat st;
+
+	// Pipes, devices and empty files are read the old fashioned way
+	if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+		size_t size = (size_t) st.st_size;
+		size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+		// Reserve at least one byte past the end of the file so the text is
+		// always followed by '\0', even when the file fills its last page
+		m->map_size = ((size / page) + 1) * page;
+		m->map = mmap(NULL, m->map_size, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+		if (m->map != MAP_FAILED) {
+			if (mmap(m->map, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+				size_t offset = bom_length(m->map, size);
+
+				m->text = d_string_new_borrowed((char *) m->map + offset, size - offset);
+				m->map_dev = (unsigned long long) st.st_dev;
+				m->map_ino = (unsigned long long) st.st_ino;
+			} else {
+				munmap(m->map, m->map_size);
+			}
+		}
+
+		if (m->text == NULL) {
+			m->map = NULL;
+			m->map_size = 0;
+		}
 	}
 
-	fclose(file);
+	close(fd);
+#endif
 
-	return buffer;
+	if (m->text == NULL) {
+		m->text = scan_file(fname);
+
+		if (m->text == NULL) {
+			free(m);
+			return NULL;
+		}
+	}
+
+	return m;
+}
+
+
+/// Free mapped file, including any private copy of the text
+void mapped_file_close(mapped_file * m) {
+	if (m == NULL) {
+		return;
+	}
+
+	d_string_free(m->text, true);
+
+#if !defined(__WIN32)
+
+	if (m->map) {
+		munmap(m->map, m->map_size);
+	}
+
+#endif
+
+	free(m);
+}
+
+
+/// Copy text out of the mapping if the output file is the input file
+void mapped_file_prepare_overwrite(mapped_file * m, const char * output_path) {
+#if !defined(__WIN32)
+	struct stat st;
+
+	if ((m == NULL) || (m->map == NULL)) {
+		return;
+	}
+
+	if (stat(output_path, &st) != 0) {
+		// Output doesn't exist yet, so it can't be the input
+		return;
+	}
+
+	if (((unsigned long long) st.st_dev != m->map_dev) || ((unsigned long long) st.st_ino != m->map_ino)) {
+		return;
+	}
+
+	if (m->text->currentStringBufferSize == 0) {
+		// Text is still borrowed from the mapping
+		size_t len = m->text->currentStringLength;
+		char * copy = malloc(len + 1);
+
+		memcpy(copy, m->text->str, len);
+		copy[len] = '\0';
+
+		d_string_adopt(m->text, copy, len, len + 1);
+	}
+
+	munmap(m->map, m->map_size);
+	m->map = NULL;
+	m->map_size = 0;
+#endif
 }
 
 
@@ -106,6 +106,7 @@
 #define FILE_UTILITIES_MULTIMARKDOWN_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef TEST
 	#include "CuTest.h"
@@ -124,6 +125,33 @@ DString * scan_file(const char * fname);
 DString * stdin_buffer(void);
 
 
+/// Read-only view of a file's contents, mapped into memory where possible
+struct mapped_file {
+	DString *			text;				//!< Text after any BOM -- copied privately on first modification
+	void *				map;				//!< Start of mapping (NULL if file was read instead)
+	size_t				map_size;			//!< Size of mapping
+	unsigned long long	map_dev;			//!< Device of mapped file
+	unsigned long long	map_ino;			//!< Inode of mapped file
+};
+
+typedef struct mapped_file mapped_file;
+
+
+/// Map file into memory for read-only access, falling back to scan_file()
+/// where that isn't possible.  `text` is always followed by '\0'.
+mapped_file * mapped_file_open(const char * fname);
+
+
+/// Free mapped file, including any private copy of the text
+void mapped_file_close(mapped_file * m);
+
+
+/// Call before writing to `output_path`.  If that is the mapped file
+/// itself, the text is copied out of the mapping, since truncating a file
+/// that is still mapped would crash the next time the text is read.
+void mapped_file_prepare_overwrite(mapped_file * m, const char * output_path);
+
+
 /// Windows can use either `\` or `/` as a separator -- thanks to t-beckmann on github
 ///	for suggesting a fix for this.
 bool is_separator(char c);
@@ -94,10 +94,7 @@ static char * my_strdup(const char * source) {
 }
 
 
-// Use Knuth's pseudo random generator to obfuscate email addresses predictably
-long ran_num_next(void);
-
-void mmd_print_char_html(DString * out, char c, bool obfuscate, bool line_breaks) {
+void mmd_print_char_html(DString * out, char c, bool line_breaks) {
 	switch (c) {
 		case '"':
 			print_const("&quot;");
@@ -126,25 +123,38 @@ void mmd_print_char_html(DString * out, char c, bool obfuscate, bool line_breaks
 			break;
 
 		default:
-			if (obfuscate && ((int) c == (((int) c) & 127))) {
-				if (ran_num_next() % 2 == 0) {
-					printf("&#%d;", (int) c);
-				} else {
-					printf("&#x%x;", (unsigned int) c);
-				}
-			} else {
-				print_char(c);
-			}
-
+			print_char(c);
 			break;
 	}
 }
 
 
-void mmd_print_string_html(DString * out, const char * str, bool obfuscate, bool line_breaks) {
+void mmd_print_string_html(DString * out, const char * str, bool line_breaks) {
+	if (str) {
+		while (*str != '\0') {
+			mmd_print_char_html(out, *str, line_breaks);
+
+			str++;
+		}
+	}
+}
+
+
+// Obfuscate email addresses with a mix of decimal and hex entities.  The
+// choice comes from the scratch pad, so output is repeatable and documents
+// exported on separate threads don't share any state.
+static void mmd_print_email_html(DString * out, const char * str, scratch_pad * scratch) {
 	if (str) {
 		while (*str != '\0') {
-			mmd_print_char_html(out, *str, obfuscate, line_breaks);
+			if ((int) * str == (((int) * str) & 127)) {
+				if (random_label_number(scratch->random_seed_base + scratch->obfuscate_counter++) % 2 == 0) {
+					printf("&#%d;", (int) * str);
+				} else {
+					printf("&#x%x;", (unsigned int) * str);
+				}
+			} else {
+				print_char(*str);
+			}
 
 			str++;
 		}
@@ -289,7 +299,7 @@ void mmd_export_link_html(DString * out, const char * source, token * text, link
 
 	if (link->url) {
 		print_const("<a href=\"");
-		mmd_print_string_html(out, link->url, false, false);
+		mmd_print_string_html(out, link->url, false);
 		print_const("\"");
 	} else {
 		print_const("<a href=\"\"");
@@ -297,7 +307,7 @@ void mmd_export_link_html(DString * out, const char * source, token * text, link
 
 	if (link->title && link->title[0] != '\0') {
 		print_const(" title=\"");
-		mmd_print_string_html(out, link->title, false, false);
+		mmd_print_string_html(out, link->title, false);
 		print_const("\"");
 	}
 
@@ -540,7 +550,7 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 	token *	temp_token	= NULL;
 	footnote * temp_note = NULL;
 
-	t->out_start = out->currentStringLength;
+	t->out_start = scratch->out_flushed + out->currentStringLength;
 
 	switch (t->type) {
 		case AMPERSAND:
@@ -849,8 +859,7 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 					temp_short = scratch->footnote_being_printed;
 
 					if (scratch->extensions & EXT_RANDOM_FOOT) {
-						srand(scratch->random_seed_base + temp_short);
-						temp_short = rand() % 32000 + 1;
+						temp_short = random_label_number(scratch->random_seed_base + temp_short);
 					}
 
 					printf(" <a href=\"#fnref:%d\" title=\"%s\" class=\"reversefootnote\">&#160;&#8617;&#xfe0e;</a>", temp_short, LC("return to body"));
@@ -1154,7 +1163,10 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 			break;
 
 		case DOC_START_TOKEN:
+			// Output can be passed along to a sink between top level blocks
+			scratch->sink_depth = scratch->recurse_depth + 1;
 			mmd_export_token_tree_html(out, source, t->child, scratch);
+			scratch->sink_depth = -1;
 			break;
 
 		case ELLIPSIS:
@@ -1183,7 +1195,7 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 					(source[t->start + 1] == ' ')) {
 				print_const("&nbsp;");
 			} else {
-				mmd_print_char_html(out, source[t->start + 1], false, false);
+				mmd_print_char_html(out, source[t->start + 1], false);
 			}
 
 			break;
@@ -1371,18 +1383,19 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 				print_const("<a href=\"");
 
 				if (scan_email(temp_char)) {
-					temp_bool = true;
-
 					if (strncmp("mailto:", temp_char, 7) != 0) {
-						mmd_print_string_html(out, "mailto:", true, false);
+						mmd_print_email_html(out, "mailto:", scratch);
 					}
+
+					mmd_print_email_html(out, temp_char, scratch);
+					print_const("\">");
+					mmd_print_email_html(out, temp_char, scratch);
 				} else {
-					temp_bool = false;
+					mmd_print_string_html(out, temp_char, false);
+					print_const("\">");
+					mmd_print_string_html(out, temp_char, false);
 				}
 
-				mmd_print_string_html(out, temp_char, temp_bool, false);
-				print_const("\">");
-				mmd_print_string_html(out, temp_char, temp_bool, false);
 				print_const("</a>");
 			} else if (scan_html(&source[t->start])) {
 				print_token(t);
@@ -1483,7 +1496,7 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 					if (temp_short2 == scratch->used_abbreviations->size) {
 						// This is a re-use of a previously used note
 						print_const("<abbr title=\"");
-						mmd_print_string_html(out, temp_note->clean_text, false, false);
+						mmd_print_string_html(out, temp_note->clean_text, false);
 						print_const("\">");
 
 						if (t->child) {
@@ -1495,9 +1508,9 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 						print_const("</abbr>");
 					} else {
 						// This is the first time this note was used
-						mmd_print_string_html(out, temp_note->clean_text, false, false);
+						mmd_print_string_html(out, temp_note->clean_text, false);
 						print_const(" (<abbr title=\"");
-						mmd_print_string_html(out, temp_note->clean_text, false, false);
+						mmd_print_string_html(out, temp_note->clean_text, false);
 						print_const("\">");
 
 						if (t->child) {
@@ -1510,11 +1523,11 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 					}
 				} else {
 					// This is an inline definition (and therefore the first use)
-					mmd_print_string_html(out, temp_note->clean_text, false, false);
+					mmd_print_string_html(out, temp_note->clean_text, false);
 					print_const(" (<abbr title=\"");
-					mmd_print_string_html(out, temp_note->clean_text, false, false);
+					mmd_print_string_html(out, temp_note->clean_text, false);
 					print_const("\">");
-					mmd_print_string_html(out, temp_note->label_text, false, false);
+					mmd_print_string_html(out, temp_note->label_text, false);
 					print_const("</abbr>)");
 				}
 			} else {
@@ -1632,8 +1645,7 @@ parse_citation:
 					// This is a re-use of a previously used note
 
 					if (scratch->extensions & EXT_RANDOM_FOOT) {
-						srand(scratch->random_seed_base + temp_short);
-						temp_short3 = rand() % 32000 + 1;
+						temp_short3 = random_label_number(scratch->random_seed_base + temp_short);
 					} else {
 						temp_short3 = temp_short;
 					}
@@ -1644,8 +1656,7 @@ parse_citation:
 					// This is the first time this note was used
 
 					if (scratch->extensions & EXT_RANDOM_FOOT) {
-						srand(scratch->random_seed_base + temp_short);
-						temp_short3 = rand() % 32000 + 1;
+						temp_short3 = random_label_number(scratch->random_seed_base + temp_short);
 					} else {
 						temp_short3 = temp_short;
 					}
@@ -1692,7 +1703,7 @@ parse_citation:
 
 					printf("<a href=\"#gn:%d\" title=\"%s\" class=\"glossary\">",
 						   temp_short, LC("see glossary"));
-					mmd_print_string_html(out, temp_note->clean_text, false, true);
+					mmd_print_string_html(out, temp_note->clean_text, true);
 					print_const("</a>");
 				} else {
 					// This is the first time this note was used
@@ -1700,7 +1711,7 @@ parse_citation:
 
 					printf("<a href=\"#gn:%d\" id=\"gnref:%d\" title=\"%s\" class=\"glossary\">",
 						   temp_short, temp_short, LC("see glossary"));
-					mmd_print_string_html(out, temp_note->clean_text, false, true);
+					mmd_print_string_html(out, temp_note->clean_text, true);
 					print_const("</a>");
 				}
 			} else {
@@ -1715,7 +1726,7 @@ parse_citation:
 			temp_char2 = extract_metadata(scratch, temp_char);
 
 			if (temp_char2) {
-				mmd_print_string_html(out, temp_char2, false, true);
+				mmd_print_string_html(out, temp_char2, true);
 			} else {
 				mmd_export_token_tree_html(out, source, t->child, scratch);
 			}
@@ -2081,13 +2092,13 @@ parse_citation:
 			break;
 
 		default:
-			fprintf(stderr, "Unknown token type: %d (%lu:%lu)\n", t->type, t->start, t->len);
+			fprintf(stderr, "Unknown token type: %d (%lu:%lu)\n", t->type, (unsigned long) t->start, (unsigned long) t->len);
 			token_describe(t, source);
 			exit(0);
 			break;
 	}
 
-	t->out_len = out->currentStringLength - t->out_start;
+	t->out_len = scratch->out_flushed + out->currentStringLength - t->out_start;
 }
 
 
@@ -2100,6 +2111,10 @@ void mmd_export_token_tree_html(DString * out, const char * source, token * t, s
 
 	scratch->recurse_depth++;
 
+	if (scratch->recurse_depth > scratch->recurse_depth_max) {
+		scratch->recurse_depth_max = scratch->recurse_depth;
+	}
+
 	while (t != NULL) {
 		if (scratch->skip_token) {
 			scratch->skip_token--;
@@ -2108,6 +2123,10 @@ void mmd_export_token_tree_html(DString * out, const char * source, token * t, s
 		}
 
 		t = t->next;
+
+		if (scratch->recurse_depth == scratch->sink_depth) {
+			mmd_export_flush(out, scratch, false);
+		}
 	}
 
 	scratch->recurse_depth--;
@@ -2167,7 +2186,7 @@ void mmd_export_token_html_raw(DString * out, const char * source, token * t, sc
 
 			if (t->next && t->next->type == TEXT_EMPTY && source[t->start + 1] == ' ') {
 			} else {
-				mmd_print_char_html(out, source[t->start + 1], false, false);
+				mmd_print_char_html(out, source[t->start + 1], false);
 			}
 
 			break;
@@ -2272,7 +2291,7 @@ void mmd_export_token_html_raw(DString * out, const char * source, token * t, sc
 			break;
 	}
 
-	t->out_len = out->currentStringLength - t->out_start;
+	t->out_len = scratch->out_flushed + out->currentStringLength - t->out_start;
 }
 
 
@@ -2377,10 +2396,10 @@ void mmd_start_complete_html(DString * out, const char * source, scratch_pad * s
 				store_asset(scratch, m->value);
 				asset * a = extract_asset(scratch, m->value);
 
-				mmd_print_string_html(out, "assets/", false, false);
-				mmd_print_string_html(out, a->asset_path, false, false);
+				mmd_print_string_html(out, "assets/", false);
+				mmd_print_string_html(out, a->asset_path, false);
 			} else {
-				mmd_print_string_html(out, m->value, false, false);
+				mmd_print_string_html(out, m->value, false);
 			}
 
 			print_const("\"/>\n");
@@ -2404,7 +2423,7 @@ void mmd_start_complete_html(DString * out, const char * source, scratch_pad * s
 		} else if (strcmp(m->key, "quoteslanguage") == 0) {
 		} else if (strcmp(m->key, "title") == 0) {
 			print_const("\t<title>");
-			mmd_print_string_html(out, m->value, false, true);
+			mmd_print_string_html(out, m->value, true);
 			print_const("</title>\n");
 		} else if (strcmp(m->key, "transcludebase") == 0) {
 		} else if (strcmp(m->key, "xhtmlheader") == 0) {
@@ -2413,9 +2432,9 @@ void mmd_start_complete_html(DString * out, const char * source, scratch_pad * s
 		} else if (strcmp(m->key, "xhtmlheaderlevel") == 0) {
 		} else {
 			print_const("\t<meta name=\"");
-			mmd_print_string_html(out, m->key, false, false);
+			mmd_print_string_html(out, m->key, false);
 			print_const("\" content=\"");
-			mmd_print_string_html(out, m->value, false, false);
+			mmd_print_string_html(out, m->value, false);
 			print_const("\"/>\n");
 		}
 	}
@@ -2534,7 +2553,7 @@ void mmd_export_glossary_list_html(DString * out, const char * source, scratch_p
 			content = note->content;
 
 			// Print term
-			mmd_print_string_html(out, note->clean_text, false, true);
+			mmd_print_string_html(out, note->clean_text, true);
 			print_const(": ");
 
 			// Print contents
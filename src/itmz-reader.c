@@ -346,13 +346,9 @@ void parse_itmz_token_chain(mmd_engine * e, token * chain) {
 		// Append body to metadata
 		d_string_append_c_array(metadata, final->str, final->currentStringLength);
 
-		// TODO: How to safely swap the new text, given that we might not own e->dstr->str?
-
-		free(e->dstr->str);
-		e->dstr->str = metadata->str;
-		e->dstr->currentStringLength = metadata->currentStringLength;
-
-		d_string_free(metadata, false);
+		// Swap in the new text
+		size_t new_len = metadata->currentStringLength;
+		d_string_adopt(e->dstr, d_string_free(metadata, false), new_len, new_len + 1);
 		d_string_free(final, true);
 	} else {
 		// Unsuccessful parse -- free token chain
@@ -373,15 +369,16 @@ void mmd_convert_itmz_string(mmd_engine * e, size_t start, size_t len) {
 	mz_bool status = unzip_file_from_data(e->dstr->str, e->dstr->currentStringLength, "mapdata.xml", text);
 
 	if (status) {
-		free(e->dstr->str);
-		e->dstr->str = text->str;
-		e->dstr->currentStringLength = text->currentStringLength;
-
-		d_string_free(text, false);
+		size_t new_len = text->currentStringLength;
+		d_string_adopt(e->dstr, d_string_free(text, false), new_len, new_len + 1);
 
 		// Now convert mapdata.xml -> MMD text
+		struct pool * previous_pool = mmd_engine_pool_enter(e);
+
 		token * chain = tokenize_itmz_string(e, 0, e->dstr->currentStringLength);
 		parse_itmz_token_chain(e, chain);
+
+		mmd_engine_pool_exit(previous_pool);
 	} else {
 		d_string_free(text, true);
 	}
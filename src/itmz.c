@@ -517,6 +517,10 @@ void mmd_export_token_tree_itmz(DString * out, const char * source, token * t, s
 
 	scratch->recurse_depth++;
 
+	if (scratch->recurse_depth > scratch->recurse_depth_max) {
+		scratch->recurse_depth_max = scratch->recurse_depth;
+	}
+
 	while (t != NULL) {
 		if (scratch->skip_token) {
 			scratch->skip_token--;
@@ -555,13 +559,18 @@ DString * itmz_create(DString * body, mmd_engine * e, const char * directory) {
 	}
 
 	// Finalize zip archive and extract data
-	free(result->str);
+	char * archive = NULL;
+	size_t archive_len = 0;
 
-	status = mz_zip_writer_finalize_heap_archive(&zip, (void **) & (result->str), (size_t *) & (result->currentStringLength));
+	status = mz_zip_writer_finalize_heap_archive(&zip, (void **) &archive, &archive_len);
 
 	if (!status) {
 		fprintf(stderr, "Error finalizing zip archive.\n");
+	} else {
+		d_string_adopt(result, archive, archive_len, archive_len);
 	}
 
+	mz_zip_writer_end(&zip);
+
 	return result;
 }
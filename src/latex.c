@@ -1057,7 +1057,10 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 			break;
 
 		case DOC_START_TOKEN:
+			// Output can be passed along to a sink between top level blocks
+			scratch->sink_depth = scratch->recurse_depth + 1;
 			mmd_export_token_tree_latex(out, source, t->child, scratch);
+			scratch->sink_depth = -1;
 			break;
 
 		case ELLIPSIS:
@@ -1917,7 +1920,7 @@ parse_citation:
 		case TABLE_CELL:
 			if (t->next && t->next->type == TABLE_DIVIDER) {
 				if (t->next->len > 1) {
-					printf("\\multicolumn{%lu}{", t->next->len);
+					printf("\\multicolumn{%lu}{", (unsigned long) t->next->len);
 
 					if (scratch->table_cell_count < kMaxTableColumns) {
 						switch (scratch->table_alignment[scratch->table_cell_count]) {
@@ -2052,6 +2055,10 @@ void mmd_export_token_tree_latex(DString * out, const char * source, token * t,
 
 	scratch->recurse_depth++;
 
+	if (scratch->recurse_depth > scratch->recurse_depth_max) {
+		scratch->recurse_depth_max = scratch->recurse_depth;
+	}
+
 	while (t != NULL) {
 		if (scratch->skip_token) {
 			scratch->skip_token--;
@@ -2060,6 +2067,10 @@ void mmd_export_token_tree_latex(DString * out, const char * source, token * t,
 		}
 
 		t = t->next;
+
+		if (scratch->recurse_depth == scratch->sink_depth) {
+			mmd_export_flush(out, scratch, false);
+		}
 	}
 
 	scratch->recurse_depth--;
@@ -54,10 +54,270 @@
 
 */
 
+#include <stdbool.h>
+#include <string.h>
+
 #include "lexer.h"
 #include "libMultiMarkdown.h"
 #include "parser.h"
 
+#ifdef TEST
+	#include "CuTest.h"
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+	#include <emmintrin.h>
+	#define kLexerUseSSE2
+#endif
+
+#ifdef __AVX2__
+	#include <immintrin.h>
+	#define kLexerUseAVX2
+#endif
+
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+
+
+/// Flags describing how the scanner treats each byte
+enum lexer_byte_flags {
+	LEXER_TOKEN_START	= 1 << 0,		//!< A token can start with this byte
+	LEXER_SPACE			= 1 << 1,		//!< ' ' only starts a token if followed by whitespace
+	LEXER_AFTER_SPACE	= 1 << 2,		//!< Bytes that can follow ' ' in a token
+};
+
+/// This must match the first state of the scanner below -- any byte not listed
+/// there is stepped over one at a time by the `*` rule.
+static const unsigned char lexer_byte_flags[256] = {
+	['\t']	= LEXER_TOKEN_START | LEXER_AFTER_SPACE,
+	['\n']	= LEXER_TOKEN_START | LEXER_AFTER_SPACE,
+	['\r']	= LEXER_TOKEN_START | LEXER_AFTER_SPACE,
+	[' ']	= LEXER_TOKEN_START | LEXER_SPACE | LEXER_AFTER_SPACE,
+	['!']	= LEXER_TOKEN_START,
+	['"']	= LEXER_TOKEN_START,
+	['#']	= LEXER_TOKEN_START,
+	['$']	= LEXER_TOKEN_START,
+	['%']	= LEXER_TOKEN_START,
+	['&']	= LEXER_TOKEN_START,
+	['\'']	= LEXER_TOKEN_START,
+	['(']	= LEXER_TOKEN_START,
+	[')']	= LEXER_TOKEN_START,
+	['*']	= LEXER_TOKEN_START,
+	['+']	= LEXER_TOKEN_START,
+	['-']	= LEXER_TOKEN_START,
+	['.']	= LEXER_TOKEN_START,
+	['/']	= LEXER_TOKEN_START,
+	['0']	= LEXER_TOKEN_START,
+	['1']	= LEXER_TOKEN_START,
+	['2']	= LEXER_TOKEN_START,
+	['3']	= LEXER_TOKEN_START,
+	['4']	= LEXER_TOKEN_START,
+	['5']	= LEXER_TOKEN_START,
+	['6']	= LEXER_TOKEN_START,
+	['7']	= LEXER_TOKEN_START,
+	['8']	= LEXER_TOKEN_START,
+	['9']	= LEXER_TOKEN_START,
+	[':']	= LEXER_TOKEN_START,
+	['<']	= LEXER_TOKEN_START,
+	['=']	= LEXER_TOKEN_START,
+	['>']	= LEXER_TOKEN_START,
+	['[']	= LEXER_TOKEN_START,
+	['\\']	= LEXER_TOKEN_START,
+	[']']	= LEXER_TOKEN_START,
+	['^']	= LEXER_TOKEN_START,
+	['_']	= LEXER_TOKEN_START,
+	['`']	= LEXER_TOKEN_START,
+	['{']	= LEXER_TOKEN_START,
+	['|']	= LEXER_TOKEN_START,
+	['}']	= LEXER_TOKEN_START,
+	['~']	= LEXER_TOKEN_START,
+	[0xC2]	= LEXER_TOKEN_START | LEXER_AFTER_SPACE,	// Non-breaking space
+	[0xEF]	= LEXER_TOKEN_START,						// Object replacement character
+};
+
+
+/// Is the byte at c certain to be skipped by the scanner?
+static inline bool lexer_byte_is_plain(const char * c) {
+	unsigned char flags = lexer_byte_flags[(unsigned char) c[0]];
+
+	if (flags & LEXER_SPACE) {
+		// The scanner also looks at the next byte (which may be the
+		// terminating '\0')
+		return !(lexer_byte_flags[(unsigned char) c[1]] & LEXER_AFTER_SPACE);
+	}
+
+	return !(flags & LEXER_TOKEN_START);
+}
+
+
+/// Skip plain text one byte at a time
+static const char * skip_plain_text_scalar(const char * cur, const char * stop) {
+	while ((cur < stop) && lexer_byte_is_plain(cur)) {
+		cur++;
+	}
+
+	return cur;
+}
+
+
+/// Index of lowest set bit (x must not be 0)
+static inline int lowest_bit(unsigned int x) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, x);
+	return (int) index;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+
+
+// The vector versions only need to recognize the common plain text bytes
+// (letters, commas, spaces between words, and most non-ASCII bytes).  Anything
+// else is checked with lexer_byte_is_plain().
+
+#ifdef kLexerUseAVX2
+/// Bitmask of which of the 32 bytes at cur are certainly plain text
+static inline unsigned int plain_text_mask_avx2(const char * cur) {
+	__m256i b = _mm256_loadu_si256((const __m256i *) cur);
+	__m256i next = _mm256_loadu_si256((const __m256i *)(cur + 1));
+
+	// Letters
+	__m256i letter = _mm256_sub_epi8(_mm256_or_si256(b, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	__m256i plain = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(25)), letter);
+
+	plain = _mm256_or_si256(plain, _mm256_cmpeq_epi8(b, _mm256_set1_epi8(',')));
+
+	// Non-ASCII, other than lead bytes that can start tokens
+	__m256i lead = _mm256_or_si256(_mm256_cmpeq_epi8(b, _mm256_set1_epi8((char) 0xC2)), _mm256_cmpeq_epi8(b, _mm256_set1_epi8((char) 0xEF)));
+	plain = _mm256_or_si256(plain, _mm256_andnot_si256(lead, _mm256_cmpgt_epi8(_mm256_setzero_si256(), b)));
+
+	// Spaces not followed by whitespace
+	__m256i follow = _mm256_or_si256(
+						 _mm256_or_si256(_mm256_cmpeq_epi8(next, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(next, _mm256_set1_epi8('\t'))),
+						 _mm256_or_si256(_mm256_cmpeq_epi8(next, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(next, _mm256_set1_epi8('\r'))));
+	follow = _mm256_or_si256(follow, _mm256_cmpeq_epi8(next, _mm256_set1_epi8((char) 0xC2)));
+	plain = _mm256_or_si256(plain, _mm256_andnot_si256(follow, _mm256_cmpeq_epi8(b, _mm256_set1_epi8(' '))));
+
+	return (unsigned int) _mm256_movemask_epi8(plain);
+}
+#endif
+
+
+#ifdef kLexerUseSSE2
+/// Bitmask of which of the 16 bytes at cur are certainly plain text
+static inline unsigned int plain_text_mask_sse2(const char * cur) {
+	__m128i b = _mm_loadu_si128((const __m128i *) cur);
+	__m128i next = _mm_loadu_si128((const __m128i *)(cur + 1));
+
+	// Letters
+	__m128i letter = _mm_sub_epi8(_mm_or_si128(b, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i plain = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(25)), letter);
+
+	plain = _mm_or_si128(plain, _mm_cmpeq_epi8(b, _mm_set1_epi8(',')));
+
+	// Non-ASCII, other than lead bytes that can start tokens
+	__m128i lead = _mm_or_si128(_mm_cmpeq_epi8(b, _mm_set1_epi8((char) 0xC2)), _mm_cmpeq_epi8(b, _mm_set1_epi8((char) 0xEF)));
+	plain = _mm_or_si128(plain, _mm_andnot_si128(lead, _mm_cmplt_epi8(b, _mm_setzero_si128())));
+
+	// Spaces not followed by whitespace
+	__m128i follow = _mm_or_si128(
+						 _mm_or_si128(_mm_cmpeq_epi8(next, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(next, _mm_set1_epi8('\t'))),
+						 _mm_or_si128(_mm_cmpeq_epi8(next, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(next, _mm_set1_epi8('\r'))));
+	follow = _mm_or_si128(follow, _mm_cmpeq_epi8(next, _mm_set1_epi8((char) 0xC2)));
+	plain = _mm_or_si128(plain, _mm_andnot_si128(follow, _mm_cmpeq_epi8(b, _mm_set1_epi8(' '))));
+
+	return (unsigned int) _mm_movemask_epi8(plain);
+}
+#endif
+
+
+/// Skip over bytes that can't start a token, rather than stepping through
+/// them one at a time with the scanner
+static const char * skip_plain_text(const char * cur, const char * stop) {
+	unsigned int mask;
+
+	// Vectors also read the byte after, so stop one short of the end
+#ifdef kLexerUseAVX2
+
+	while (stop - cur > 32) {
+		mask = plain_text_mask_avx2(cur);
+
+		if (mask == 0xFFFFFFFF) {
+			cur += 32;
+			continue;
+		}
+
+		cur += lowest_bit(~mask);
+
+		if (!lexer_byte_is_plain(cur)) {
+			return cur;
+		}
+
+		cur++;
+	}
+
+#endif
+
+#ifdef kLexerUseSSE2
+
+	while (stop - cur > 16) {
+		mask = plain_text_mask_sse2(cur);
+
+		if (mask == 0xFFFF) {
+			cur += 16;
+			continue;
+		}
+
+		cur += lowest_bit(~mask);
+
+		if (!lexer_byte_is_plain(cur)) {
+			return cur;
+		}
+
+		cur++;
+	}
+
+#endif
+
+	return skip_plain_text_scalar(cur, stop);
+}
+
+
+#ifdef TEST
+void Test_skip_plain_text(CuTest * tc) {
+	const char * test = "Plain text, with  some *tokens*, \xC3\xA0 and\xC2\xA0more.\n";
+	const char * stop = test + strlen(test);
+
+	CuAssertPtrEquals(tc, (void *) &test[16], (void *) skip_plain_text(test, stop));
+	CuAssertPtrEquals(tc, (void *) &test[23], (void *) skip_plain_text(&test[17], stop));
+	CuAssertPtrEquals(tc, (void *) &test[39], (void *) skip_plain_text(&test[31], stop));
+
+	// Vector and scalar versions must agree everywhere
+	char buffer[300];
+	const char * alphabet = "aZ,  \t\n\r*.1@;\xC2\xA0\xEF\xC3";
+	size_t count = strlen(alphabet);
+	unsigned int seed = 1;
+
+	for (int i = 0; i < 200; ++i) {
+		size_t len = i + 1;
+
+		for (size_t j = 0; j < len; ++j) {
+			seed = seed * 1103515245 + 12345;
+			// Mostly letters and spaces
+			buffer[j] = ((seed >> 16) % 4) ? alphabet[(seed >> 20) % 5] : alphabet[(seed >> 20) % count];
+		}
+
+		buffer[len] = '\0';
+
+		for (size_t j = 0; j < len; ++j) {
+			CuAssertPtrEquals(tc, (void *) skip_plain_text_scalar(&buffer[j], &buffer[len]), (void *) skip_plain_text(&buffer[j], &buffer[len]));
+		}
+	}
+}
+#endif
+
 
 // Basic scanner struct
 
@@ -70,6 +330,9 @@ int scan(Scanner * s, const char * stop) {
 
 scan:
 
+	// Skip plain text without running the scanner on each byte
+	s->cur = skip_plain_text(s->cur, stop);
+
 	if (s->cur >= stop) {
 		return 0;
 	}
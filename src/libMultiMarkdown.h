@@ -13,16 +13,14 @@
 
 	******IMPORTANT******
 
-	If you are using libMultiMarkdown in your own project, you need to either:
+	Tokens are allocated from an object pool owned by each `mmd_engine`, and
+	are released all at once when the engine is reset or freed.  Separate
+	engines can be used on separate threads at the same time.
 
-	1. Disable kUseObjectPool in `token.h`
-
-	2. Properly manage the `token_pool_init` and `token_pool_free` functions.
-
-
-	I recommend option #1, unless you absolutely need the best performance for
-	long documents.  Doing #2 properly is tricky in any program that can handle
-	multiple MMD text strings at overlapping times.
+	If you create tokens directly (outside of an engine), they come from a
+	fallback pool belonging to the calling thread.  Use `token_pool_init` and
+	`token_pool_free` on that thread to manage it, or disable kUseObjectPool
+	in `token.h`.
 
 **/
 
@@ -90,6 +88,50 @@ typedef struct mmd_engine mmd_engine;
 typedef struct stack stack;
 
 
+/// Callback that receives a chunk of exported output
+typedef void (*mmd_sink_write)(const char * data, size_t len, void * context);
+
+
+/// Destination for streaming output.  Output is buffered until at least
+/// `flush_threshold` bytes are available at the end of a top level block,
+/// and is then passed to `write`.
+struct mmd_sink {
+	mmd_sink_write		write;				//!< Called with each chunk of finished output
+	void 		*		context;			//!< Passed through to `write`
+	size_t				flush_threshold;	//!< Buffer at least this many bytes (0 to pass along each block)
+};
+
+typedef struct mmd_sink mmd_sink;
+
+
+/// Phases of parsing and exporting that are timed by mmd_stats
+enum mmd_stats_phases {
+	PHASE_TOKENIZE,				//!< Lexing source text into tokens
+	PHASE_PARSE_BLOCKS,			//!< Parsing lines into blocks
+	PHASE_AMBIDEXTROUS,			//!< Deciding which tokens can open/close pairs
+	PHASE_PAIR_TOKENS,			//!< Matching pairs of tokens, including emphasis and strong
+	PHASE_DEFINITIONS,			//!< Processing link, footnote, etc. definitions
+	PHASE_HEADERS,				//!< Processing headers as cross-reference targets
+	PHASE_TABLES,				//!< Processing tables as cross-reference targets
+	PHASE_SEARCH_TERMS,			//!< Processing metadata, abbreviations and glossary terms
+	PHASE_WRITER,				//!< Writing the output format
+	PHASE_COUNT
+};
+
+
+/// Where time and memory were spent during the most recent parse and export
+struct mmd_stats {
+	double				phase_time[PHASE_COUNT];	//!< Wall time spent in each phase (seconds)
+	size_t				tokens_allocated;			//!< Tokens allocated from the engine's pool
+	size_t				pool_slabs;					//!< Slabs allocated by the engine's pool
+	size_t				string_reallocations;		//!< DString buffers that had to grow
+	unsigned short		parse_depth_max;			//!< Deepest recursion while parsing (see kMaxParseRecursiveDepth)
+	unsigned short		export_depth_max;			//!< Deepest recursion while exporting (see kMaxExportRecursiveDepth)
+};
+
+typedef struct mmd_stats mmd_stats;
+
+
 /// There are 3 main versions of the primary functions:
 ///
 ///	* `mmd_string...` -- start from source text in c string
@@ -224,6 +266,17 @@ mmd_engine * mmd_engine_create_with_string(
 );
 
 
+/// Create MMD Engine that parses directly from read-only memory, e.g. a
+/// memory-mapped file (A copy is only made if the engine needs to modify the
+/// text).  `str[len]` must be '\0', and `str` must remain valid until the
+/// engine is freed.  Free with `mmd_engine_free(e, true)`.
+mmd_engine * mmd_engine_create_with_buffer(
+	const char *	str,
+	size_t			len,
+	unsigned long	extensions
+);
+
+
 /// Reset engine when finished parsing. (Usually not necessary to use this.)
 void mmd_engine_reset(mmd_engine * e);
 
@@ -254,10 +307,48 @@ token * mmd_engine_parse_substring(mmd_engine * e, size_t byte_start, size_t byt
 void mmd_engine_parse_string(mmd_engine * e);
 
 
+/// Replace `old_len` bytes of the source text at `start` with `new_text`, and
+/// update the token tree.  Where possible, only the top level blocks around
+/// the edit are re-parsed.  Exporting modifies the token tree, so the first
+/// edit after an export re-parses the whole document.
+void mmd_engine_apply_edit(mmd_engine * e, size_t start, size_t old_len, const char * new_text);
+
+
 /// Export parsed token tree to output format
 void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format);
 
 
+/// Export parsed token tree to output format, passing output to the sink as
+/// it is finished rather than holding the whole document in memory.
+/// Formats that are packaged afterwards (EPUB, ODT, etc.) receive the same
+/// text that mmd_engine_export_token_tree() would produce.
+void mmd_engine_export_token_tree_to_sink(mmd_sink * sink, mmd_engine * e, short format);
+
+
+/// Sink callback that writes to the `FILE *` passed as context
+void mmd_sink_write_to_file(const char * data, size_t len, void * context);
+
+
+/// Start (or stop) collecting mmd_stats for this engine.  Stats are reset
+/// each time the whole document is parsed, and include any later edits and
+/// exports.
+void mmd_engine_set_stats_enabled(mmd_engine * e, bool enabled);
+
+
+/// Parse very large documents on several threads (1 by default).  The
+/// document is split into chunks at empty lines between top level blocks, and
+/// the result is the same as parsing on one thread.
+void mmd_engine_set_parse_threads(mmd_engine * e, int threads);
+
+
+/// Stats for this engine, or NULL if they are not being collected
+const mmd_stats * mmd_engine_stats(mmd_engine * e);
+
+
+/// Name of a phase in mmd_stats, e.g. "tokenize"
+const char * mmd_stats_phase_name(short phase);
+
+
 /// Convert MMD text to specified format, with specified extensions, and language
 /// Returned char * must be freed
 char * mmd_engine_convert(mmd_engine * e, short format);
@@ -325,6 +416,19 @@ DString * scan_file(const char * fname);
 void mmd_transclude_source(DString * source, const char * search_path, const char * source_path, short format, struct stack * parsed, struct stack * manifest);
 
 
+/// Keep transcluded files in memory, and share them between all documents
+/// transcluded until the cache is cleared (e.g. when converting many files
+/// that include the same fragments).  Cached files are read again if their
+/// size or modification time changes.
+void mmd_transclusion_cache_enable(bool enable);
+
+
+/// Free all cached transcluded files, and stop the threads used to read
+/// transcluded files -- must not be called while transclusion is in
+/// progress on another thread
+void mmd_transclusion_cache_clear(void);
+
+
 /// If MMD Header metadata used, insert it into appropriate place
 void mmd_prepend_mmd_header(DString * source);
 
@@ -54,6 +54,7 @@
 */
 
 #include <ctype.h>
+#include <errno.h>
 #include <libgen.h>
 #include <limits.h>
 #include <stdio.h>
@@ -66,6 +67,7 @@
 #include "file.h"
 #include "i18n.h"
 #include "libMultiMarkdown.h"
+#include "thread.h"
 #include "token.h"
 #include "uuid.h"
 #include "version.h"
@@ -73,11 +75,16 @@
 
 #define kBUFFERSIZE 4096	// How many bytes to read at a time
 
+#define kOutputFlushThreshold (64 * 1024)	// Buffer this much output before writing
+
+#define kBatchThreadStackSize (8 * 1024 * 1024)	// Secondary threads need room for deeply nested documents
+
 // argtable structs
 struct arg_lit * a_help, * a_version, * a_compatibility, * a_nolabels, * a_batch,
 		   * a_accept, * a_reject, * a_full, * a_snippet, * a_random, * a_unique, * a_meta,
-		   * a_notransclude, * a_nosmart, * a_opml, * a_itmz;
+		   * a_notransclude, * a_nosmart, * a_opml, * a_itmz, * a_stats;
 struct arg_str * a_format, * a_lang, * a_extract;
+struct arg_int * a_jobs;
 struct arg_file * a_file, * a_o;
 struct arg_end * a_end;
 struct arg_rem * a_rem1, * a_rem2, * a_rem3, * a_rem4, * a_rem5, * a_rem6;
@@ -129,6 +136,318 @@ char * filename_with_extension(const char * original, const char * new_extension
 }
 
 
+/// Settings shared by all files in batch mode
+struct batch_options {
+	unsigned long			extensions;
+	short					format;
+	short					language;
+	bool					list_keys;			//!< List metadata keys instead of converting
+	const char 		*		extract_key;		//!< Extract metadata value instead of converting
+};
+
+typedef struct batch_options batch_options;
+
+
+/// A single file to be processed in batch mode
+struct batch_file {
+	char 			*		input;				//!< Path to read source text from
+	const char 		*		source_path;		//!< Path used to resolve transclusions
+	char 			*		folder;				//!< Directory used to resolve transclusions
+	char 			*		output_filename;	//!< Path to write output to
+	DString 		*		stdout_text;		//!< Text to be sent to stdout (e.g. metadata)
+	bool					read_failed;		//!< Could not read input file
+	int						write_errno;		//!< Could not write output file
+};
+
+typedef struct batch_file batch_file;
+
+
+/// Queue of files shared by batch worker threads
+struct batch_queue {
+	batch_file 		*		files;
+	int						count;
+	int						next;				//!< Next file to be claimed by a worker
+	const batch_options *	options;
+	mmd_mutex			lock;
+};
+
+typedef struct batch_queue batch_queue;
+
+
+/// File extension used for output in batch mode
+static const char * batch_output_extension(short format) {
+	switch (format) {
+		case FORMAT_LATEX:
+		case FORMAT_BEAMER:
+		case FORMAT_MEMOIR:
+			return ".tex";
+
+		case FORMAT_FODT:
+			return ".fodt";
+
+		case FORMAT_ODT:
+			return ".odt";
+
+		case FORMAT_MMD:
+			return ".mmdtext";
+
+		case FORMAT_EPUB:
+			return ".epub";
+
+		case FORMAT_TEXTBUNDLE:
+			return ".textbundle";
+
+		case FORMAT_TEXTBUNDLE_COMPRESSED:
+			return ".textpack";
+
+		case FORMAT_OPML:
+			return ".opml";
+
+		case FORMAT_ITMZ:
+			return ".itmz";
+
+		case FORMAT_HTML:
+		default:
+			return ".html";
+	}
+}
+
+
+/// Can this format be written out as it is exported, or does it need to be
+/// packaged first?  Only packaging uses the source directory (to find files
+/// to embed), so formats that stream must never need it.
+static bool format_can_stream(short format) {
+	switch (format) {
+		case FORMAT_HTML:
+		case FORMAT_LATEX:
+		case FORMAT_BEAMER:
+		case FORMAT_MEMOIR:
+		case FORMAT_OPML:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+
+/// Print where time was spent converting a file
+static void print_stats(const mmd_stats * stats, const char * label) {
+	DString * report = d_string_new("");
+	double total = 0;
+
+	if (label) {
+		d_string_append_printf(report, "%s:\n", label);
+	}
+
+	for (short i = 0; i < PHASE_COUNT; ++i) {
+		d_string_append_printf(report, "\t%-22s %10.3f ms\n", mmd_stats_phase_name(i), stats->phase_time[i] * 1000);
+		total += stats->phase_time[i];
+	}
+
+	d_string_append_printf(report, "\t%-22s %10.3f ms\n", "total", total * 1000);
+	d_string_append_printf(report, "\t%-22s %10lu\n", "tokens allocated", (unsigned long) stats->tokens_allocated);
+	d_string_append_printf(report, "\t%-22s %10lu\n", "pool slabs", (unsigned long) stats->pool_slabs);
+	d_string_append_printf(report, "\t%-22s %10lu\n", "string reallocations", (unsigned long) stats->string_reallocations);
+	d_string_append_printf(report, "\t%-22s %10u\n", "max parse depth", stats->parse_depth_max);
+	d_string_append_printf(report, "\t%-22s %10u\n", "max export depth", stats->export_depth_max);
+
+	// Write at once, so that reports from batch threads aren't interleaved
+	fputs(report->str, stderr);
+
+	d_string_free(report, true);
+}
+
+
+/// Convert source and write the results to output_stream
+static void convert_to_stream(DString * source, unsigned long extensions, short format, short language, const char * directory, FILE * output_stream, const char * label, int parse_threads) {
+	mmd_engine * e = mmd_engine_create_with_dstring(source, extensions);
+
+	mmd_engine_set_language(e, language);
+	mmd_engine_set_parse_threads(e, parse_threads);
+	mmd_engine_set_stats_enabled(e, a_stats->count > 0);
+
+	if (format_can_stream(format)) {
+		// Write output as each block is finished, rather than all at once.
+		// `directory` isn't needed -- mmd_engine_convert_to_data() would
+		// only pass it to the packaging step these formats don't have.
+		mmd_engine_parse_string(e);
+
+		mmd_sink sink = {
+			.write = mmd_sink_write_to_file,
+			.context = output_stream,
+			.flush_threshold = kOutputFlushThreshold,
+		};
+
+		mmd_engine_export_token_tree_to_sink(&sink, e, format);
+		fputc('\n', output_stream);
+	} else {
+		DString * result = mmd_engine_convert_to_data(e, format, directory);
+
+		fwrite(result->str, result->currentStringLength, 1, output_stream);
+
+		d_string_free(result, true);
+	}
+
+	if (mmd_engine_stats(e)) {
+		print_stats(mmd_engine_stats(e), label);
+	}
+
+	mmd_engine_free(e, false);
+}
+
+
+/// Process a single file in batch mode.  Results that need to be reported
+/// are stored in the batch_file so that they can be output in order.
+static void batch_process_file(batch_file * f, const batch_options * o) {
+	char * char_result;
+	DString * result;
+	FILE * output_stream;
+
+	mapped_file * input = mapped_file_open(f->input);
+
+	if (input == NULL) {
+		f->read_failed = true;
+		return;
+	}
+
+	// Source is copied only if something needs to modify it
+	DString * buffer = input->text;
+
+	if (!(o->extensions & EXT_COMPATIBILITY)) {
+		mmd_prepend_mmd_header(buffer);
+		mmd_append_mmd_footer(buffer);
+	}
+
+	// Perform transclusion(s)
+	if (o->extensions & EXT_TRANSCLUDE) {
+		mmd_transclude_source(buffer, f->folder, f->source_path, o->format, NULL, NULL);
+	}
+
+	// Perform block level CriticMarkup?
+	if (o->extensions & EXT_CRITIC_ACCEPT) {
+		mmd_critic_markup_accept(buffer);
+	}
+
+	if (o->extensions & EXT_CRITIC_REJECT) {
+		mmd_critic_markup_reject(buffer);
+	}
+
+	if (o->list_keys) {
+		// List metadata keys
+		char_result = mmd_d_string_metadata_keys(buffer);
+
+		if (char_result) {
+			f->stdout_text = d_string_new(char_result);
+
+			free(char_result);
+		}
+	} else if (o->extract_key) {
+		// Extract metadata key
+		char_result = mmd_d_string_metavalue_for_key(buffer, o->extract_key);
+
+		if (char_result) {
+			f->stdout_text = d_string_new(char_result);
+			d_string_append_c(f->stdout_text, '\n');
+
+			free(char_result);
+		}
+	} else {
+		// Regular processing
+		if (FORMAT_TEXTBUNDLE == o->format) {
+			result = mmd_d_string_convert_to_data(buffer, o->extensions, o->format, o->language, f->folder);
+
+			unzip_data_to_path(result->str, result->currentStringLength, f->output_filename);
+
+			d_string_free(result, true);
+		} else {
+			// Output may be the input file
+			mapped_file_prepare_overwrite(input, f->output_filename);
+
+			if (!(output_stream = fopen(f->output_filename, "wb"))) {
+				// Failed to open file
+				f->write_errno = errno;
+			} else {
+				convert_to_stream(buffer, o->extensions, o->format, o->language, f->folder, output_stream, f->input, 1);
+				fclose(output_stream);
+			}
+		}
+	}
+
+	mapped_file_close(input);
+}
+
+
+/// Worker thread -- process files from the queue until none are left
+static void * batch_worker(void * arg) {
+	batch_queue * q = arg;
+	int i;
+
+	while (true) {
+		mmd_mutex_lock(&q->lock);
+		i = q->next++;
+		mmd_mutex_unlock(&q->lock);
+
+		if (i >= q->count) {
+			break;
+		}
+
+		batch_process_file(&q->files[i], q->options);
+	}
+
+	return NULL;
+}
+
+
+/// Process files in the queue using the specified number of threads
+static void batch_run(batch_queue * q, int jobs) {
+	if (jobs > q->count) {
+		jobs = q->count;
+	}
+
+	if (jobs <= 1) {
+		// No need for extra threads
+		batch_worker(q);
+		return;
+	}
+
+	mmd_thread * threads = malloc(sizeof(mmd_thread) * jobs);
+	int started = 0;
+
+	for (int i = 0; i < jobs; ++i) {
+		if (mmd_thread_create(&threads[started], kBatchThreadStackSize, batch_worker, q)) {
+			started++;
+		}
+	}
+
+	if (started == 0) {
+		// Couldn't create threads, so do the work ourselves
+		batch_worker(q);
+	}
+
+	for (int i = 0; i < started; ++i) {
+		mmd_thread_join(threads[i]);
+	}
+
+	free(threads);
+}
+
+
+/// How many files should be processed at once?
+static int batch_job_count(void) {
+	if (a_jobs->count == 0) {
+		return 1;
+	}
+
+	if (a_jobs->ival[0] > 0) {
+		return a_jobs->ival[0];
+	}
+
+	// Use one thread per processor
+	return mmd_processor_count();
+}
+
+
 int main(int argc, char ** argv) {
 	int exitcode = EXIT_SUCCESS;
 	char * binname = "multimarkdown";
@@ -143,6 +462,7 @@ int main(int argc, char ** argv) {
 		a_rem1			= arg_rem("", ""),
 
 		a_batch			= arg_lit0("b", "batch", "process each file separately"),
+		a_jobs			= arg_int0("j", "jobs", "N", "use N threads, for files in batch mode or to parse one large file (0 = one per CPU)"),
 		a_full			= arg_lit0("f", "full", "force a complete document"),
 		a_snippet		= arg_lit0("s", "snippet", "force a snippet"),
 		a_compatibility	= arg_lit0("c", "compatibility", "Markdown compatibility mode"),
@@ -153,6 +473,7 @@ int main(int argc, char ** argv) {
 		a_notransclude	= arg_lit0(NULL, "notransclude", "Disable file transclusion"),
 		a_opml			= arg_lit0(NULL, "opml", "Convert OPML source to plain text before processing"),
 		a_itmz			= arg_lit0(NULL, "itmz", "Convert ITMZ (iThoughts) source to plain text before processing"),
+		a_stats			= arg_lit0(NULL, "stats", "Report time spent in each phase to stderr"),
 
 		a_rem2			= arg_rem("", ""),
 
@@ -326,15 +647,9 @@ int main(int argc, char ** argv) {
 	}
 
 	DString * buffer = NULL;
-	DString * result = NULL;
+	mapped_file * input = NULL;
 	char * char_result = NULL;
 	FILE * output_stream;
-	char * output_filename;
-
-	// Increment counter and prepare token pool
-#ifdef kUseObjectPool
-	token_pool_init();
-#endif
 
 	// Seed random numbers
 	custom_seed_rand();
@@ -343,147 +658,89 @@ int main(int argc, char ** argv) {
 
 	if ((a_batch->count) && (a_file->count)) {
 		// Batch process 1 or more files
+		batch_options options = {
+			.extensions = extensions,
+			.format = format,
+			.language = language,
+			.list_keys = (a_meta->count > 0),
+			.extract_key = (a_extract->count > 0) ? a_extract->sval[0] : NULL,
+		};
+
+		batch_queue queue = {
+			.files = calloc(a_file->count, sizeof(batch_file)),
+			.count = a_file->count,
+			.next = 0,
+			.options = &options,
+		};
+
+		mmd_mutex_init(&queue.lock);
+
+		// Prepare paths up front, since dirname() is not thread safe
 		for (int i = 0; i < a_file->count; ++i) {
+			batch_file * f = &queue.files[i];
 
-			buffer = scan_file(a_file->filename[i]);
-
-			if (buffer == NULL) {
-				fprintf(stderr, "Error reading file '%s'\n", a_file->filename[i]);
-				exitcode = 1;
-				goto exit2;
-			}
+			f->input = my_strdup(a_file->filename[i]);
 
 			// Append output file extension
-			switch (format) {
-				case FORMAT_HTML:
-					output_filename = filename_with_extension(a_file->filename[i], ".html");
-					break;
-
-				case FORMAT_LATEX:
-				case FORMAT_BEAMER:
-				case FORMAT_MEMOIR:
-					output_filename = filename_with_extension(a_file->filename[i], ".tex");
-					break;
-
-				case FORMAT_FODT:
-					output_filename = filename_with_extension(a_file->filename[i], ".fodt");
-					break;
-
-				case FORMAT_ODT:
-					output_filename = filename_with_extension(a_file->filename[i], ".odt");
-					break;
-
-				case FORMAT_MMD:
-					output_filename = filename_with_extension(a_file->filename[i], ".mmdtext");
-					break;
-
-				case FORMAT_EPUB:
-					output_filename = filename_with_extension(a_file->filename[i], ".epub");
-					break;
-
-				case FORMAT_TEXTBUNDLE:
-					output_filename = filename_with_extension(a_file->filename[i], ".textbundle");
-					break;
-
-				case FORMAT_TEXTBUNDLE_COMPRESSED:
-					output_filename = filename_with_extension(a_file->filename[i], ".textpack");
-					break;
-
-				case FORMAT_OPML:
-					output_filename = filename_with_extension(a_file->filename[i], ".opml");
-					break;
-
-				case FORMAT_ITMZ:
-					output_filename = filename_with_extension(a_file->filename[i], ".itmz");
-					break;
-			}
+			f->output_filename = filename_with_extension(a_file->filename[i], batch_output_extension(format));
 
-			// Perform transclusion(s)
-			char * folder = dirname((char *) a_file->filename[i]);
+			f->folder = my_strdup(dirname((char *) a_file->filename[i]));
+			f->source_path = a_file->filename[i];
+		}
 
-			if (!(extensions & EXT_COMPATIBILITY)) {
-				mmd_prepend_mmd_header(buffer);
-				mmd_append_mmd_footer(buffer);
-			}
+		// Files are often transcluded by many documents in a batch
+		if (extensions & EXT_TRANSCLUDE) {
+			mmd_transclusion_cache_enable(true);
+		}
 
-			if (extensions & EXT_TRANSCLUDE) {
-				mmd_transclude_source(buffer, folder, a_file->filename[i], format, NULL, NULL);
+		batch_run(&queue, batch_job_count());
 
-				// Don't free folder -- owned by dirname
-			}
+		mmd_transclusion_cache_clear();
+		mmd_transclusion_cache_enable(false);
 
-			// Perform block level CriticMarkup?
-			if (extensions & EXT_CRITIC_ACCEPT) {
-				mmd_critic_markup_accept(buffer);
-			}
+		// Report results in the order files were given
+		for (int i = 0; i < a_file->count; ++i) {
+			batch_file * f = &queue.files[i];
 
-			if (extensions & EXT_CRITIC_REJECT) {
-				mmd_critic_markup_reject(buffer);
+			if (f->read_failed) {
+				fprintf(stderr, "Error reading file '%s'\n", f->input);
+				exitcode = 1;
+			} else if (f->write_errno) {
+				fprintf(stderr, "%s: %s\n", f->output_filename, strerror(f->write_errno));
 			}
 
-			// Increment counter and prepare token pool
-#ifdef kUseObjectPool
-			token_pool_init();
-#endif
-
-			if (a_meta->count > 0) {
-				// List metadata keys
-				char_result = mmd_string_metadata_keys(buffer->str);
-
-				if (char_result) {
-					fputs(char_result, stdout);
-
-					free(char_result);
-				}
-			} else if (a_extract->count > 0) {
-				// Extract metadata key
-				const char * query = a_extract->sval[0];
-
-				char_result = mmd_string_metavalue_for_key(buffer->str, query);
-
-				if (char_result) {
-					fputs(char_result, stdout);
-					fputc('\n', stdout);
-
-					free(char_result);
-				}
-			} else {
-				// Regular processing
+			if (f->stdout_text) {
+				fputs(f->stdout_text->str, stdout);
+				d_string_free(f->stdout_text, true);
+			}
 
-				result = mmd_d_string_convert_to_data(buffer, extensions, format, language, folder);
+			free(f->input);
+			free(f->folder);
+			free(f->output_filename);
+		}
 
-				if (FORMAT_TEXTBUNDLE == format) {
-					unzip_data_to_path(result->str, result->currentStringLength, output_filename);
-				} else {
-					if (!(output_stream = fopen(output_filename, "wb"))) {
-						// Failed to open file
-						perror(output_filename);
-					} else {
-						fwrite(result->str, result->currentStringLength, 1, output_stream);
-						fclose(output_stream);
-					}
-				}
+		mmd_mutex_destroy(&queue.lock);
+		free(queue.files);
+	} else {
+		if (a_file->count == 1) {
+			// Work directly from the file -- it is copied only if something needs to modify it
+			input = mapped_file_open(a_file->filename[0]);
 
-				d_string_free(result, true);
+			if (input == NULL) {
+				fprintf(stderr, "Error reading file '%s'\n", a_file->filename[0]);
+				exitcode = 1;
+				goto exit;
 			}
 
-			d_string_free(buffer, true);
-			free(output_filename);
-
-			// Decrement counter and drain
-#ifdef kUseObjectPool
-			token_pool_drain();
-#endif
-		}
-	} else {
-		if (a_file->count) {
+			buffer = input->text;
+		} else if (a_file->count) {
 			// We have files to process
 			buffer = d_string_new("");
-			DString * file_buffer;
+			mapped_file * file_buffer;
 
 			// Concatenate all input files
 			for (int i = 0; i < a_file->count; ++i) {
-				file_buffer = scan_file(a_file->filename[i]);
+				file_buffer = mapped_file_open(a_file->filename[i]);
 
 				if (file_buffer == NULL) {
 					fprintf(stderr, "Error reading file '%s'\n", a_file->filename[i]);
@@ -491,8 +748,8 @@ int main(int argc, char ** argv) {
 					goto exit;
 				}
 
-				d_string_append_c_array(buffer, file_buffer->str, file_buffer->currentStringLength);
-				d_string_free(file_buffer, true);
+				d_string_append_c_array(buffer, file_buffer->text->str, file_buffer->text->currentStringLength);
+				mapped_file_close(file_buffer);
 			}
 		} else {
 			// Obtain input from stdin
@@ -544,7 +801,7 @@ int main(int argc, char ** argv) {
 
 		if (a_meta->count > 0) {
 			// List metadata keys
-			char_result = mmd_string_metadata_keys(buffer->str);
+			char_result = mmd_d_string_metadata_keys(buffer);
 
 			if (char_result) {
 				fputs(char_result, stdout);
@@ -555,7 +812,7 @@ int main(int argc, char ** argv) {
 			// Extract metadata key
 			const char * query = a_extract->sval[0];
 
-			char_result = mmd_string_metavalue_for_key(buffer->str, query);
+			char_result = mmd_d_string_metavalue_for_key(buffer, query);
 
 			if (char_result) {
 				fputs(char_result, stdout);
@@ -566,43 +823,46 @@ int main(int argc, char ** argv) {
 		} else {
 			// Regular processing
 
-			result = mmd_d_string_convert_to_data(buffer, extensions, format, language, folder);
-
 			// Where does output go?
+			if (strcmp(a_o->filename[0], "-") != 0) {
+				// Output may be the input file
+				mapped_file_prepare_overwrite(input, a_o->filename[0]);
+			}
+
 			if (strcmp(a_o->filename[0], "-") == 0) {
 				// direct to stdout
 				output_stream = stdout;
 			} else if (!(output_stream = fopen(a_o->filename[0], "wb"))) {
 				perror(a_o->filename[0]);
-				free(result);
-				d_string_free(buffer, true);
+
+				if (input) {
+					mapped_file_close(input);
+				} else {
+					d_string_free(buffer, true);
+				}
 
 				exitcode = 1;
 				goto exit;
 			}
 
-			fwrite(result->str, result->currentStringLength, 1, output_stream);
+			// Large documents can be parsed in parallel
+			convert_to_stream(buffer, extensions, format, language, folder, output_stream, NULL, batch_job_count());
 
 			if (output_stream != stdout) {
 				fclose(output_stream);
 			}
-
-			d_string_free(result, true);
 		}
 
-		d_string_free(buffer, true);
+		if (input) {
+			mapped_file_close(input);
+		} else {
+			d_string_free(buffer, true);
+		}
 	}
 
 
 exit:
 
-#ifdef kUseObjectPool
-	// Decrement counter and clean up token pool
-	token_pool_drain();
-
-	token_pool_free();
-#endif
-
 exit2:
 
 	// Clean up after argtable
@@ -75,7 +75,10 @@ void mmd_export_token_memoir(DString * out, const char * source, token * t, scra
 
 	switch (t->type) {
 		case DOC_START_TOKEN:
+			// Output can be passed along to a sink between top level blocks
+			scratch->sink_depth = scratch->recurse_depth + 1;
 			mmd_export_token_tree_memoir(out, source, t->child, scratch);
+			scratch->sink_depth = -1;
 			break;
 
 		case BLOCK_CODE_FENCED:
@@ -155,6 +158,10 @@ void mmd_export_token_tree_memoir(DString * out, const char * source, token * t,
 
 	scratch->recurse_depth++;
 
+	if (scratch->recurse_depth > scratch->recurse_depth_max) {
+		scratch->recurse_depth_max = scratch->recurse_depth;
+	}
+
 	while (t != NULL) {
 		if (scratch->skip_token) {
 			scratch->skip_token--;
@@ -163,6 +170,10 @@ void mmd_export_token_tree_memoir(DString * out, const char * source, token * t,
 		}
 
 		t = t->next;
+
+		if (scratch->recurse_depth == scratch->sink_depth) {
+			mmd_export_flush(out, scratch, false);
+		}
 	}
 
 	scratch->recurse_depth--;
@@ -72,19 +72,27 @@
 #include "scanners.h"
 #include "stack.h"
 #include "textbundle.h"
+#include "thread.h"
 #include "token.h"
 #include "token_pairs.h"
 #include "writer.h"
 #include "version.h"
 
+#ifdef TEST
+	#include "CuTest.h"
+#endif
 
 // Basic parser function declarations
 void * ParseAlloc(void *);
 void Parse(void *, int, void *, void *);
 void ParseFree(void *, void *);
+void ParseReset(void *);
 void ParseTrace(FILE * stream, char * zPrefix);
 
-void mmd_pair_tokens_in_block(token * block, token_pair_engine * e, stack * s);
+void mmd_pair_tokens_in_block(token * block, const token_pair_engine * e, stack * s);
+void pair_emphasis_tokens(token * t);
+
+static token * mmd_engine_parse_parallel(mmd_engine * e, size_t byte_start, size_t byte_len, int threads, size_t min_chunk);
 
 
 /// strdup() not available on all platforms
@@ -103,6 +111,274 @@ static char * my_strdup(const char * source) {
 }
 
 
+/// Pairing tables only depend on these extensions
+#define kPairingExtensions (EXT_COMPATIBILITY | EXT_CRITIC | EXT_NOTES)
+
+/// Buffer this much output before writing to file
+#define kOutputFlushThreshold (64 * 1024)
+
+/// Don't split a document for parallel parsing into chunks smaller than this
+#define kParallelParseMinChunk (1024 * 1024)
+
+
+/// Kinds of tokens recorded in `token->type_mask` for lines and blocks, so
+/// that pairing can skip blocks without anything to pair
+enum token_type_bits {
+	TYPE_BIT_CRITIC			= 1 << 0,
+	TYPE_BIT_HTML_COMMENT	= 1 << 1,
+	TYPE_BIT_BRACKET		= 1 << 2,
+	TYPE_BIT_PAREN			= 1 << 3,
+	TYPE_BIT_ANGLE			= 1 << 4,
+	TYPE_BIT_BRACE_DOUBLE	= 1 << 5,
+	TYPE_BIT_EMPH			= 1 << 6,
+	TYPE_BIT_BACKTICK		= 1 << 7,
+	TYPE_BIT_QUOTE			= 1 << 8,
+	TYPE_BIT_MATH			= 1 << 9,
+	TYPE_BIT_SCRIPT			= 1 << 10,
+	TYPE_BIT_TEXT_BRACE		= 1 << 11,
+	TYPE_BIT_DASH			= 1 << 12,
+};
+
+/// Set once a mask is complete (otherwise a block could contain anything)
+#define TYPE_BIT_KNOWN (1u << 31)
+
+/// Tokens handled by mmd_assign_ambidextrous_tokens_in_block()
+#define kAmbidextrousTypes (TYPE_BIT_CRITIC | TYPE_BIT_EMPH | TYPE_BIT_BACKTICK | TYPE_BIT_QUOTE | TYPE_BIT_MATH | TYPE_BIT_SCRIPT | TYPE_BIT_DASH)
+
+
+/// Which kind of token is this, for the purpose of `type_mask`?
+static uint32_t token_type_bit(unsigned short type) {
+	switch (type) {
+		case CRITIC_ADD_OPEN:
+		case CRITIC_ADD_CLOSE:
+		case CRITIC_DEL_OPEN:
+		case CRITIC_DEL_CLOSE:
+		case CRITIC_COM_OPEN:
+		case CRITIC_COM_CLOSE:
+		case CRITIC_SUB_OPEN:
+		case CRITIC_SUB_DIV:
+		case CRITIC_SUB_DIV_A:
+		case CRITIC_SUB_DIV_B:
+		case CRITIC_SUB_CLOSE:
+		case CRITIC_HI_OPEN:
+		case CRITIC_HI_CLOSE:
+			return TYPE_BIT_CRITIC;
+
+		case HTML_COMMENT_START:
+		case HTML_COMMENT_STOP:
+			return TYPE_BIT_HTML_COMMENT;
+
+		case BRACKET_LEFT:
+		case BRACKET_RIGHT:
+		case BRACKET_ABBREVIATION_LEFT:
+		case BRACKET_FOOTNOTE_LEFT:
+		case BRACKET_GLOSSARY_LEFT:
+		case BRACKET_CITATION_LEFT:
+		case BRACKET_IMAGE_LEFT:
+		case BRACKET_VARIABLE_LEFT:
+			return TYPE_BIT_BRACKET;
+
+		case PAREN_LEFT:
+		case PAREN_RIGHT:
+			return TYPE_BIT_PAREN;
+
+		case ANGLE_LEFT:
+		case ANGLE_RIGHT:
+			return TYPE_BIT_ANGLE;
+
+		case BRACE_DOUBLE_LEFT:
+		case BRACE_DOUBLE_RIGHT:
+			return TYPE_BIT_BRACE_DOUBLE;
+
+		case STAR:
+		case UL:
+			return TYPE_BIT_EMPH;
+
+		case BACKTICK:
+		case QUOTE_RIGHT_ALT:
+			return TYPE_BIT_BACKTICK;
+
+		case QUOTE_SINGLE:
+		case QUOTE_DOUBLE:
+			return TYPE_BIT_QUOTE;
+
+		case MATH_PAREN_OPEN:
+		case MATH_PAREN_CLOSE:
+		case MATH_BRACKET_OPEN:
+		case MATH_BRACKET_CLOSE:
+		case MATH_DOLLAR_SINGLE:
+		case MATH_DOLLAR_DOUBLE:
+			return TYPE_BIT_MATH;
+
+		case SUPERSCRIPT:
+		case SUBSCRIPT:
+			return TYPE_BIT_SCRIPT;
+
+		case TEXT_BRACE_LEFT:
+		case TEXT_BRACE_RIGHT:
+		case RAW_FILTER_LEFT:
+			return TYPE_BIT_TEXT_BRACE;
+
+		case DASH_N:
+			return TYPE_BIT_DASH;
+
+		default:
+			return 0;
+	}
+}
+
+
+/// Combine the type masks of a chain of lines/blocks (0 if any are unknown)
+static uint32_t token_chain_type_mask(token * chain) {
+	uint32_t mask = TYPE_BIT_KNOWN;
+
+	while (chain != NULL) {
+		if (!(chain->type_mask & TYPE_BIT_KNOWN)) {
+			return 0;
+		}
+
+		mask |= chain->type_mask;
+		chain = chain->next;
+	}
+
+	return mask;
+}
+
+
+/// Could this line/block contain any of the specified kinds of tokens?
+static bool token_may_contain(token * block, uint32_t types) {
+	return !(block->type_mask & TYPE_BIT_KNOWN) || (block->type_mask & types);
+}
+
+
+/// Which kinds of tokens can open or close a pair in this pairing table?
+static uint32_t token_pair_engine_type_mask(const token_pair_engine * p) {
+	uint32_t mask = 0;
+
+	for (int i = 0; i < kMaxTokenTypes; ++i) {
+		if (p->can_open_pair[i] || p->can_close_pair[i]) {
+			if (token_type_bit(i) == 0) {
+				// Not tracked, so we can't skip anything
+				return UINT32_MAX;
+			}
+
+			mask |= token_type_bit(i);
+		}
+	}
+
+	return mask;
+}
+
+
+/// Pairing tables are built once for each combination of pairing extensions,
+/// and then shared (read-only) by all engines
+static token_pair_engine * shared_pairings[8][4];
+
+static mmd_mutex shared_pairings_lock = kMutexInitializer;
+
+
+/// Configure the four token pair engines used when parsing
+static void mmd_pairings_build(token_pair_engine * p[4], unsigned long extensions) {
+	for (int i = 0; i < 4; ++i) {
+		p[i] = token_pair_engine_new();
+	}
+
+	// CriticMarkup
+	if (extensions & EXT_CRITIC) {
+		token_pair_engine_add_pairing(p[0], CRITIC_ADD_OPEN, CRITIC_ADD_CLOSE, PAIR_CRITIC_ADD, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[0], CRITIC_DEL_OPEN, CRITIC_DEL_CLOSE, PAIR_CRITIC_DEL, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[0], CRITIC_COM_OPEN, CRITIC_COM_CLOSE, PAIR_CRITIC_COM, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[0], CRITIC_SUB_OPEN, CRITIC_SUB_DIV_A, PAIR_CRITIC_SUB_DEL, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[0], CRITIC_SUB_DIV_B, CRITIC_SUB_CLOSE, PAIR_CRITIC_SUB_ADD, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[0], CRITIC_HI_OPEN, CRITIC_HI_CLOSE, PAIR_CRITIC_HI, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	}
+
+	// HTML Comments
+	token_pair_engine_add_pairing(p[1], HTML_COMMENT_START, HTML_COMMENT_STOP, PAIR_HTML_COMMENT, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+
+	// Brackets, Parentheses, Angles
+	token_pair_engine_add_pairing(p[2], BRACKET_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+
+	if (extensions & EXT_NOTES) {
+		token_pair_engine_add_pairing(p[2], BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_CITATION, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[2], BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_FOOTNOTE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[2], BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET_GLOSSARY, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[2], BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_ABBREVIATION, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	} else {
+		token_pair_engine_add_pairing(p[2], BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[2], BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[2], BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[2], BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	}
+
+	token_pair_engine_add_pairing(p[2], BRACKET_VARIABLE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_VARIABLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+
+	token_pair_engine_add_pairing(p[2], BRACKET_IMAGE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_IMAGE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	token_pair_engine_add_pairing(p[2], PAREN_LEFT, PAREN_RIGHT, PAIR_PAREN, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	token_pair_engine_add_pairing(p[2], ANGLE_LEFT, ANGLE_RIGHT, PAIR_ANGLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	token_pair_engine_add_pairing(p[2], BRACE_DOUBLE_LEFT, BRACE_DOUBLE_RIGHT, PAIR_BRACES, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+
+	// Strong/Emph
+	token_pair_engine_add_pairing(p[3], STAR, STAR, PAIR_STAR, 0);
+	token_pair_engine_add_pairing(p[3], UL, UL, PAIR_UL, 0);
+
+	// Quotes and Backticks
+	token_pair_engine_add_pairing(p[2], BACKTICK, BACKTICK, PAIR_BACKTICK, PAIRING_PRUNE_MATCH | PAIRING_MATCH_LENGTH);
+
+	token_pair_engine_add_pairing(p[3], BACKTICK,   QUOTE_RIGHT_ALT,   PAIR_QUOTE_ALT, PAIRING_ALLOW_EMPTY | PAIRING_MATCH_LENGTH);
+	token_pair_engine_add_pairing(p[3], QUOTE_SINGLE, QUOTE_SINGLE, PAIR_QUOTE_SINGLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	token_pair_engine_add_pairing(p[3], QUOTE_DOUBLE, QUOTE_DOUBLE, PAIR_QUOTE_DOUBLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+
+	// Math
+	if (!(extensions & EXT_COMPATIBILITY)) {
+		token_pair_engine_add_pairing(p[2], MATH_PAREN_OPEN, MATH_PAREN_CLOSE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[2], MATH_BRACKET_OPEN, MATH_BRACKET_CLOSE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[2], MATH_DOLLAR_SINGLE, MATH_DOLLAR_SINGLE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[2], MATH_DOLLAR_DOUBLE, MATH_DOLLAR_DOUBLE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	}
+
+	// Superscript/Subscript
+	if (!(extensions & EXT_COMPATIBILITY)) {
+		token_pair_engine_add_pairing(p[3], SUPERSCRIPT, SUPERSCRIPT, PAIR_SUPERSCRIPT, PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[3], SUBSCRIPT, SUBSCRIPT, PAIR_SUBSCRIPT, PAIRING_PRUNE_MATCH);
+	}
+
+	// Text Braces -- for raw text syntax
+	if (!(extensions & EXT_COMPATIBILITY)) {
+		token_pair_engine_add_pairing(p[3], TEXT_BRACE_LEFT, TEXT_BRACE_RIGHT, PAIR_BRACE, PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p[3], RAW_FILTER_LEFT, TEXT_BRACE_RIGHT, PAIR_RAW_FILTER, PAIRING_PRUNE_MATCH);
+	}
+}
+
+
+/// Get the shared pairing tables for the specified extensions
+static token_pair_engine ** mmd_pairings_for_extensions(unsigned long extensions) {
+	int index = 0;
+
+	if (extensions & EXT_COMPATIBILITY) {
+		index |= 1;
+	}
+
+	if (extensions & EXT_CRITIC) {
+		index |= 2;
+	}
+
+	if (extensions & EXT_NOTES) {
+		index |= 4;
+	}
+
+	mmd_mutex_lock(&shared_pairings_lock);
+
+	if (shared_pairings[index][0] == NULL) {
+		mmd_pairings_build(shared_pairings[index], extensions & kPairingExtensions);
+	}
+
+	mmd_mutex_unlock(&shared_pairings_lock);
+
+	return shared_pairings[index];
+}
+
+
 /// Build MMD Engine
 mmd_engine * mmd_engine_create(DString * d, unsigned long extensions) {
 	mmd_engine * e = malloc(sizeof(mmd_engine));
@@ -136,76 +412,33 @@ mmd_engine * mmd_engine_create(DString * d, unsigned long extensions) {
 		e->metadata_stack = stack_new(0);
 		e->table_stack = stack_new(0);
 		e->asset_hash = NULL;
+		e->metadata_index = NULL;
+		e->metadata_indexed = 0;
 
-		e->pairings1 = token_pair_engine_new();
-		e->pairings2 = token_pair_engine_new();
-		e->pairings3 = token_pair_engine_new();
-		e->pairings4 = token_pair_engine_new();
-
-		// CriticMarkup
-		if (extensions & EXT_CRITIC) {
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_ADD_OPEN, CRITIC_ADD_CLOSE, PAIR_CRITIC_ADD, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_DEL_OPEN, CRITIC_DEL_CLOSE, PAIR_CRITIC_DEL, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_COM_OPEN, CRITIC_COM_CLOSE, PAIR_CRITIC_COM, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_SUB_OPEN, CRITIC_SUB_DIV_A, PAIR_CRITIC_SUB_DEL, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_SUB_DIV_B, CRITIC_SUB_CLOSE, PAIR_CRITIC_SUB_ADD, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_HI_OPEN, CRITIC_HI_CLOSE, PAIR_CRITIC_HI, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		}
-
-		// HTML Comments
-		token_pair_engine_add_pairing(e->pairings2, HTML_COMMENT_START, HTML_COMMENT_STOP, PAIR_HTML_COMMENT, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-
-		// Brackets, Parentheses, Angles
-		token_pair_engine_add_pairing(e->pairings3, BRACKET_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-
-		if (extensions & EXT_NOTES) {
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_CITATION, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_FOOTNOTE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET_GLOSSARY, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_ABBREVIATION, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		} else {
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		}
-
-		token_pair_engine_add_pairing(e->pairings3, BRACKET_VARIABLE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_VARIABLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		e->root_exported = false;
 
-		token_pair_engine_add_pairing(e->pairings3, BRACKET_IMAGE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_IMAGE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e->pairings3, PAREN_LEFT, PAREN_RIGHT, PAIR_PAREN, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e->pairings3, ANGLE_LEFT, ANGLE_RIGHT, PAIR_ANGLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e->pairings3, BRACE_DOUBLE_LEFT, BRACE_DOUBLE_RIGHT, PAIR_BRACES, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		e->stats = NULL;
 
-		// Strong/Emph
-		token_pair_engine_add_pairing(e->pairings4, STAR, STAR, PAIR_STAR, 0);
-		token_pair_engine_add_pairing(e->pairings4, UL, UL, PAIR_UL, 0);
+		e->parse_threads = 1;
+		e->range_continues = false;
 
-		// Quotes and Backticks
-		token_pair_engine_add_pairing(e->pairings3, BACKTICK, BACKTICK, PAIR_BACKTICK, PAIRING_PRUNE_MATCH | PAIRING_MATCH_LENGTH);
+		e->parsers = NULL;
+		e->parser_count = 0;
 
-		token_pair_engine_add_pairing(e->pairings4, BACKTICK,   QUOTE_RIGHT_ALT,   PAIR_QUOTE_ALT, PAIRING_ALLOW_EMPTY | PAIRING_MATCH_LENGTH);
-		token_pair_engine_add_pairing(e->pairings4, QUOTE_SINGLE, QUOTE_SINGLE, PAIR_QUOTE_SINGLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e->pairings4, QUOTE_DOUBLE, QUOTE_DOUBLE, PAIR_QUOTE_DOUBLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+#ifdef kUseObjectPool
+		e->token_pool = pool_new(sizeof(token));
+		e->reparsed_bytes = 0;
+#endif
 
-		// Math
-		if (!(extensions & EXT_COMPATIBILITY)) {
-			token_pair_engine_add_pairing(e->pairings3, MATH_PAREN_OPEN, MATH_PAREN_CLOSE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, MATH_BRACKET_OPEN, MATH_BRACKET_CLOSE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, MATH_DOLLAR_SINGLE, MATH_DOLLAR_SINGLE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, MATH_DOLLAR_DOUBLE, MATH_DOLLAR_DOUBLE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		}
+		token_pair_engine ** pairings = mmd_pairings_for_extensions(extensions);
 
-		// Superscript/Subscript
-		if (!(extensions & EXT_COMPATIBILITY)) {
-			token_pair_engine_add_pairing(e->pairings4, SUPERSCRIPT, SUPERSCRIPT, PAIR_SUPERSCRIPT, PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings4, SUBSCRIPT, SUBSCRIPT, PAIR_SUBSCRIPT, PAIRING_PRUNE_MATCH);
-		}
+		e->pairings1 = pairings[0];
+		e->pairings2 = pairings[1];
+		e->pairings3 = pairings[2];
+		e->pairings4 = pairings[3];
 
-		// Text Braces -- for raw text syntax
-		if (!(extensions & EXT_COMPATIBILITY)) {
-			token_pair_engine_add_pairing(e->pairings4, TEXT_BRACE_LEFT, TEXT_BRACE_RIGHT, PAIR_BRACE, PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings4, RAW_FILTER_LEFT, TEXT_BRACE_RIGHT, PAIR_RAW_FILTER, PAIRING_PRUNE_MATCH);
+		for (int i = 0; i < 4; ++i) {
+			e->pairing_types[i] = token_pair_engine_type_mask(pairings[i]);
 		}
 	}
 
@@ -227,6 +460,15 @@ mmd_engine * mmd_engine_create_with_string(const char * str, unsigned long exten
 }
 
 
+/// Create MMD Engine that parses directly from read-only memory (A copy is
+/// only made if the engine needs to modify the text)
+mmd_engine * mmd_engine_create_with_buffer(const char * str, size_t len, unsigned long extensions) {
+	DString * d = d_string_new_borrowed(str, len);
+
+	return mmd_engine_create(d, extensions);
+}
+
+
 /// Set language and smart quotes language
 void mmd_engine_set_language(mmd_engine * e, short language) {
 	if (!e) {
@@ -266,6 +508,13 @@ void mmd_engine_set_language(mmd_engine * e, short language) {
 }
 
 
+/// Empty the metadata index (the metadata itself belongs to metadata_stack)
+static void mmd_engine_metadata_index_clear(mmd_engine * e) {
+	HASH_CLEAR(engine_hh, e->metadata_index);
+	e->metadata_indexed = 0;
+}
+
+
 void mmd_engine_reset(mmd_engine * e) {
 	if (e->root) {
 		token_tree_free(e->root);
@@ -298,6 +547,8 @@ void mmd_engine_reset(mmd_engine * e) {
 	}
 
 	// Metadata needs to be freed
+	mmd_engine_metadata_index_clear(e);
+
 	while (e->metadata_stack->size) {
 		meta_free(stack_pop(e->metadata_stack));
 	}
@@ -314,6 +565,18 @@ void mmd_engine_reset(mmd_engine * e) {
 	e->definition_stack->size = 0;
 	e->header_stack->size = 0;
 	e->table_stack->size = 0;
+
+	e->root_exported = false;
+
+	if (e->stats) {
+		memset(e->stats, 0, sizeof(mmd_stats));
+	}
+
+#ifdef kUseObjectPool
+	// Release all tokens at once
+	pool_drain(e->token_pool);
+	e->reparsed_bytes = 0;
+#endif
 }
 
 
@@ -329,10 +592,7 @@ void mmd_engine_free(mmd_engine * e, bool freeDString) {
 		d_string_free(e->dstr, true);
 	}
 
-	token_pair_engine_free(e->pairings1);
-	token_pair_engine_free(e->pairings2);
-	token_pair_engine_free(e->pairings3);
-	token_pair_engine_free(e->pairings4);
+	// Pairing tables are shared, so don't free them
 
 	// Pointers to blocks that are freed elsewhere
 	stack_free(e->definition_stack);
@@ -348,10 +608,125 @@ void mmd_engine_free(mmd_engine * e, bool freeDString) {
 	stack_free(e->link_stack);
 	stack_free(e->metadata_stack);
 
+	free(e->stats);
+
+	for (int i = 0; i < e->parser_count; ++i) {
+		ParseFree(e->parsers[i], free);
+	}
+
+	free(e->parsers);
+
+#ifdef kUseObjectPool
+	pool_free(e->token_pool);
+#endif
+
 	free(e);
 }
 
 
+/// Make the engine's token pool the active pool for the current thread
+struct pool * mmd_engine_pool_enter(mmd_engine * e) {
+#ifdef kUseObjectPool
+	return token_pool_swap(e->token_pool);
+#else
+	return NULL;
+#endif
+}
+
+
+/// Restore the token pool that was active before mmd_engine_pool_enter()
+void mmd_engine_pool_exit(struct pool * previous) {
+#ifdef kUseObjectPool
+	token_pool_swap(previous);
+#endif
+}
+
+
+/// Start (or stop) collecting stats for this engine
+void mmd_engine_set_stats_enabled(mmd_engine * e, bool enabled) {
+	if (e == NULL) {
+		return;
+	}
+
+	if (enabled && (e->stats == NULL)) {
+		e->stats = calloc(1, sizeof(mmd_stats));
+	} else if (!enabled) {
+		free(e->stats);
+		e->stats = NULL;
+	}
+}
+
+
+/// Use several threads to parse very large documents
+void mmd_engine_set_parse_threads(mmd_engine * e, int threads) {
+	if (e) {
+		e->parse_threads = (threads < 1) ? 1 : threads;
+	}
+}
+
+
+/// Stats for this engine, or NULL if they are not being collected
+const mmd_stats * mmd_engine_stats(mmd_engine * e) {
+	if ((e == NULL) || (e->stats == NULL)) {
+		return NULL;
+	}
+
+#ifdef kUseObjectPool
+	// Tokens are only counted when they come from the engine's pool
+	e->stats->tokens_allocated = pool_object_count(e->token_pool);
+	e->stats->pool_slabs = e->token_pool->allocated->size;
+#endif
+
+	return e->stats;
+}
+
+
+/// Name of a phase in mmd_stats
+const char * mmd_stats_phase_name(short phase) {
+	static const char * names[PHASE_COUNT] = {
+		"tokenize",
+		"parse blocks",
+		"ambidextrous",
+		"pair tokens",
+		"definitions",
+		"headers",
+		"tables",
+		"search terms",
+		"writer",
+	};
+
+	if ((phase < 0) || (phase >= PHASE_COUNT)) {
+		return NULL;
+	}
+
+	return names[phase];
+}
+
+
+/// Current time for timing stats phases (0 if stats are not enabled)
+double mmd_stats_clock(mmd_engine * e) {
+	if (e->stats == NULL) {
+		return 0;
+	}
+
+	return mmd_clock_seconds();
+}
+
+
+/// Add the time since `since` to a stats phase, and return the current time
+double mmd_stats_lap(mmd_engine * e, short phase, double since) {
+	if (e->stats == NULL) {
+		return 0;
+	}
+
+	double now = mmd_stats_clock(e);
+
+	e->stats->phase_time[phase] += now - since;
+
+	return now;
+}
+
+
 /// Access DString directly
 DString * mmd_engine_d_string(mmd_engine * e) {
 	return e->dstr;
@@ -1091,9 +1466,19 @@ token * mmd_tokenize_string(mmd_engine * e, size_t start, size_t len, bool stop_
 				// 0 means we finished with input
 				// Add current line to root
 
+				// A range that ends at the start of a line, before the end of
+				// the text, may be followed by more lines that are parsed
+				// separately (e.g. when parsing a document in chunks) -- so
+				// there is no final empty line
+				if (e->range_continues && (line->child == NULL) && (stop < &e->dstr->str[e->dstr->currentStringLength])) {
+					token_free(line);
+					break;
+				}
+
 				// What sort of line is this?
 				mmd_assign_line_type(e, line);
 
+				line->type_mask |= TYPE_BIT_KNOWN;
 				token_append_child(root, line);
 				break;
 
@@ -1122,6 +1507,7 @@ token * mmd_tokenize_string(mmd_engine * e, size_t start, size_t len, bool stop_
 				// What sort of line is this?
 				mmd_assign_line_type(e, line);
 
+				line->type_mask |= TYPE_BIT_KNOWN;
 				token_append_child(root, line);
 
 				// If this is first line, do we have proper metadata?
@@ -1168,6 +1554,7 @@ token * mmd_tokenize_string(mmd_engine * e, size_t start, size_t len, bool stop_
 			default:
 				t = token_new(type, (size_t)(s.start - e->dstr->str), (size_t)(s.cur - s.start));
 				token_append_child(line, t);
+				line->type_mask |= token_type_bit(type);
 				break;
 		}
 
@@ -1180,6 +1567,26 @@ token * mmd_tokenize_string(mmd_engine * e, size_t start, size_t len, bool stop_
 }
 
 
+/// Get a lemon parser for the current parse recursion depth.  Each list
+/// item, blockquote, etc. is parsed recursively, so reuse the parser left
+/// from the last parse at this depth instead of allocating a new one.
+static void * mmd_engine_parser(mmd_engine * e) {
+	unsigned short depth = e->recurse_depth - 1;
+
+	if (depth < e->parser_count) {
+		ParseReset(e->parsers[depth]);
+		return e->parsers[depth];
+	}
+
+	// Recursion only goes one level deeper at a time
+	e->parsers = realloc(e->parsers, sizeof(void *) * (depth + 1));
+	e->parsers[depth] = ParseAlloc(malloc);
+	e->parser_count = depth + 1;
+
+	return e->parsers[depth];
+}
+
+
 /// Parse token tree
 void mmd_parse_token_chain(mmd_engine * e, token * chain) {
 
@@ -1189,7 +1596,11 @@ void mmd_parse_token_chain(mmd_engine * e, token * chain) {
 
 	e->recurse_depth++;
 
-	void * pParser = ParseAlloc (malloc);		// Create a parser (for lemon)
+	if (e->stats && (e->recurse_depth > e->stats->parse_depth_max)) {
+		e->stats->parse_depth_max = e->recurse_depth;
+	}
+
+	void * pParser = mmd_engine_parser(e);		// Get a parser (for lemon)
 	token * walker = chain->child;				// Walk the existing tree
 	token * remainder;							// Hold unparsed tail of chain
 
@@ -1223,13 +1634,11 @@ void mmd_parse_token_chain(mmd_engine * e, token * chain) {
 	token_append_child(chain, e->root);
 	e->root = NULL;
 
-	ParseFree(pParser, free);
-
 	e->recurse_depth--;
 }
 
 
-void mmd_pair_tokens_in_chain(token * head, token_pair_engine * e, stack * s) {
+void mmd_pair_tokens_in_chain(token * head, const token_pair_engine * e, stack * s) {
 
 	while (head != NULL) {
 		mmd_pair_tokens_in_block(head, e, s);
@@ -1240,7 +1649,7 @@ void mmd_pair_tokens_in_chain(token * head, token_pair_engine * e, stack * s) {
 
 
 /// Match token pairs inside block
-void mmd_pair_tokens_in_block(token * block, token_pair_engine * e, stack * s) {
+void mmd_pair_tokens_in_block(token * block, const token_pair_engine * e, stack * s) {
 	if (block == NULL || e == NULL) {
 		return;
 	}
@@ -1264,7 +1673,7 @@ void mmd_pair_tokens_in_block(token * block, token_pair_engine * e, stack * s) {
 		case BLOCK_SETEXT_1:
 		case BLOCK_SETEXT_2:
 		case BLOCK_TERM:
-			token_pairs_match_pairs_inside_token(block, e, s, 0);
+			token_pairs_match_pairs_inside_token(block, e, s);
 			break;
 
 		case DOC_START_TOKEN:
@@ -1277,14 +1686,14 @@ void mmd_pair_tokens_in_block(token * block, token_pair_engine * e, stack * s) {
 
 		case BLOCK_LIST_ITEM:
 		case BLOCK_LIST_ITEM_TIGHT:
-			token_pairs_match_pairs_inside_token(block, e, s, 0);
+			token_pairs_match_pairs_inside_token(block, e, s);
 			mmd_pair_tokens_in_chain(block->child, e, s);
 			break;
 
 		case LINE_TABLE:
 		case BLOCK_TABLE:
 			// TODO: Need to parse into cells first
-			token_pairs_match_pairs_inside_token(block, e, s, 0);
+			token_pairs_match_pairs_inside_token(block, e, s);
 			mmd_pair_tokens_in_chain(block->child, e, s);
 			break;
 
@@ -1298,6 +1707,79 @@ void mmd_pair_tokens_in_block(token * block, token_pair_engine * e, stack * s) {
 }
 
 
+/// Match token pairs inside block for each of the pairing levels in turn,
+/// then pair emphasis, visiting each block only once.  The result is the
+/// same as running mmd_pair_tokens_in_block() once per level over the
+/// whole document, followed by pair_emphasis_tokens().  Levels are skipped
+/// for blocks that contain none of the tokens in `types`.
+void mmd_pair_tokens_in_block_fused(token * block, const token_pair_engine * e[4], const uint32_t types[4], stack * s) {
+	if (block == NULL) {
+		return;
+	}
+
+	switch (block->type) {
+		case BLOCK_BLOCKQUOTE:
+		case BLOCK_DEFLIST:
+		case BLOCK_DEFINITION:
+		case BLOCK_DEF_ABBREVIATION:
+		case BLOCK_DEF_CITATION:
+		case BLOCK_DEF_FOOTNOTE:
+		case BLOCK_DEF_GLOSSARY:
+		case BLOCK_DEF_LINK:
+		case BLOCK_H1:
+		case BLOCK_H2:
+		case BLOCK_H3:
+		case BLOCK_H4:
+		case BLOCK_H5:
+		case BLOCK_H6:
+		case BLOCK_PARA:
+		case BLOCK_SETEXT_1:
+		case BLOCK_SETEXT_2:
+		case BLOCK_TERM:
+			for (int i = 0; i < 4; ++i) {
+				if (e[i] && token_may_contain(block, types[i])) {
+					token_pairs_match_pairs_inside_token(block, e[i], s);
+				}
+			}
+
+			break;
+
+		case DOC_START_TOKEN:
+		case BLOCK_LIST_BULLETED:
+		case BLOCK_LIST_BULLETED_LOOSE:
+		case BLOCK_LIST_ENUMERATED:
+		case BLOCK_LIST_ENUMERATED_LOOSE:
+			for (token * t = block->child; t != NULL; t = t->next) {
+				mmd_pair_tokens_in_block_fused(t, e, types, s);
+			}
+
+			return;
+
+		case BLOCK_LIST_ITEM:
+		case BLOCK_LIST_ITEM_TIGHT:
+		case LINE_TABLE:
+		case BLOCK_TABLE:
+			// Children are paired twice at each level (once from here, and
+			// again on their own), so keep the original order inside
+			for (int i = 0; i < 4; ++i) {
+				if (token_may_contain(block, types[i])) {
+					mmd_pair_tokens_in_block(block, e[i], s);
+				}
+			}
+
+			break;
+
+		default:
+			// Nothing to pair, so nothing to emphasize
+			return;
+	}
+
+	if (token_may_contain(block, TYPE_BIT_EMPH)) {
+		pair_emphasis_tokens(block->child);
+	}
+}
+
+
 /// Ambidextrous tokens can open OR close a pair.  This routine gives the opportunity
 /// to change this behavior on case-by-case basis.  For example, in `foo **bar** foo`, the
 /// first set of asterisks can open, but not close a pair.  The second set can close, but not
@@ -1330,46 +1812,53 @@ void mmd_assign_ambidextrous_tokens_in_block(mmd_engine * e, token * block, size
 				// This is not metadata
 				t->type = BLOCK_PARA;
 
-			case DOC_START_TOKEN:
-			case BLOCK_BLOCKQUOTE:
 			case BLOCK_DEF_ABBREVIATION:
 			case BLOCK_DEF_CITATION:
-			case BLOCK_DEF_FOOTNOTE:
-			case BLOCK_DEF_GLOSSARY:
 			case BLOCK_DEF_LINK:
-			case BLOCK_DEFLIST:
-			case BLOCK_DEFINITION:
 			case BLOCK_H1:
 			case BLOCK_H2:
 			case BLOCK_H3:
 			case BLOCK_H4:
 			case BLOCK_H5:
 			case BLOCK_H6:
-			case BLOCK_LIST_BULLETED:
-			case BLOCK_LIST_BULLETED_LOOSE:
-			case BLOCK_LIST_ENUMERATED:
-			case BLOCK_LIST_ENUMERATED_LOOSE:
-			case BLOCK_LIST_ITEM:
-			case BLOCK_LIST_ITEM_TIGHT:
 			case BLOCK_PARA:
 			case BLOCK_SETEXT_1:
 			case BLOCK_SETEXT_2:
 			case BLOCK_TABLE:
-			case BLOCK_TABLE_SECTION:
-			case TABLE_ROW:
-			case TABLE_CELL:
 			case BLOCK_TERM:
 			case LINE_LIST_BULLETED:
 			case LINE_LIST_ENUMERATED:
-				// Assign child tokens of blocks
-				mmd_assign_ambidextrous_tokens_in_block(e, t, start_offset);
-				break;
-
-			case CRITIC_SUB_DIV:
-				// Divide this into two tokens
-				new = token_new(CRITIC_SUB_DIV_B, t->start + 1, 1);
+				// Assign child tokens of blocks, unless there is nothing to assign
+				if (token_may_contain(t, kAmbidextrousTypes)) {
+					mmd_assign_ambidextrous_tokens_in_block(e, t, start_offset);
+				}
 
-				new->next = t->next;
+				break;
+
+			case DOC_START_TOKEN:
+			case BLOCK_BLOCKQUOTE:
+			case BLOCK_DEF_FOOTNOTE:
+			case BLOCK_DEF_GLOSSARY:
+			case BLOCK_DEFLIST:
+			case BLOCK_DEFINITION:
+			case BLOCK_LIST_BULLETED:
+			case BLOCK_LIST_BULLETED_LOOSE:
+			case BLOCK_LIST_ENUMERATED:
+			case BLOCK_LIST_ENUMERATED_LOOSE:
+			case BLOCK_LIST_ITEM:
+			case BLOCK_LIST_ITEM_TIGHT:
+			case BLOCK_TABLE_SECTION:
+			case TABLE_ROW:
+			case TABLE_CELL:
+				// Assign child tokens of blocks that may hold other blocks
+				mmd_assign_ambidextrous_tokens_in_block(e, t, start_offset);
+				break;
+
+			case CRITIC_SUB_DIV:
+				// Divide this into two tokens
+				new = token_new(CRITIC_SUB_DIV_B, t->start + 1, 1);
+
+				new->next = t->next;
 
 				if (new->next) {
 					new->next->prev = new;
@@ -1803,6 +2292,7 @@ void recursive_parse_list_item(mmd_engine * e, token * block) {
 	deindent_block(e, block);
 
 	mmd_parse_token_chain(e, block);
+	block->type_mask = token_chain_type_mask(block->child);
 
 	// Insert marker back in place
 	marker->next = block->child->child;
@@ -1834,6 +2324,7 @@ void recursive_parse_indent(mmd_engine * e, token * block) {
 	}
 
 	mmd_parse_token_chain(e, block);
+	block->type_mask = token_chain_type_mask(block->child);
 }
 
 
@@ -2113,6 +2604,9 @@ void strip_line_tokens_from_block(mmd_engine * e, token * block) {
 
 	token * l = block->child;
 
+	// Remember what the lines contain before they are merged
+	block->type_mask = token_chain_type_mask(l);
+
 	// Custom actions
 	switch (block->type) {
 		case BLOCK_META:
@@ -2302,6 +2796,61 @@ handle_line:
 }
 
 
+/// Tokenize, parse, and pair tokens for a range of the source.  Unlike
+/// mmd_engine_parse_substring(), this leaves the engine's existing tree and
+/// stacks alone (new blocks are added to the stacks).  If `continues`, the
+/// range is part of a larger parse, and the text after it will be parsed
+/// separately.
+static token * mmd_engine_parse_range(mmd_engine * e, size_t byte_start, size_t byte_len, bool continues) {
+	size_t reallocations = d_string_reallocations();
+	double lap = mmd_stats_clock(e);
+
+	// Tokenize the string
+	e->range_continues = continues;
+	token * doc = mmd_tokenize_string(e, byte_start, byte_len, false);
+	e->range_continues = false;
+	lap = mmd_stats_lap(e, PHASE_TOKENIZE, lap);
+
+	// Describe token chain for debugging purposes
+	// token_describe(doc, NULL);
+
+	// Parse tokens into blocks
+	mmd_parse_token_chain(e, doc);
+	lap = mmd_stats_lap(e, PHASE_PARSE_BLOCKS, lap);
+
+	// Describe token blocks for debugging purposes
+	// token_describe(doc, NULL);
+
+	if (doc) {
+		// Parse blocks for pairs
+		mmd_assign_ambidextrous_tokens_in_block(e, doc, 0);
+		lap = mmd_stats_lap(e, PHASE_AMBIDEXTROUS, lap);
+
+		// Prepare stack to be used for token pairing
+		// This avoids allocating/freeing one for each iteration.
+		stack * pair_stack = stack_new(0);
+
+
+		const token_pair_engine * pairings[4] = {
+			e->pairings1, e->pairings2, e->pairings3, e->pairings4
+		};
+
+		// Pair tokens and emphasis in one walk over the blocks
+		mmd_pair_tokens_in_block_fused(doc, pairings, e->pairing_types, pair_stack);
+
+		// Free stack
+		stack_free(pair_stack);
+		mmd_stats_lap(e, PHASE_PAIR_TOKENS, lap);
+	}
+
+	if (e->stats) {
+		e->stats->string_reallocations += d_string_reallocations() - reallocations;
+	}
+
+	return doc;
+}
+
+
 /// Parse part of the string into a token tree
 token * mmd_engine_parse_substring(mmd_engine * e, size_t byte_start, size_t byte_len) {
 	// Fix indeterminant length
@@ -2313,6 +2862,9 @@ token * mmd_engine_parse_substring(mmd_engine * e, size_t byte_start, size_t byt
 
 	mmd_engine_reset(e);
 
+	// Allocate tokens from this engine's pool
+	struct pool * previous_pool = mmd_engine_pool_enter(e);
+
 	// Disable metadata unless we are starting at the beginnging
 	size_t old_ext = e->extensions;
 
@@ -2336,41 +2888,32 @@ token * mmd_engine_parse_substring(mmd_engine * e, size_t byte_start, size_t byt
 		byte_len = e->dstr->currentStringLength;
 	}
 
-	// Tokenize the string
-	token * doc = mmd_tokenize_string(e, byte_start, byte_len, false);
-
-	// Describe token chain for debugging purposes
-	// token_describe(doc, NULL);
-
-	// Parse tokens into blocks
-	mmd_parse_token_chain(e, doc);
-
-	// Describe token blocks for debugging purposes
-	// token_describe(doc, NULL);
-
-	if (doc) {
-		// Parse blocks for pairs
-		mmd_assign_ambidextrous_tokens_in_block(e, doc, 0);
+#ifdef kUseCompactTokens
 
-		// Prepare stack to be used for token pairing
-		// This avoids allocating/freeing one for each iteration.
-		stack * pair_stack = stack_new(0);
+	// Offsets would not fit in the token struct, so parse nothing
+	if (byte_start + byte_len > kTokenOffsetMax) {
+		fprintf(stderr, "Document too large to parse (limit is %lu bytes).\n", (unsigned long) kTokenOffsetMax);
+		byte_start = 0;
+		byte_len = 0;
+	}
 
+#endif
 
-		mmd_pair_tokens_in_block(doc, e->pairings1, pair_stack);
-		mmd_pair_tokens_in_block(doc, e->pairings2, pair_stack);
-		mmd_pair_tokens_in_block(doc, e->pairings3, pair_stack);
-		mmd_pair_tokens_in_block(doc, e->pairings4, pair_stack);
+	token * doc = NULL;
 
-		// Free stack
-		stack_free(pair_stack);
+	if (e->parse_threads > 1) {
+		doc = mmd_engine_parse_parallel(e, byte_start, byte_len, e->parse_threads, kParallelParseMinChunk);
+	}
 
-		pair_emphasis_tokens(doc);
+	if (doc == NULL) {
+		doc = mmd_engine_parse_range(e, byte_start, byte_len, false);
 	}
 
 	// Return original extensions
 	e->extensions = old_ext;
 
+	mmd_engine_pool_exit(previous_pool);
+
 	return doc;
 }
 
@@ -2383,203 +2926,1209 @@ void mmd_engine_parse_string(mmd_engine * e) {
 }
 
 
-/// Does the text have metadata?
-bool mmd_string_has_metadata(char * source, size_t * end) {
-	bool result;
+/// Find the start of the line containing `pos`
+static size_t line_start(const char * str, size_t pos) {
+	while (pos && !char_is_line_ending(str[pos - 1])) {
+		pos--;
+	}
 
-	mmd_engine * e = mmd_engine_create_with_string(source, 0);
-	result = mmd_engine_has_metadata(e, end);
+	return pos;
+}
 
-	mmd_engine_free(e, true);
 
-	return result;
+/// Find the first empty line -- metadata can't continue past it, but any line
+/// before it might be affected by an edit to the first line
+static size_t metadata_end(const char * str, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		if (char_is_line_ending(str[i]) && ((i == 0) || (str[i - 1] == '\n') ||
+											((str[i - 1] == '\r') && (str[i] == '\r')))) {
+			return i;
+		}
+	}
+
+	return len;
 }
 
 
-/// Does the text have metadata?
-bool mmd_d_string_has_metadata(DString * source, size_t * end) {
-	bool result;
+/// Shift offsets of a token chain, and all its descendants
+static void token_tree_shift(token * t, long delta) {
+	while (t) {
+		t->start += delta;
+		token_tree_shift(t->child, delta);
 
-	mmd_engine * e = mmd_engine_create_with_dstring(source, 0);
-	result = mmd_engine_has_metadata(e, end);
+		t = t->next;
+	}
+}
 
-	mmd_engine_free(e, false);
 
-	return result;
+/// Does a newly parsed block match the old one (shifted by delta)?  How a line
+/// is lexed can depend on the end of the line before it, so the whole block
+/// is compared, not just its extent
+static bool token_tree_matches(token * old, token * t, long delta) {
+	while (old && t) {
+		if ((old->type != t->type) || (old->start + delta != t->start) || (old->len != t->len)) {
+			return false;
+		}
+
+		if (!token_tree_matches(old->child, t->child, delta)) {
+			return false;
+		}
+
+		old = old->next;
+		t = t->next;
+	}
+
+	return (old == NULL) && (t == NULL);
 }
 
 
-/// Does the text have metadata?
-bool mmd_engine_has_metadata(mmd_engine * e, size_t * end) {
-	bool result = false;
-	token * old_root;
-	mmd_engine * temp = NULL;
+/// Does a block match another one at the same place?
+static bool token_block_matches(token * a, token * b) {
+	return (a->type == b->type) && (a->start == b->start) && (a->len == b->len) &&
+		   token_tree_matches(a->child, b->child, 0);
+}
 
-	if (!e) {
-		return false;
-	}
 
-	if (!(scan_meta_line(&e->dstr->str[0]))) {
-		// First line is not metadata, so can't have metadata
-		// Saves the time of an unnecessary parse
-		// TODO:  Need faster confirmation of actual metadata than full tokenizing
-		if (end) {
-			*end = 0;
+/// Find places where a range can be split for parallel parsing -- the start
+/// of a line that begins with a letter after an empty line, outside of
+/// metadata, fenced code, and HTML comments.  Chunks are roughly equal in
+/// size.  This is only a quick scan of the text rather than the real grammar,
+/// so each split is checked after parsing.
+static int parallel_parse_splits(const char * str, size_t start, size_t len, size_t * splits, int chunks) {
+	size_t end = start + len;
+	size_t meta = (start == 0) ? metadata_end(str, len) : 0;
+	size_t pos = start;
+	int count = 0;
+
+	bool prev_empty = false;
+	bool comment = false;
+	short fence = 0;
+
+	while ((pos < end) && (count < chunks - 1)) {
+		const char * line = &str[pos];
+		const char * eol = memchr(line, '\n', end - pos);
+		size_t line_len = (eol) ? eol - line : end - pos;
+		size_t i = 0;
+
+		if (prev_empty && !fence && !comment && (pos > meta) &&
+				(pos >= start + (len / chunks) * (count + 1)) &&
+				((line[0] | 0x20) >= 'a') && ((line[0] | 0x20) <= 'z') &&
+				!memchr(line, '|', line_len)) {
+			splits[count++] = pos;
 		}
 
-		return false;
-	}
+		while ((i < 3) && (i < line_len) && (line[i] == ' ')) {
+			i++;
+		}
 
-	// Preserve existing parse tree (if any)
-	old_root = e->root;
+		size_t marker = i;
 
-	token * doc = NULL;
+		while ((i < line_len) && (line[i] == '`')) {
+			i++;
+		}
 
-	if (old_root &&
-			(old_root->type == DOC_START_TOKEN) &&
-			(old_root->len == e->dstr->currentStringLength)
-	   ) {
-		// Already parsed
-		doc = old_root;
-	} else {
-		// Store stack sizes
-		temp = mmd_engine_create(NULL, 0);
+		size_t backticks = i - marker;
 
-		temp->abbreviation_stack->size = e->abbreviation_stack->size;
-		temp->citation_stack->size = e->citation_stack->size;
-		temp->definition_stack->size = e->definition_stack->size;
-		temp->footnote_stack->size = e->footnote_stack->size;
-		temp->glossary_stack->size = e->glossary_stack->size;
-		temp->header_stack->size = e->header_stack->size;
-		temp->link_stack->size = e->link_stack->size;
-		temp->metadata_stack->size = e->metadata_stack->size;
-		temp->table_stack->size = e->table_stack->size;
+		if (backticks >= 3) {
+			// Is the rest of the line blank, or an info string?
+			bool blank = true;
+			bool info = true;
 
+			for (; i < line_len; ++i) {
+				if (!char_is_whitespace_or_line_ending(line[i])) {
+					blank = false;
+				}
 
-		// Tokenize the string (up until first empty line)
-		doc = mmd_tokenize_string(e, 0, e->dstr->currentStringLength, true);
+				if ((line[i] == '`') || (line[i] == '\'')) {
+					info = false;
+				}
+			}
 
-		// Parse tokens into blocks
-		mmd_parse_token_chain(e, doc);
-	}
+			if (!fence && (blank || info)) {
+				fence = (backticks > 5) ? 5 : backticks;
+			} else if (fence && blank && (backticks >= fence)) {
+				fence = 0;
+			}
+		} else if (!fence) {
+			// Comment blocks start and stop with lines of their own.  When in
+			// doubt, stay in the comment (it only means fewer places to split)
+			if (!comment && (marker + 4 <= line_len) && (strncmp(&line[marker], "<!--", 4) == 0)) {
+				comment = true;
+			} else if (comment && (marker + 3 <= line_len) && (strncmp(&line[marker], "-->", 3) == 0)) {
+				comment = (marker + 3 < line_len) && (line[marker + 3] != '\r');
+			}
+		}
 
-	if (doc) {
-		if (doc->child && doc->child->type == BLOCK_META) {
-			result = true;
+		prev_empty = true;
 
-			if (end) {
-				*end = doc->child->len;
+		for (i = 0; i < line_len; ++i) {
+			if (!char_is_whitespace_or_line_ending(line[i])) {
+				prev_empty = false;
+				break;
 			}
 		}
 
-		if (old_root != doc) {
-			token_tree_free(doc);
+		pos += line_len + 1;
+	}
 
-			// Reset stack sizes
-			// Except metadata stack, since we will need that for any subseqeunt requests
-			// TODO: May need a more robust approach for this in the future
-			e->abbreviation_stack->size =	temp->abbreviation_stack->size;
-			e->citation_stack->size = 		temp->citation_stack->size;
-			e->definition_stack->size = 	temp->definition_stack->size;
-			e->footnote_stack->size = 		temp->footnote_stack->size;
-			e->glossary_stack->size = 		temp->glossary_stack->size;
-			e->header_stack->size = 		temp->header_stack->size;
-			e->link_stack->size = 			temp->link_stack->size;
-//			e->metadata_stack->size = 		temp->metadata_stack->size;
-			e->table_stack->size = 			temp->table_stack->size;
+	return count;
+}
 
-			// And reset temp stack sizes
-			temp->abbreviation_stack->size =	0;
-			temp->citation_stack->size = 		0;
-			temp->definition_stack->size = 		0;
-			temp->footnote_stack->size = 		0;
-			temp->glossary_stack->size = 		0;
-			temp->header_stack->size = 			0;
-			temp->link_stack->size = 			0;
-			temp->metadata_stack->size = 		0;
-			temp->table_stack->size = 			0;
 
-			mmd_engine_free(temp, true);
-		}
-	}
+/// One chunk of a document being parsed in parallel
+struct parse_chunk {
+	mmd_engine *	e;				//!< Engine for this chunk (shares the source text)
+	size_t			start;
+	size_t			len;
+	token *			doc;
+	mmd_thread		thread;
+	bool			threaded;		//!< Was a thread started for this chunk?
+};
 
-	// Restore previous parse tree
-	e->root = old_root;
+typedef struct parse_chunk parse_chunk;
 
-	return result;
-}
 
+static void * parse_chunk_run(void * arg) {
+	parse_chunk * c = arg;
 
-/// Return metadata keys, one per line
-/// Returned char * must be freed
-char * mmd_string_metadata_keys(char * source) {
-	char * result;
+	// Each thread allocates from its own engine's pool
+	struct pool * previous_pool = mmd_engine_pool_enter(c->e);
 
-	mmd_engine * e = mmd_engine_create_with_string(source, 0);
-	result = mmd_engine_metadata_keys(e);
+	c->doc = mmd_engine_parse_range(c->e, c->start, c->len, true);
 
-	mmd_engine_free(e, true);
+	mmd_engine_pool_exit(previous_pool);
 
-	return result;
+	return NULL;
 }
 
 
-/// Return metadata keys, one per line
-/// Returned char * must be freed
-char * mmd_d_string_metadata_keys(DString * source) {
-	char * result;
+/// Did splitting the document at the start of `right` produce the same blocks
+/// as a serial parse?  The blocks of `left` are correct, except that the last
+/// one was ended by the end of the chunk rather than by the line that follows
+/// it.  So re-parse from that block through the first block of `right`, and
+/// check that nothing changes.
+static bool parallel_parse_joins(mmd_engine * scratch, parse_chunk * left, parse_chunk * right) {
+	const char * str = scratch->dstr->str;
+	token * first = right->doc->child;
 
-	mmd_engine * e = mmd_engine_create_with_dstring(source, 0);
-	result = mmd_engine_metadata_keys(e);
+	if ((left->doc->child == NULL) || (first == NULL) || (first->start != right->start)) {
+		return false;
+	}
 
-	mmd_engine_free(e, false);
+	token * before = left->doc->child->tail;
 
-	return result;
-}
+	// A leading space is lexed differently at the very start of the text
+	// than after a newline, so don't start the range on such a line
+	while (before->prev && (str[line_start(str, before->start)] == ' ')) {
+		before = before->prev;
+	}
 
+	size_t win_start = line_start(str, before->start);
+	size_t win_end = (first->next) ? line_start(str, first->next->start) : right->start + right->len;
 
-/// Return metadata keys, one per line
-/// Returned char * must be freed
-char * mmd_engine_metadata_keys(mmd_engine * e) {
-	if (e->metadata_stack->size == 0) {
-		// Ensure we have checked for metadata
-		if (!mmd_engine_has_metadata(e, NULL)) {
-			return NULL;
-		}
+	if (win_start < left->start) {
+		win_start = left->start;
 	}
 
-	char * result = NULL;
-	DString * output = d_string_new("");
-
-	meta * m;
+	struct pool * previous_pool = mmd_engine_pool_enter(scratch);
 
-	for (int i = 0; i < e->metadata_stack->size; ++i) {
-		m = stack_peek_index(e->metadata_stack, i);
+	unsigned long old_ext = scratch->extensions;
 
-		d_string_append_printf(output, "%s\n", m->key);
+	if (win_start != 0) {
+		scratch->extensions |= EXT_NO_METADATA;
 	}
 
-	result = output->str;
-	d_string_free(output, false);
+	token * doc = mmd_engine_parse_range(scratch, win_start, win_end - win_start, true);
+	token * b = doc->child;
+	bool joins = true;
 
-	return result;
-}
+	for (token * a = before; a && joins; a = a->next) {
+		joins = b && token_block_matches(a, b);
 
+		b = (b) ? b->next : NULL;
+	}
 
-/// Extract desired metadata as string value
-/// Returned char * must be freed
-char * mmd_string_metavalue_for_key(char * source, const char * key) {
-	char * result;
+	joins = joins && b && token_block_matches(first, b);
 
-	mmd_engine * e = mmd_engine_create_with_string(source, 0);
-	result = mmd_engine_metavalue_for_key(e, key);
+	token_tree_free(doc);
 
-	if (result) {
-		// We need to return a copy of the string
-		result = my_strdup(result);
-	}
+	scratch->extensions = old_ext;
+	mmd_engine_reset(scratch);
 
-	mmd_engine_free(e, true);
+	mmd_engine_pool_exit(previous_pool);
+
+	return joins;
+}
+
+
+/// Move block pointers from one stack to the end of another
+static void stack_move_all(stack * to, stack * from) {
+	for (size_t i = 0; i < from->size; ++i) {
+		stack_push(to, from->element[i]);
+	}
+
+	from->size = 0;
+}
+
+
+/// Parse a large range by splitting it into chunks that are parsed on
+/// separate threads, and then joined back together.  Returns NULL, having
+/// parsed nothing, if the range can't be split or if the chunks don't join
+/// up exactly as a serial parse would have produced them.
+///
+/// The first chunk is parsed by the calling thread, so stats for it are
+/// collected as usual, and the time waiting for the others is counted as
+/// block parsing.
+static token * mmd_engine_parse_parallel(mmd_engine * e, size_t byte_start, size_t byte_len, int threads, size_t min_chunk) {
+	// Don't bother with chunks that are too small
+	if (byte_len / min_chunk < (size_t) threads) {
+		threads = (int)(byte_len / min_chunk);
+	}
+
+	if (threads < 2) {
+		return NULL;
+	}
+
+	size_t * splits = malloc(sizeof(size_t) * threads);
+	int count = parallel_parse_splits(e->dstr->str, byte_start, byte_len, splits, threads) + 1;
+
+	if (count < 2) {
+		free(splits);
+		return NULL;
+	}
+
+	parse_chunk * chunks = calloc(count, sizeof(parse_chunk));
+
+	for (int i = 0; i < count; ++i) {
+		chunks[i].start = (i) ? splits[i - 1] : byte_start;
+		chunks[i].len = ((i < count - 1) ? splits[i] : byte_start + byte_len) - chunks[i].start;
+	}
+
+	free(splits);
+
+	for (int i = 1; i < count; ++i) {
+		chunks[i].e = mmd_engine_create(e->dstr, e->extensions | EXT_NO_METADATA);
+		mmd_engine_set_language(chunks[i].e, e->language);
+		mmd_engine_set_stats_enabled(chunks[i].e, e->stats != NULL);
+
+		chunks[i].threaded = mmd_thread_create(&chunks[i].thread, 0, parse_chunk_run, &chunks[i]);
+	}
+
+	chunks[0].e = e;
+	chunks[0].doc = mmd_engine_parse_range(e, chunks[0].start, chunks[0].len, true);
+
+	double lap = mmd_stats_clock(e);
+
+	for (int i = 1; i < count; ++i) {
+		if (chunks[i].threaded) {
+			mmd_thread_join(chunks[i].thread);
+		} else {
+			parse_chunk_run(&chunks[i]);
+		}
+	}
+
+	// Check each split against a serial parse of the blocks around it
+	mmd_engine * scratch = mmd_engine_create(e->dstr, e->extensions);
+	mmd_engine_set_language(scratch, e->language);
+
+	bool joins = true;
+
+	for (int i = 1; (i < count) && joins; ++i) {
+		joins = parallel_parse_joins(scratch, &chunks[i - 1], &chunks[i]);
+	}
+
+	mmd_engine_free(scratch, false);
+	token * doc = chunks[0].doc;
+
+	for (int i = 1; i < count; ++i) {
+		mmd_engine * c = chunks[i].e;
+
+		if (joins) {
+			token_append_child(doc, chunks[i].doc->child);
+			chunks[i].doc->child = NULL;
+
+			stack_move_all(e->definition_stack, c->definition_stack);
+			stack_move_all(e->header_stack, c->header_stack);
+			stack_move_all(e->table_stack, c->table_stack);
+
+			if (e->stats) {
+				e->stats->string_reallocations += c->stats->string_reallocations;
+
+				if (c->stats->parse_depth_max > e->stats->parse_depth_max) {
+					e->stats->parse_depth_max = c->stats->parse_depth_max;
+				}
+			}
+
+#ifdef kUseObjectPool
+			// Tokens now belong to the main engine
+			pool_adopt(e->token_pool, c->token_pool);
+#endif
+		}
+
+		token_free(chunks[i].doc);
+		mmd_engine_free(c, false);
+	}
+
+	free(chunks);
+
+	if (!joins) {
+		// Start over, and let the caller parse serially
+		token_tree_free(doc);
+		mmd_engine_reset(e);
+
+		return NULL;
+	}
+
+	mmd_stats_lap(e, PHASE_PARSE_BLOCKS, lap);
+
+	return doc;
+}
+
+
+/// Update a stack of block pointers after re-parsing part of the document.
+/// Entries from `old_size` on were added by the new parse.  Old entries in
+/// [win_start, old_end) belong to blocks that were replaced, and new entries
+/// from `new_end` on belong to blocks that will be discarded.
+static void stack_splice_range(stack * s, size_t old_size, size_t win_start, size_t old_end, size_t new_end) {
+	stack * suffix = stack_new(0);
+	size_t count = 0;
+	token * t;
+
+	// Keep old entries before the window, and hold on to those after it
+	for (size_t i = 0; i < old_size; ++i) {
+		t = s->element[i];
+
+		if (t->start < win_start) {
+			s->element[count++] = t;
+		} else if (t->start >= old_end) {
+			stack_push(suffix, t);
+		}
+	}
+
+	// New entries for the re-parsed blocks
+	for (size_t i = old_size; i < s->size; ++i) {
+		t = s->element[i];
+
+		if (t->start < new_end) {
+			s->element[count++] = t;
+		}
+	}
+
+	s->size = count;
+
+	for (size_t i = 0; i < suffix->size; ++i) {
+		stack_push(s, suffix->element[i]);
+	}
+
+	stack_free(suffix);
+}
+
+
+/// Apply an edit to the source text, and update the token tree by re-parsing
+/// only the top level blocks surrounding the edit.
+///
+/// The re-parsed range starts one block before the edit, since the end of that
+/// block depends on the first line of the next.  It ends one block after the
+/// edit, and that last block is only kept from the old tree if the new parse
+/// produces the same block at the same place (otherwise the range grows).
+/// Beyond that point the text is unchanged, so the old blocks are reused with
+/// their offsets shifted.
+void mmd_engine_apply_edit(mmd_engine * e, size_t start, size_t old_len, const char * new_text) {
+	if (e == NULL) {
+		return;
+	}
+
+	if (start > e->dstr->currentStringLength) {
+		start = e->dstr->currentStringLength;
+	}
+
+	if (old_len > e->dstr->currentStringLength - start) {
+		old_len = e->dstr->currentStringLength - start;
+	}
+
+	if (new_text == NULL) {
+		new_text = "";
+	}
+
+	size_t edit_end = start + old_len;
+	long delta = (long) strlen(new_text) - (long) old_len;
+
+	token * root = e->root;
+	bool incremental = root && root->child && !e->root_exported &&
+					   !(e->extensions & (EXT_PARSE_OPML | EXT_PARSE_ITMZ));
+
+#ifdef kUseCompactTokens
+
+	// Let the full parse report that the document is too large
+	if (e->dstr->currentStringLength - old_len + strlen(new_text) > kTokenOffsetMax) {
+		incremental = false;
+	}
+
+#endif
+
+#ifdef kUseObjectPool
+
+	// Replaced tokens aren't released until the pool is drained, so once we
+	// have re-parsed as much as the whole document, start over
+	if (e->reparsed_bytes > e->dstr->currentStringLength) {
+		incremental = false;
+	}
+
+#endif
+
+	size_t meta_end = 0;
+
+	token * before = NULL;			// Last block that ends before the edit
+	token * after = NULL;			// First block that starts after the edit
+	token * b;
+
+	if (incremental) {
+		const char * str = e->dstr->str;
+
+		b = root->child;
+
+		while (b->next && (line_start(str, b->next->start) < start)) {
+			before = b;
+			b = b->next;
+		}
+
+		// A leading space is lexed differently at the very start of the text
+		// than after a newline, so don't start the range on such a line
+		while (before && (str[line_start(str, before->start)] == ' ')) {
+			before = before->prev;
+		}
+
+		// Lines before the first empty line may be metadata, so re-parse all
+		// of them from the beginning if any are involved
+		meta_end = metadata_end(str, e->dstr->currentStringLength);
+
+		if (before && (line_start(str, before->start) <= meta_end)) {
+			before = NULL;
+		}
+
+		after = b;
+
+		while (after && ((line_start(str, after->start) <= edit_end) ||
+						 (!before && (after->start <= meta_end)))) {
+			after = after->next;
+		}
+	}
+
+	// Update source text
+	d_string_erase(e->dstr, start, old_len);
+	d_string_insert(e->dstr, start, new_text);
+
+	if (!incremental) {
+		mmd_engine_parse_string(e);
+		return;
+	}
+
+	struct pool * previous_pool = mmd_engine_pool_enter(e);
+
+	const char * str = e->dstr->str;
+	size_t doc_len = e->dstr->currentStringLength;
+	size_t win_start = (before) ? line_start(str, before->start) : 0;
+	size_t win_end;
+
+	token * first = (before) ? before : root->child;
+	token * doc;
+	token * boundary;
+
+	size_t header_count = e->header_stack->size;
+	size_t definition_count = e->definition_stack->size;
+	size_t table_count = e->table_stack->size;
+
+	// Disable metadata unless we are starting at the beginning
+	unsigned long old_ext = e->extensions;
+
+	if (win_start != 0) {
+		e->extensions |= EXT_NO_METADATA;
+	}
+
+	if (win_start == 0) {
+		meta_end = metadata_end(str, doc_len);
+	}
+
+	for (int grow = 1; ; grow *= 2) {
+		if (win_start == 0) {
+			// Metadata is re-parsed along with the first block
+			mmd_engine_metadata_index_clear(e);
+
+			while (e->metadata_stack->size) {
+				meta_free(stack_pop(e->metadata_stack));
+			}
+		}
+
+		// Text from `after` on is unchanged, but shifted by delta
+		if (after && after->next) {
+			win_end = line_start(str, after->next->start + delta);
+		} else {
+			win_end = doc_len;
+		}
+
+#ifdef kUseObjectPool
+		e->reparsed_bytes += win_end - win_start;
+#endif
+
+		// Parsing uses e->root as scratch space
+		e->root = NULL;
+		doc = mmd_engine_parse_range(e, win_start, win_end - win_start, true);
+		e->root = root;
+
+		boundary = NULL;
+
+		if (after == NULL) {
+			break;
+		}
+
+		// Did the new parse produce the same block where `after` starts?
+		for (b = doc->child; b; b = b->next) {
+			if ((b->start == after->start + delta) && ((win_start != 0) || (b->start > meta_end))) {
+				if ((b->type == after->type) && (b->len == after->len) &&
+						token_tree_matches(after->child, b->child, delta)) {
+					boundary = b;
+				}
+
+				break;
+			}
+		}
+
+		if (boundary) {
+			break;
+		}
+
+		// Try again with a bigger range
+		token_tree_free(doc);
+
+		e->header_stack->size = header_count;
+		e->definition_stack->size = definition_count;
+		e->table_stack->size = table_count;
+
+		for (int i = 0; (i < grow) && after; ++i) {
+			after = after->next;
+		}
+	}
+
+	e->extensions = old_ext;
+
+	// Update stacks -- old offsets refer to the text before the edit
+	size_t old_end = (after) ? after->start : (size_t) - 1;
+	size_t new_end = (after) ? after->start + delta : (size_t) - 1;
+
+	stack_splice_range(e->header_stack, header_count, win_start, old_end, new_end);
+	stack_splice_range(e->definition_stack, definition_count, win_start, old_end, new_end);
+	stack_splice_range(e->table_stack, table_count, win_start, old_end, new_end);
+
+	// Detach new blocks from the re-parsed range, discarding any that
+	// duplicate `after` and beyond
+	token * new_blocks = doc->child;
+	token * new_last = NULL;
+
+	doc->child = NULL;
+	token_free(doc);
+
+	if (boundary) {
+		if (boundary->prev) {
+			new_last = boundary->prev;
+			new_last->next = NULL;
+		} else {
+			new_blocks = NULL;
+		}
+
+		boundary->prev = NULL;
+		token_tree_free(boundary);
+	} else if (new_blocks) {
+		new_last = new_blocks;
+
+		while (new_last->next) {
+			new_last = new_last->next;
+		}
+	}
+
+	// Swap old blocks for new ones
+	token * prev = first->prev;
+
+	if (after && after->prev) {
+		after->prev->next = NULL;
+	}
+
+	first->prev = NULL;
+	token_tree_free(first);
+
+	if (new_blocks) {
+		new_blocks->prev = prev;
+		new_last->next = after;
+	}
+
+	if (prev) {
+		prev->next = (new_blocks) ? new_blocks : after;
+	} else {
+		root->child = (new_blocks) ? new_blocks : after;
+	}
+
+	if (after) {
+		after->prev = (new_blocks) ? new_last : prev;
+
+		token_tree_shift(after, delta);
+	}
+
+	// Fix chain tail and document length
+	if (root->child) {
+		b = root->child;
+
+		while (b->next) {
+			b = b->next;
+		}
+
+		root->child->tail = b;
+		root->len = b->start + b->len - root->start;
+	} else {
+		root->len = 0;
+	}
+
+	mmd_engine_pool_exit(previous_pool);
+}
+
+
+#ifdef TEST
+static void check_apply_edit(CuTest * tc, const char * source, size_t start, size_t old_len, const char * new_text) {
+	mmd_engine * e = mmd_engine_create_with_string(source, EXT_SMART | EXT_NOTES);
+	mmd_engine_parse_string(e);
+
+	mmd_engine_apply_edit(e, start, old_len, new_text);
+
+	mmd_engine * full = mmd_engine_create_with_string(e->dstr->str, EXT_SMART | EXT_NOTES);
+	mmd_engine_parse_string(full);
+
+	CuAssertTrue(tc, token_tree_matches(full->root->child, e->root->child, 0));
+	CuAssertIntEquals(tc, full->root->len, e->root->len);
+	CuAssertIntEquals(tc, full->header_stack->size, e->header_stack->size);
+	CuAssertIntEquals(tc, full->definition_stack->size, e->definition_stack->size);
+	CuAssertIntEquals(tc, full->metadata_stack->size, e->metadata_stack->size);
+
+	mmd_engine_free(full, true);
+	mmd_engine_free(e, true);
+}
+
+
+void Test_mmd_engine_apply_edit(CuTest * tc) {
+	const char * source = "Title: foo\nAuthor: bar\n\n# One #\n\nSome *text*.\n\n* a\n* b\n\n[foo]: http://example.net\n\n## Two ##\n\nMore text.\n";
+
+	// Edit inside a paragraph
+	check_apply_edit(tc, source, 39, 4, "words");
+
+	// Join two blocks, and split them again
+	check_apply_edit(tc, source, 45, 2, " ");
+	check_apply_edit(tc, source, 37, 0, "\n\n");
+
+	// Change block types
+	check_apply_edit(tc, source, 33, 0, "> ");
+	check_apply_edit(tc, source, 56, 0, "```\n");
+
+	// Metadata
+	check_apply_edit(tc, source, 11, 6, "Date");
+	check_apply_edit(tc, source, 23, 1, "");
+
+	// Start and end of document
+	check_apply_edit(tc, source, 0, 0, "Text\n\n");
+	check_apply_edit(tc, source, strlen(source), 0, "\n[^1]: Note\n");
+
+	// Replace everything
+	check_apply_edit(tc, source, 0, strlen(source), "Just one line.");
+}
+#endif
+
+
+#ifdef TEST
+void Test_mmd_engine_stats(CuTest * tc) {
+	mmd_engine * e = mmd_engine_create_with_string("# Header #\n\nSome *text*.\n\n> * a\n> * b\n", 0);
+
+	CuAssertPtrEquals(tc, NULL, (void *) mmd_engine_stats(e));
+
+	mmd_engine_set_stats_enabled(e, true);
+	DString * out = mmd_engine_convert_to_data(e, FORMAT_HTML, NULL);
+	const mmd_stats * stats = mmd_engine_stats(e);
+
+	CuAssertPtrNotNull(tc, stats);
+	CuAssertTrue(tc, stats->phase_time[PHASE_TOKENIZE] >= 0);
+	CuAssertTrue(tc, stats->parse_depth_max >= 2);
+	CuAssertTrue(tc, stats->export_depth_max >= 3);
+#ifdef kUseObjectPool
+	CuAssertTrue(tc, stats->tokens_allocated > 0);
+	CuAssertIntEquals(tc, 1, stats->pool_slabs);
+#endif
+
+	CuAssertStrEquals(tc, "tokenize", mmd_stats_phase_name(PHASE_TOKENIZE));
+	CuAssertPtrEquals(tc, NULL, (void *) mmd_stats_phase_name(PHASE_COUNT));
+
+	mmd_engine_set_stats_enabled(e, false);
+	CuAssertPtrEquals(tc, NULL, (void *) mmd_engine_stats(e));
+
+	d_string_free(out, true);
+	mmd_engine_free(e, true);
+}
+#endif
+
+
+#ifdef TEST
+/// Parse in parallel with tiny chunks, and check against a serial parse
+static void check_parse_parallel(CuTest * tc, const char * source, bool split) {
+	mmd_engine * s = mmd_engine_create_with_string(source, EXT_SMART | EXT_NOTES);
+	mmd_engine * p = mmd_engine_create_with_string(source, EXT_SMART | EXT_NOTES);
+
+	mmd_engine_parse_string(s);
+
+	struct pool * previous_pool = mmd_engine_pool_enter(p);
+	p->root = mmd_engine_parse_parallel(p, 0, p->dstr->currentStringLength, 4, 8);
+	mmd_engine_pool_exit(previous_pool);
+
+	if (!split) {
+		CuAssertPtrEquals(tc, NULL, p->root);
+		mmd_engine_parse_string(p);
+	}
+
+	CuAssertPtrNotNull(tc, p->root);
+	CuAssertTrue(tc, token_tree_matches(s->root, p->root, 0));
+	CuAssertIntEquals(tc, s->header_stack->size, p->header_stack->size);
+	CuAssertIntEquals(tc, s->definition_stack->size, p->definition_stack->size);
+	CuAssertIntEquals(tc, s->table_stack->size, p->table_stack->size);
+	CuAssertIntEquals(tc, s->metadata_stack->size, p->metadata_stack->size);
+
+	for (int i = 0; i < s->header_stack->size; ++i) {
+		CuAssertIntEquals(tc, ((token *)stack_peek_index(s->header_stack, i))->start, ((token *)stack_peek_index(p->header_stack, i))->start);
+	}
+
+	DString * s_out = d_string_new("");
+	DString * p_out = d_string_new("");
+
+	mmd_engine_export_token_tree(s_out, s, FORMAT_HTML);
+	mmd_engine_export_token_tree(p_out, p, FORMAT_HTML);
+
+	CuAssertStrEquals(tc, s_out->str, p_out->str);
+
+	d_string_free(s_out, true);
+	d_string_free(p_out, true);
+	mmd_engine_free(s, true);
+	mmd_engine_free(p, true);
+}
+
+
+void Test_mmd_engine_parse_parallel(CuTest * tc) {
+	check_parse_parallel(tc, "Title: Test\n\n# First #\n\nSome *text* and a [link].\n\n"
+						 "```\ncode\n\nmore code\n```\n\nSecond\n======\n\n| a | b |\n|---|---|\n| 1 | 2 |\n\n"
+						 "Term\n: Definition\n\n[link]: http://example.net/\n\nFinal paragraph[^note].\n\n"
+						 "[^note]: A footnote\n\n    with more\n\nThe end\n", true);
+
+	// Nowhere to split outside of the code block and comment
+	check_parse_parallel(tc, "Some text\n\n<!--\n\nNot here\n\n--> x\n\nNor here\n\n-->\n\n"
+						 "````\ncode\n\nmore\n\n``` x\n\nstill code\n\n```\n\nStill code\n", false);
+}
+
+
+/// A substring is parsed as though it were the whole text, ending with an
+/// empty line, but a chunk of a larger parse is not
+void Test_mmd_engine_parse_substring(CuTest * tc) {
+	mmd_engine * e = mmd_engine_create_with_string("One\nTwo\n", 0);
+	mmd_engine * c = mmd_engine_create_with_string("One\nTwo\n", 0);
+	mmd_engine * whole = mmd_engine_create_with_string("One\n", 0);
+
+	mmd_engine_parse_string(whole);
+	e->root = mmd_engine_parse_substring(e, 0, 4);
+
+	CuAssertTrue(tc, token_tree_matches(whole->root, e->root, 0));
+	CuAssertPtrNotNull(tc, e->root->child->next);
+
+	struct pool * previous_pool = mmd_engine_pool_enter(c);
+	c->root = mmd_engine_parse_range(c, 0, 4, true);
+	mmd_engine_pool_exit(previous_pool);
+
+	CuAssertIntEquals(tc, e->root->child->type, c->root->child->type);
+	CuAssertPtrEquals(tc, NULL, c->root->child->next);
+
+	mmd_engine_free(whole, true);
+	mmd_engine_free(c, true);
+	mmd_engine_free(e, true);
+}
+#endif
+
+
+#ifdef TEST
+void Test_token_type_mask(CuTest * tc) {
+	mmd_engine * e = mmd_engine_create_with_string("Plain text.\n\nSome *text*.\n\n* item\n* [link]\n\n> Quote\n", 0);
+	mmd_engine_parse_string(e);
+
+	token * plain = e->root->child;
+	token * emph = plain->next->next;
+	token * list = emph->next->next;
+	token * quote = list->next;
+
+	CuAssertIntEquals(tc, BLOCK_PARA, plain->type);
+	CuAssertIntEquals(tc, TYPE_BIT_KNOWN, plain->type_mask);
+	CuAssertTrue(tc, !token_may_contain(plain, e->pairing_types[2] | e->pairing_types[3]));
+
+	CuAssertIntEquals(tc, BLOCK_PARA, emph->type);
+	CuAssertTrue(tc, token_may_contain(emph, TYPE_BIT_EMPH));
+	CuAssertTrue(tc, !token_may_contain(emph, TYPE_BIT_BRACKET));
+
+	CuAssertIntEquals(tc, BLOCK_LIST_BULLETED, list->type);
+	CuAssertTrue(tc, token_may_contain(list, TYPE_BIT_BRACKET));
+	CuAssertTrue(tc, !token_may_contain(list->child, TYPE_BIT_BRACKET));
+
+	CuAssertIntEquals(tc, BLOCK_BLOCKQUOTE, quote->type);
+	CuAssertTrue(tc, quote->type_mask & TYPE_BIT_KNOWN);
+	CuAssertTrue(tc, !token_may_contain(quote, TYPE_BIT_EMPH));
+
+	// Blocks built elsewhere could contain anything
+	token * t = token_new(BLOCK_PARA, 0, 0);
+	CuAssertTrue(tc, token_may_contain(t, TYPE_BIT_EMPH));
+	token_free(t);
+
+	mmd_engine_free(e, true);
+}
+#endif
+
+
+/// Does the text have metadata?
+bool mmd_string_has_metadata(char * source, size_t * end) {
+	bool result;
+
+	mmd_engine * e = mmd_engine_create_with_string(source, 0);
+	result = mmd_engine_has_metadata(e, end);
+
+	mmd_engine_free(e, true);
+
+	return result;
+}
+
+
+/// Does the text have metadata?
+bool mmd_d_string_has_metadata(DString * source, size_t * end) {
+	bool result;
+
+	mmd_engine * e = mmd_engine_create_with_dstring(source, 0);
+	result = mmd_engine_has_metadata(e, end);
+
+	mmd_engine_free(e, false);
+
+	return result;
+}
+
+
+/// Scan metadata at the start of the text without tokenizing it.  This
+/// handles the usual headers -- MMD or YAML ("---") style, with unindented
+/// `key: value` and continuation lines, ending at an empty line or the end
+/// of the text.  Metadata is added to the stack the same way
+/// `strip_line_tokens_from_metadata()` would.
+///
+/// Returns 1 if there is metadata, 0 if there is not, or -1 if the text
+/// needs the full parser to decide (nothing is changed in that case).
+static short mmd_engine_scan_metadata(mmd_engine * e, size_t * end) {
+	if ((e->extensions & EXT_COMPATIBILITY) || (e->extensions & EXT_NO_METADATA)) {
+		return 0;
+	}
+
+	const char * source = e->dstr->str;
+	size_t source_len = e->dstr->currentStringLength;
+
+	size_t line = 0;		// Start of current line
+	size_t stop;			// End of line text
+	size_t next;			// Start of next line
+	size_t len;
+	size_t count = 0;		// Metadata lines found
+	size_t first = e->metadata_stack->size;
+	bool yaml = false;
+
+	meta * m = NULL;
+	DString * d = d_string_new("");
+
+	while (line < source_len) {
+		stop = line;
+
+		while ((stop < source_len) && !char_is_line_ending(source[stop])) {
+			stop++;
+		}
+
+		next = stop;
+
+		if (next < source_len) {
+			if (source[next] == '\0') {
+				goto full_parse;
+			}
+
+			next += ((source[next] == '\r') && (source[next + 1] == '\n')) ? 2 : 1;
+		}
+
+		if (stop == line) {
+			// Empty line ends metadata
+			break;
+		}
+
+		if ((line == 0) && (stop == 3) && (next > stop) && (strncmp(source, "---", 3) == 0)) {
+			// YAML style
+			yaml = true;
+			line = next;
+			continue;
+		}
+
+		if (!char_is_alpha(source[line])) {
+			// Could be indented continuation, HTML, a fence, etc.
+			goto full_parse;
+		}
+
+		if ((scan_url(&source[line]) == 0) && scan_meta_line(&source[line])) {
+			if ((count == 0) && !yaml && (next > stop) && scan_empty_meta_line(&source[line])) {
+				// Don't start metadata with empty meta line (e.g. "foo:\n")
+				d_string_free(d, true);
+				return 0;
+			}
+
+			if (m) {
+				meta_set_value(m, d->str);
+				d_string_erase(d, 0, -1);
+			}
+
+			len = scan_meta_key(&source[line]);
+			m = meta_new(source, line, len);
+			stack_push(e->metadata_stack, m);
+
+			line += len + 1;
+			len = next - line;
+
+			if (char_is_line_ending(source[line + len])) {
+				len--;
+			}
+
+			d_string_append_c_array(d, &source[line], len);
+		} else if (count == 0) {
+			// Not metadata unless opened with YAML marker
+			d_string_free(d, true);
+			return (yaml) ? -1 : 0;
+		} else if (memchr(&source[line], '|', stop - line)) {
+			// Could be a table
+			goto full_parse;
+		} else {
+			// Continuation line
+			d_string_append_c(d, '\n');
+			d_string_append_c_array(d, &source[line], next - line);
+		}
+
+		count++;
+		line = next;
+	}
+
+	if (count == 0) {
+		goto full_parse;
+	}
+
+	// Finish last line
+	meta_set_value(m, d->str);
+	d_string_free(d, true);
+
+	if (end) {
+		*end = line;
+	}
+
+	return 1;
+
+full_parse:
+
+	while (e->metadata_stack->size > first) {
+		meta_free(stack_pop(e->metadata_stack));
+	}
+
+	d_string_free(d, true);
+	return -1;
+}
+
+
+/// Does the text have metadata?
+bool mmd_engine_has_metadata(mmd_engine * e, size_t * end) {
+	bool result = false;
+	token * old_root;
+	mmd_engine * temp = NULL;
+
+	if (!e) {
+		return false;
+	}
+
+	if (!(scan_meta_line(&e->dstr->str[0]))) {
+		// First line is not metadata, so can't have metadata
+		// Saves the time of an unnecessary parse
+		if (end) {
+			*end = 0;
+		}
+
+		return false;
+	}
+
+	// Preserve existing parse tree (if any)
+	old_root = e->root;
+
+	if (!(old_root &&
+			(old_root->type == DOC_START_TOKEN) &&
+			(old_root->len == e->dstr->currentStringLength))) {
+		// Most metadata can be scanned without tokenizing
+		switch (mmd_engine_scan_metadata(e, end)) {
+			case 0:
+				return false;
+
+			case 1:
+				return true;
+		}
+	}
+
+	// Allocate tokens from this engine's pool
+	struct pool * previous_pool = mmd_engine_pool_enter(e);
+
+	token * doc = NULL;
+
+	if (old_root &&
+			(old_root->type == DOC_START_TOKEN) &&
+			(old_root->len == e->dstr->currentStringLength)
+	   ) {
+		// Already parsed
+		doc = old_root;
+	} else {
+		// Store stack sizes
+		temp = mmd_engine_create(NULL, 0);
+
+		temp->abbreviation_stack->size = e->abbreviation_stack->size;
+		temp->citation_stack->size = e->citation_stack->size;
+		temp->definition_stack->size = e->definition_stack->size;
+		temp->footnote_stack->size = e->footnote_stack->size;
+		temp->glossary_stack->size = e->glossary_stack->size;
+		temp->header_stack->size = e->header_stack->size;
+		temp->link_stack->size = e->link_stack->size;
+		temp->metadata_stack->size = e->metadata_stack->size;
+		temp->table_stack->size = e->table_stack->size;
+
+
+		// Tokenize the string (up until first empty line)
+		doc = mmd_tokenize_string(e, 0, e->dstr->currentStringLength, true);
+
+		// Parse tokens into blocks
+		mmd_parse_token_chain(e, doc);
+	}
+
+	if (doc) {
+		if (doc->child && doc->child->type == BLOCK_META) {
+			result = true;
+
+			if (end) {
+				*end = doc->child->len;
+			}
+		}
+
+		if (old_root != doc) {
+			token_tree_free(doc);
+
+			// Reset stack sizes
+			// Except metadata stack, since we will need that for any subseqeunt requests
+			// TODO: May need a more robust approach for this in the future
+			e->abbreviation_stack->size =	temp->abbreviation_stack->size;
+			e->citation_stack->size = 		temp->citation_stack->size;
+			e->definition_stack->size = 	temp->definition_stack->size;
+			e->footnote_stack->size = 		temp->footnote_stack->size;
+			e->glossary_stack->size = 		temp->glossary_stack->size;
+			e->header_stack->size = 		temp->header_stack->size;
+			e->link_stack->size = 			temp->link_stack->size;
+//			e->metadata_stack->size = 		temp->metadata_stack->size;
+			e->table_stack->size = 			temp->table_stack->size;
+
+			// And reset temp stack sizes
+			temp->abbreviation_stack->size =	0;
+			temp->citation_stack->size = 		0;
+			temp->definition_stack->size = 		0;
+			temp->footnote_stack->size = 		0;
+			temp->glossary_stack->size = 		0;
+			temp->header_stack->size = 			0;
+			temp->link_stack->size = 			0;
+			temp->metadata_stack->size = 		0;
+			temp->table_stack->size = 			0;
+
+			mmd_engine_free(temp, true);
+		}
+	}
+
+	// Restore previous parse tree
+	e->root = old_root;
+
+	mmd_engine_pool_exit(previous_pool);
+
+	return result;
+}
+
+
+/// Return metadata keys, one per line
+/// Returned char * must be freed
+char * mmd_string_metadata_keys(char * source) {
+	char * result;
+
+	mmd_engine * e = mmd_engine_create_with_string(source, 0);
+	result = mmd_engine_metadata_keys(e);
+
+	mmd_engine_free(e, true);
+
+	return result;
+}
+
+
+/// Return metadata keys, one per line
+/// Returned char * must be freed
+char * mmd_d_string_metadata_keys(DString * source) {
+	char * result;
+
+	mmd_engine * e = mmd_engine_create_with_dstring(source, 0);
+	result = mmd_engine_metadata_keys(e);
+
+	mmd_engine_free(e, false);
+
+	return result;
+}
+
+
+/// Return metadata keys, one per line
+/// Returned char * must be freed
+char * mmd_engine_metadata_keys(mmd_engine * e) {
+	if (e->metadata_stack->size == 0) {
+		// Ensure we have checked for metadata
+		if (!mmd_engine_has_metadata(e, NULL)) {
+			return NULL;
+		}
+	}
+
+	char * result = NULL;
+	DString * output = d_string_new("");
+
+	meta * m;
+
+	for (int i = 0; i < e->metadata_stack->size; ++i) {
+		m = stack_peek_index(e->metadata_stack, i);
+
+		d_string_append_printf(output, "%s\n", m->key);
+	}
+
+	result = output->str;
+	d_string_free(output, false);
+
+	return result;
+}
+
+
+/// Extract desired metadata as string value
+/// Returned char * must be freed
+char * mmd_string_metavalue_for_key(char * source, const char * key) {
+	char * result;
+
+	mmd_engine * e = mmd_engine_create_with_string(source, 0);
+	result = mmd_engine_metavalue_for_key(e, key);
+
+	if (result) {
+		// We need to return a copy of the string
+		result = my_strdup(result);
+	}
+
+	mmd_engine_free(e, true);
 
 	return result;
 }
@@ -2604,6 +4153,33 @@ char * mmd_d_string_metavalue_for_key(DString * source, const char * key) {
 }
 
 
+/// Find metadata by normalized key.  Metadata added to the stack since the
+/// last lookup is indexed first; the first entry with a given key wins.
+static meta * mmd_engine_meta_for_key(mmd_engine * e, const char * clean) {
+	meta * m;
+	meta * found;
+
+	if (e->metadata_indexed > e->metadata_stack->size) {
+		// Stack was emptied behind our back
+		mmd_engine_metadata_index_clear(e);
+	}
+
+	while (e->metadata_indexed < e->metadata_stack->size) {
+		m = stack_peek_index(e->metadata_stack, e->metadata_indexed++);
+
+		HASH_FIND(engine_hh, e->metadata_index, m->key, strlen(m->key), found);
+
+		if (!found) {
+			HASH_ADD_KEYPTR(engine_hh, e->metadata_index, m->key, strlen(m->key), m);
+		}
+	}
+
+	HASH_FIND(engine_hh, e->metadata_index, clean, strlen(clean), m);
+
+	return m;
+}
+
+
 /// Grab metadata without processing entire document
 /// Returned char * does not need to be freed
 char * mmd_engine_metavalue_for_key(mmd_engine * e, const char * key) {
@@ -2618,24 +4194,50 @@ char * mmd_engine_metavalue_for_key(mmd_engine * e, const char * key) {
 		}
 	}
 
-	char * result = NULL;
 	char * clean = label_from_string(key);
+	meta * m = mmd_engine_meta_for_key(e, clean);
 
-	meta * m;
+	free(clean);
 
-	for (int i = 0; i < e->metadata_stack->size; ++i) {
-		m = stack_peek_index(e->metadata_stack, i);
+	return (m) ? m->value : NULL;
+}
 
-		if (strcmp(clean, m->key) == 0) {
-			// We have a match
-			free(clean);
-			return m->value;
-		}
-	}
 
-	free(clean);
-	return result;
+#ifdef TEST
+void Test_mmd_engine_scan_metadata(CuTest * tc) {
+	size_t end = 0;
+	mmd_engine * e = mmd_engine_create_with_string("---\nTitle: Foo\nAuthor: Me\nand you\n\nTitle: Body\n", 0);
+
+	CuAssertIntEquals(tc, 1, mmd_engine_scan_metadata(e, &end));
+	CuAssertIntEquals(tc, 34, end);
+	CuAssertIntEquals(tc, 2, e->metadata_stack->size);
+	CuAssertStrEquals(tc, "Foo", mmd_engine_metavalue_for_key(e, "TITLE"));
+	CuAssertStrEquals(tc, "Me and you", mmd_engine_metavalue_for_key(e, "author"));
+	CuAssertTrue(tc, mmd_engine_metavalue_for_key(e, "date") == NULL);
+
+	// Index is rebuilt after the metadata changes
+	mmd_engine_reset(e);
+	CuAssertTrue(tc, e->metadata_index == NULL);
+	CuAssertStrEquals(tc, "Foo", mmd_engine_metavalue_for_key(e, "title"));
+	CuAssertIntEquals(tc, 2, e->metadata_indexed);
+	mmd_engine_free(e, true);
+
+	// Empty first value means this is not metadata
+	e = mmd_engine_create_with_string("Title:\nAuthor: Me\n", 0);
+	CuAssertIntEquals(tc, 0, mmd_engine_scan_metadata(e, &end));
+	CuAssertTrue(tc, !mmd_engine_has_metadata(e, NULL));
+	mmd_engine_free(e, true);
+
+	// Indented continuation needs the parser
+	e = mmd_engine_create_with_string("Title: Foo\n\tBar\n", 0);
+	CuAssertIntEquals(tc, -1, mmd_engine_scan_metadata(e, &end));
+	CuAssertIntEquals(tc, 0, e->metadata_stack->size);
+	CuAssertTrue(tc, mmd_engine_has_metadata(e, &end));
+	CuAssertIntEquals(tc, 16, end);
+	CuAssertStrEquals(tc, "Foo Bar", mmd_engine_metavalue_for_key(e, "title"));
+	mmd_engine_free(e, true);
 }
+#endif
 
 
 /// Grab list of all transcluded files, but we need to know directory to search,
@@ -2890,44 +4492,52 @@ void mmd_d_string_convert_to_file(DString * source, unsigned long extensions, sh
 /// multiple documents (e.g. EPUB)
 void mmd_engine_convert_to_file(mmd_engine * e, short format, const char * directory, const char * filepath) {
 	FILE * output_stream;
-
-	DString * output = d_string_new("");
+	DString * output;
 
 	mmd_engine_parse_string(e);
 
-	mmd_engine_export_token_tree(output, e, format);
-
-	// Now we have the input source string, the output string, the (modified) parse tree, and engine stacks
-
 	switch (format) {
 		case FORMAT_EPUB:
-			epub_write_wrapper(filepath, output, e, directory);
-			break;
-
 		case FORMAT_TEXTBUNDLE:
-			// TODO: Need to implement this
-			break;
-
 		case FORMAT_TEXTBUNDLE_COMPRESSED:
-			textbundle_write_wrapper(filepath, output, e, directory);
+			output = d_string_new("");
+
+			mmd_engine_export_token_tree(output, e, format);
+
+			// Now we have the input source string, the output string, the (modified) parse tree, and engine stacks
+
+			if (format == FORMAT_EPUB) {
+				epub_write_wrapper(filepath, output, e, directory);
+			} else if (format == FORMAT_TEXTBUNDLE_COMPRESSED) {
+				textbundle_write_wrapper(filepath, output, e, directory);
+			}
+
+			// TODO: Need to implement FORMAT_TEXTBUNDLE
+
+			d_string_free(output, true);
 			break;
 
 		default:
 
-			// Basic formats just write to file
+			// Basic formats are written to file as they are exported
 			if (!(output_stream = fopen(filepath, "w"))) {
 				// Failed to open file
 				perror(filepath);
 			} else {
-				fputs(output->str, output_stream);
+				mmd_sink sink = {
+					.write = mmd_sink_write_to_file,
+					.context = output_stream,
+					.flush_threshold = kOutputFlushThreshold,
+				};
+
+				mmd_engine_export_token_tree_to_sink(&sink, e, format);
+
 				fputc('\n', output_stream);
 				fclose(output_stream);
 			}
 
 			break;
 	}
-
-	d_string_free(output, true);
 }
 
 
@@ -3056,17 +4666,9 @@ DString  * mmd_engine_convert_opml_to_text(mmd_engine * e) {
 
 	mmd_convert_opml_string(e, 0, e->dstr->currentStringLength);
 
-	// Swap original and engine
-	char * temp = e->dstr->str;
-	size_t size = e->dstr->currentStringLength;
-
-	// Replace engine copy with original OPML text
-	e->dstr->str = original->str;
-	e->dstr->currentStringLength = original->currentStringLength;
-
-	// Original now contains the processed text
-	original->str = temp;
-	original->currentStringLength = size;
+	// Swap original and engine -- engine gets original OPML text back, and
+	// original now contains the processed text
+	d_string_swap(e->dstr, original);
 
 	return original;
 }
@@ -3105,20 +4707,41 @@ DString  * mmd_engine_convert_itmz_to_text(mmd_engine * e) {
 
 	mmd_convert_itmz_string(e, 0, e->dstr->currentStringLength);
 
-	// Swap original and engine
-	char * temp = e->dstr->str;
-	size_t size = e->dstr->currentStringLength;
+	// Swap original and engine -- engine gets original ITMZ text back, and
+	// original now contains the processed text
+	d_string_swap(e->dstr, original);
 
-	// Replace engine copy with original ITMZ text
-	e->dstr->str = original->str;
-	e->dstr->currentStringLength = original->currentStringLength;
+	return original;
+}
 
-	// Original now contains the processed text
-	original->str = temp;
-	original->currentStringLength = size;
 
-	return original;
+#ifdef TEST
+void Test_mmd_string_convert_opml_to_text(CuTest * tc) {
+	// Results must survive the engine, including empty ones
+	DString * result = mmd_string_convert_opml_to_text("<opml><body></body></opml>");
+	CuAssertStrEquals(tc, "", result->str);
+	d_string_free(result, true);
+
+	result = mmd_string_convert_opml_to_text("<opml><body><outline text=\"Foo\" _note=\"bar\"/></body></opml>");
+	CuAssertStrEquals(tc, "# Foo #\nbar\n", result->str);
+	d_string_free(result, true);
+
+	// Original source is restored
+	DString * source = d_string_new("<opml><body></body></opml>");
+	result = mmd_d_string_convert_opml_to_text(source);
+	CuAssertStrEquals(tc, "<opml><body></body></opml>", source->str);
+	CuAssertStrEquals(tc, "", result->str);
+	d_string_free(result, true);
+	d_string_free(source, true);
+
+	// ITMZ round trip
+	DString * itmz = mmd_string_convert_to_data("# Foo #\n", 0, FORMAT_ITMZ, 0, NULL);
+	result = mmd_d_string_convert_itmz_to_text(itmz);
+	CuAssertStrEquals(tc, "# Foo #\n", result->str);
+	d_string_free(result, true);
+	d_string_free(itmz, true);
 }
+#endif
 
 
 /// Return string containing engine version.
@@ -57,6 +57,7 @@
 #define MMD_MULTIMARKDOWN_H
 
 #include "libMultiMarkdown.h"
+#include "token.h"
 #include "uthash.h"
 
 typedef struct token_pair_engine toke_pair_engine;
@@ -72,10 +73,11 @@ struct mmd_engine {
 
 	bool					allow_meta;
 
-	struct token_pair_engine 	*	pairings1;
-	struct token_pair_engine 	*	pairings2;
-	struct token_pair_engine 	*	pairings3;
-	struct token_pair_engine 	*	pairings4;
+	const struct token_pair_engine 	*	pairings1;	//!< Shared (read-only) pairing tables
+	const struct token_pair_engine 	*	pairings2;
+	const struct token_pair_engine 	*	pairings3;
+	const struct token_pair_engine 	*	pairings4;
+	uint32_t				pairing_types[4];	//!< Kinds of tokens used by each pairing table
 
 	stack 		*			abbreviation_stack;
 	stack 		*			citation_stack;
@@ -92,11 +94,44 @@ struct mmd_engine {
 	short					quotes_lang;
 
 	struct asset 	*		asset_hash;
+	struct meta 	*		metadata_index;			//!< Metadata by normalized key, for quick lookups
+	size_t					metadata_indexed;		//!< Entries of metadata_stack added to the index
 
 	int						random_seed_base_labels;
+
+	bool					root_exported;			//!< Export modifies the token tree, so it can't be reused
+
+	mmd_stats 		*		stats;					//!< NULL unless stats are enabled
+
+	int						parse_threads;			//!< Threads used to parse large documents
+	bool					range_continues;		//!< Is the range being tokenized followed by text parsed separately?
+
+	void 		**			parsers;				//!< Lemon parsers kept for reuse, one per parse recursion depth
+	unsigned short			parser_count;
+
+#ifdef kUseObjectPool
+	struct pool 	*		token_pool;				//!< Tokens belonging to this engine
+	size_t					reparsed_bytes;			//!< Source re-parsed since pool was last drained
+#endif
 };
 
 
+/// Make the engine's token pool the active pool for the current thread.
+/// Returns the previously active pool, which must be passed to
+/// `mmd_engine_pool_exit()` when done.
+struct pool * mmd_engine_pool_enter(mmd_engine * e);
+
+/// Restore the token pool that was active before `mmd_engine_pool_enter()`
+void mmd_engine_pool_exit(struct pool * previous);
+
+
+/// Current time for timing stats phases (0 if stats are not enabled)
+double mmd_stats_clock(mmd_engine * e);
+
+/// Add the time since `since` to a stats phase, and return the current time
+double mmd_stats_lap(mmd_engine * e, short phase, double since);
+
+
 /// Expose routines to lemon parser
 void recursive_parse_indent(mmd_engine * e, token * block);
 void recursive_parse_list_item(mmd_engine * e, token * block);
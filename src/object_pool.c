@@ -83,9 +83,13 @@ pool * pool_new(short size) {
 	if (p) {
 		p->object_size = size;
 
-		p->allocated = stack_new(1024);
+		p->allocated = stack_new(0);
 
-		pool_add_slab(p);
+		// Slabs are added on first use, so that unused pools are cheap
+		p->next = NULL;
+		p->last = NULL;
+
+		p->adopted_unused = 0;
 	}
 
 	return p;
@@ -119,6 +123,8 @@ void pool_drain(pool * p) {
 
 	p->next = NULL;
 	p->last = NULL;
+
+	p->adopted_unused = 0;
 }
 
 
@@ -139,3 +145,45 @@ void * pool_allocate_object(pool * p) {
 	return a;
 }
 
+
+/// Take over the slabs of another pool
+void pool_adopt(pool * p, pool * other) {
+	if ((p == NULL) || (other == NULL) || (other->allocated->size == 0)) {
+		return;
+	}
+
+	// Keep allocating from our current slab, which stays on top of the stack
+	void * current = (p->allocated->size) ? stack_pop(p->allocated) : NULL;
+
+	for (size_t i = 0; i < other->allocated->size; ++i) {
+		stack_push(p->allocated, stack_peek_index(other->allocated, i));
+	}
+
+	if (current) {
+		stack_push(p->allocated, current);
+	} else {
+		// Nothing left to allocate until a new slab is added
+		p->next = NULL;
+		p->last = NULL;
+	}
+
+	p->adopted_unused += other->adopted_unused + ((other->last - other->next) / other->object_size);
+
+	other->allocated->size = 0;
+	other->next = NULL;
+	other->last = NULL;
+	other->adopted_unused = 0;
+}
+
+
+/// How many objects have been allocated since the pool was last drained
+size_t pool_object_count(pool * p) {
+	if ((p == NULL) || (p->allocated->size == 0)) {
+		return 0;
+	}
+
+	// Every slab is full except for the end of the current one, and any
+	// space left over in adopted slabs
+	return (p->allocated->size * kNumberOfObjects) - ((p->last - p->next) / p->object_size) - p->adopted_unused;
+}
+
@@ -66,6 +66,7 @@ struct pool {
 	stack 	*		allocated;		//!< Stack of pointers to slabs that have been allocated
 	void 	*		next;			//!< Pointer to next available memory for allocation
 	void 	*		last;			//!< Pointer to end of available memory
+	size_t			adopted_unused;	//!< Objects never allocated in slabs taken from other pools
 	short			object_size;	//!< Size of individual objects to be allocated
 
 	char 			_PADDING[6];	//!< pad struct for alignment
@@ -98,4 +99,18 @@ void * pool_allocate_object(
 );
 
 
+/// Take over the slabs of another pool (with the same object size), so that
+/// its objects live until this pool is drained.  The other pool is left empty.
+void pool_adopt(
+	pool * p,						//!< Pool to receive the slabs
+	pool * other					//!< Pool to be emptied
+);
+
+
+/// How many objects have been allocated since the pool was last drained
+size_t pool_object_count(
+	pool * p						//!< Pool to be checked
+);
+
+
 #endif
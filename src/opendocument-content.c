@@ -727,7 +727,10 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 
 	switch (t->type) {
 		case DOC_START_TOKEN:
+			// Output can be passed along to a sink between top level blocks
+			scratch->sink_depth = scratch->recurse_depth + 1;
 			mmd_export_token_tree_opendocument(out, source, t->child, scratch);
+			scratch->sink_depth = -1;
 			break;
 
 		case AMPERSAND:
@@ -2206,6 +2209,10 @@ void mmd_export_token_tree_opendocument(DString * out, const char * source, toke
 
 	scratch->recurse_depth++;
 
+	if (scratch->recurse_depth > scratch->recurse_depth_max) {
+		scratch->recurse_depth_max = scratch->recurse_depth;
+	}
+
 	while (t != NULL) {
 		if (scratch->skip_token) {
 			scratch->skip_token--;
@@ -2214,6 +2221,10 @@ void mmd_export_token_tree_opendocument(DString * out, const char * source, toke
 		}
 
 		t = t->next;
+
+		if (scratch->recurse_depth == scratch->sink_depth) {
+			mmd_export_flush(out, scratch, false);
+		}
 	}
 
 	scratch->recurse_depth--;
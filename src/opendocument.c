@@ -979,14 +979,20 @@ DString * opendocument_core_file_create(DString * body, mmd_engine * e, const ch
 
 
 	// Clean up
-	free(result->str);
+	char * archive = NULL;
+	size_t archive_len = 0;
 
-	status = mz_zip_writer_finalize_heap_archive(zip, (void **) & (result->str), (size_t *) & (result->currentStringLength));
+	status = mz_zip_writer_finalize_heap_archive(zip, (void **) &archive, &archive_len);
 
 	if (!status) {
 		fprintf(stderr, "Error finalizing zip archive.\n");
+	} else {
+		d_string_adopt(result, archive, archive_len, archive_len);
 	}
 
+	mz_zip_writer_end(zip);
+	free(zip);
+
 	return result;
 }
 
@@ -339,13 +339,9 @@ void parse_opml_token_chain(mmd_engine * e, token * chain) {
 		// Append body to metadata
 		d_string_append_c_array(metadata, final->str, final->currentStringLength);
 
-		// TODO: How to safely swap the new text, given that we might not own e->dstr->str?
-
-		free(e->dstr->str);
-		e->dstr->str = metadata->str;
-		e->dstr->currentStringLength = metadata->currentStringLength;
-
-		d_string_free(metadata, false);
+		// Swap in the new text
+		size_t new_len = metadata->currentStringLength;
+		d_string_adopt(e->dstr, d_string_free(metadata, false), new_len, new_len + 1);
 		d_string_free(final, true);
 	} else {
 		// Unsuccessful parse -- free token chain
@@ -360,6 +356,10 @@ void parse_opml_token_chain(mmd_engine * e, token * chain) {
 
 /// Create a token chain from source OPML string
 void mmd_convert_opml_string(mmd_engine * e, size_t start, size_t len) {
+	struct pool * previous_pool = mmd_engine_pool_enter(e);
+
 	token * chain = tokenize_opml_string(e, start, len);
 	parse_opml_token_chain(e, chain);
+
+	mmd_engine_pool_exit(previous_pool);
 }
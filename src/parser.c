@@ -101,7 +101,7 @@ typedef union {
 	ParseTOKENTYPE yy0;
 } YYMINORTYPE;
 #ifndef YYSTACKDEPTH
-	#define YYSTACKDEPTH 100
+	#define YYSTACKDEPTH 32
 #endif
 #define ParseARG_SDECL  mmd_engine * engine ;
 #define ParseARG_PDECL , mmd_engine * engine
@@ -947,6 +947,8 @@ static void yyStackOverflow(yyParser * yypParser) {
 	/* Here code is inserted which will execute if the parser
 	** stack every overflows */
 	/******** Begin %stack_overflow code ******************************************/
+
+	fprintf(stderr, "Parser stack overflow.\n");
 	/******** End %stack_overflow code ********************************************/
 	ParseARG_STORE; /* Suppress warning about unused %extra_argument var */
 }
@@ -1721,6 +1723,7 @@ static void yy_reduce(
 			yytestcase(yyruleno == 78);
 			{
 				yylhsminor.yy0 = token_new_parent(yymsp[0].minor.yy0, BLOCK_LIST_ITEM_TIGHT);
+				yylhsminor.yy0->type_mask = yymsp[0].minor.yy0->type_mask;
 			}
 			yymsp[0].minor.yy0 = yylhsminor.yy0;
 			break;
@@ -2139,3 +2142,19 @@ void Parse(
 #endif
 	return;
 }
+
+
+/// Prepare an existing parser to parse a new token chain
+void ParseReset(void * p) {
+	yyParser * pParser = (yyParser *)p;
+
+	while (pParser->yytos > pParser->yystack) {
+		yy_pop_parser_stack(pParser);
+	}
+
+#ifndef YYNOERRORRECOVERY
+	pParser->yyerrcnt = -1;
+#endif
+	pParser->yystack[0].stateno = 0;
+	pParser->yystack[0].major = 0;
+}
@@ -307,7 +307,7 @@ list_bullet			::=	item_bullet.
 item_bullet(A)		::= LINE_LIST_BULLETED(B) ext_chunk(C).		{ A = token_new_parent(B, BLOCK_LIST_ITEM); token_chain_append(B, C); recursive_parse_list_item(engine, A); }
 item_bullet(A)		::= LINE_LIST_BULLETED(B) chunk(C).			{ A = token_new_parent(B, BLOCK_LIST_ITEM_TIGHT); token_chain_append(B, C); recursive_parse_list_item(engine, A); }
 item_bullet(A)		::= LINE_LIST_BULLETED(B) nested_chunks(C).	{ A = token_new_parent(B, BLOCK_LIST_ITEM); token_chain_append(B, C); recursive_parse_list_item(engine, A); }
-item_bullet(A)		::= LINE_LIST_BULLETED(B).					{ A = token_new_parent(B, BLOCK_LIST_ITEM_TIGHT); }
+item_bullet(A)		::= LINE_LIST_BULLETED(B).					{ A = token_new_parent(B, BLOCK_LIST_ITEM_TIGHT); A->type_mask = B->type_mask; }
 
 
 // Enumerated lists
@@ -317,7 +317,7 @@ list_enum			::=	item_enum.
 item_enum(A)		::= LINE_LIST_ENUMERATED(B) ext_chunk(C).	{ A = token_new_parent(B, BLOCK_LIST_ITEM); token_chain_append(B, C); recursive_parse_list_item(engine, A); }
 item_enum(A)		::= LINE_LIST_ENUMERATED(B) chunk(C).		{ A = token_new_parent(B, BLOCK_LIST_ITEM_TIGHT); token_chain_append(B, C); recursive_parse_list_item(engine, A); }
 item_enum(A)		::= LINE_LIST_ENUMERATED(B) nested_chunks(C).	{ A = token_new_parent(B, BLOCK_LIST_ITEM); token_chain_append(B, C); recursive_parse_list_item(engine, A); }
-item_enum(A)		::= LINE_LIST_ENUMERATED(B).				{ A = token_new_parent(B, BLOCK_LIST_ITEM_TIGHT); }
+item_enum(A)		::= LINE_LIST_ENUMERATED(B).				{ A = token_new_parent(B, BLOCK_LIST_ITEM_TIGHT); A->type_mask = B->type_mask; }
 
 
 // Metadata
@@ -410,3 +410,31 @@ para				::= defs.
 	fprintf(stderr, "Parser failed to successfully parse.\n");
 }
 
+
+// The grammar only nests a few rules deep -- the deepest stack seen while
+// parsing the test suites and benchmark documents was 8 entries
+%stack_size 32
+
+%stack_overflow {
+	fprintf(stderr, "Parser stack overflow.\n");
+}
+
+
+// Parsers are reused for recursive parses (see mmd_parse_token_chain())
+%code {
+	/// Prepare an existing parser to parse a new token chain
+	void ParseReset(void * p) {
+		yyParser * pParser = (yyParser *)p;
+
+		while (pParser->yytos > pParser->yystack) {
+			yy_pop_parser_stack(pParser);
+		}
+
+#ifndef YYNOERRORRECOVERY
+		pParser->yyerrcnt = -1;
+#endif
+		pParser->yystack[0].stateno = 0;
+		pParser->yystack[0].major = 0;
+	}
+}
+
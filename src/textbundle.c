@@ -420,6 +420,7 @@ DString * textbundle_create(DString * body, mmd_engine * e, const char * directo
 
 	len = temp->currentStringLength;
 	status = mz_zip_writer_add_mem(&zip, "text.markdown", temp->str, len, MZ_BEST_COMPRESSION);
+	d_string_free(temp, true);
 
 	if (!status) {
 		fprintf(stderr, "Error adding content to zip.\n");
@@ -438,14 +439,19 @@ DString * textbundle_create(DString * body, mmd_engine * e, const char * directo
 	scratch_pad_free(scratch);
 
 	// Finalize zip archive and extract data
-	free(result->str);
+	char * archive = NULL;
+	size_t archive_len = 0;
 
-	status = mz_zip_writer_finalize_heap_archive(&zip, (void **) & (result->str), (size_t *) & (result->currentStringLength));
+	status = mz_zip_writer_finalize_heap_archive(&zip, (void **) &archive, &archive_len);
 
 	if (!status) {
 		fprintf(stderr, "Error finalizing zip.\n");
+	} else {
+		d_string_adopt(result, archive, archive_len, archive_len);
 	}
 
+	mz_zip_writer_end(&zip);
+
 	return result;
 }
 
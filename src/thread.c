@@ -0,0 +1,291 @@
+/**
+
+	MultiMarkdown 6 -- Lightweight markup processor to produce HTML, LaTeX, and more.
+
+	@file thread.c
+
+	@brief Minimal threads, mutexes and condition variables -- POSIX threads
+	where available, and the native API on Windows.
+
+
+	@author	Fletcher T. Penney
+	@bug
+
+**/
+
+/*
+
+	Copyright © 2020 Fletcher T. Penney.
+
+
+	The `MultiMarkdown 6` project is released under the MIT License..
+
+	GLibFacade.c and GLibFacade.h are from the MultiMarkdown v4 project:
+
+		https://github.com/fletcher/MultiMarkdown-4/
+
+	MMD 4 is released under both the MIT License and GPL.
+
+
+	CuTest is released under the zlib/libpng license. See CuTest.c for the text
+	of the license.
+
+
+	## The MIT License ##
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+#include "thread.h"
+#include "token.h"
+
+#if (defined(_WIN32) || defined(__WIN32__))
+	#include <windows.h>
+#else
+	#include <time.h>
+	#include <unistd.h>
+#endif
+
+
+/// Function and argument for a new thread
+struct thread_start {
+	void * (* start)(void *);
+	void *		arg;
+};
+
+
+/// Run the thread function, then release anything library code left behind
+/// on this thread
+static void * thread_run(void * param) {
+	struct thread_start s = * (struct thread_start *) param;
+	free(param);
+
+	void * result = s.start(s.arg);
+
+#ifdef kUseObjectPool
+	// Tokens created outside of an engine come from a per-thread pool
+	token_pool_thread_exit();
+#endif
+
+	return result;
+}
+
+
+static struct thread_start * thread_start_new(void * (* start)(void *), void * arg) {
+	struct thread_start * s = malloc(sizeof(struct thread_start));
+
+	if (s) {
+		s->start = start;
+		s->arg = arg;
+	}
+
+	return s;
+}
+
+
+#if (defined(_WIN32) || defined(__WIN32__))
+
+void mmd_mutex_init(mmd_mutex * m) {
+	InitializeSRWLock((PSRWLOCK) m);
+}
+
+
+void mmd_mutex_destroy(mmd_mutex * m) {
+	// SRW locks don't hold any resources
+}
+
+
+void mmd_mutex_lock(mmd_mutex * m) {
+	AcquireSRWLockExclusive((PSRWLOCK) m);
+}
+
+
+void mmd_mutex_unlock(mmd_mutex * m) {
+	ReleaseSRWLockExclusive((PSRWLOCK) m);
+}
+
+
+void mmd_cond_init(mmd_cond * c) {
+	InitializeConditionVariable((PCONDITION_VARIABLE) c);
+}
+
+
+void mmd_cond_destroy(mmd_cond * c) {
+	// Condition variables don't hold any resources
+}
+
+
+void mmd_cond_wait(mmd_cond * c, mmd_mutex * m) {
+	SleepConditionVariableSRW((PCONDITION_VARIABLE) c, (PSRWLOCK) m, INFINITE, 0);
+}
+
+
+void mmd_cond_broadcast(mmd_cond * c) {
+	WakeAllConditionVariable((PCONDITION_VARIABLE) c);
+}
+
+
+/// Adapt POSIX style thread function to the Windows API
+static DWORD WINAPI thread_trampoline(LPVOID param) {
+	thread_run(param);
+
+	return 0;
+}
+
+
+bool mmd_thread_create(mmd_thread * t, size_t stack_size, void * (* start)(void *), void * arg) {
+	struct thread_start * s = thread_start_new(start, arg);
+
+	if (!s) {
+		return false;
+	}
+
+	*t = CreateThread(NULL, stack_size, thread_trampoline, s, 0, NULL);
+
+	if (*t == NULL) {
+		free(s);
+		return false;
+	}
+
+	return true;
+}
+
+
+void mmd_thread_join(mmd_thread t) {
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+
+int mmd_processor_count(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+
+	return (info.dwNumberOfProcessors > 0) ? (int) info.dwNumberOfProcessors : 1;
+}
+
+
+double mmd_clock_seconds(void) {
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+
+	return (double) counter.QuadPart / frequency.QuadPart;
+}
+
+#else
+
+void mmd_mutex_init(mmd_mutex * m) {
+	pthread_mutex_init(m, NULL);
+}
+
+
+void mmd_mutex_destroy(mmd_mutex * m) {
+	pthread_mutex_destroy(m);
+}
+
+
+void mmd_mutex_lock(mmd_mutex * m) {
+	pthread_mutex_lock(m);
+}
+
+
+void mmd_mutex_unlock(mmd_mutex * m) {
+	pthread_mutex_unlock(m);
+}
+
+
+void mmd_cond_init(mmd_cond * c) {
+	pthread_cond_init(c, NULL);
+}
+
+
+void mmd_cond_destroy(mmd_cond * c) {
+	pthread_cond_destroy(c);
+}
+
+
+void mmd_cond_wait(mmd_cond * c, mmd_mutex * m) {
+	pthread_cond_wait(c, m);
+}
+
+
+void mmd_cond_broadcast(mmd_cond * c) {
+	pthread_cond_broadcast(c);
+}
+
+
+bool mmd_thread_create(mmd_thread * t, size_t stack_size, void * (* start)(void *), void * arg) {
+	struct thread_start * s = thread_start_new(start, arg);
+
+	if (!s) {
+		return false;
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	if (stack_size) {
+		pthread_attr_setstacksize(&attr, stack_size);
+	}
+
+	bool result = (pthread_create(t, &attr, thread_run, s) == 0);
+
+	pthread_attr_destroy(&attr);
+
+	if (!result) {
+		free(s);
+	}
+
+	return result;
+}
+
+
+void mmd_thread_join(mmd_thread t) {
+	pthread_join(t, NULL);
+}
+
+
+int mmd_processor_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus > 0) {
+		return (int) cpus;
+	}
+
+#endif
+
+	return 1;
+}
+
+
+double mmd_clock_seconds(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
@@ -0,0 +1,167 @@
+/**
+
+	MultiMarkdown 6 -- Lightweight markup processor to produce HTML, LaTeX, and more.
+
+	@file thread.h
+
+	@brief Minimal threads, mutexes and condition variables -- POSIX threads
+	where available, and the native API on Windows.
+
+
+	@author	Fletcher T. Penney
+	@bug
+
+**/
+
+/*
+
+	Copyright © 2020 Fletcher T. Penney.
+
+
+	The `MultiMarkdown 6` project is released under the MIT License..
+
+	GLibFacade.c and GLibFacade.h are from the MultiMarkdown v4 project:
+
+		https://github.com/fletcher/MultiMarkdown-4/
+
+	MMD 4 is released under both the MIT License and GPL.
+
+
+	CuTest is released under the zlib/libpng license. See CuTest.c for the text
+	of the license.
+
+
+	## The MIT License ##
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+#ifndef THREAD_MULTIMARKDOWN_H
+#define THREAD_MULTIMARKDOWN_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#if (defined(_WIN32) || defined(__WIN32__))
+	// Same layout as SRWLOCK, CONDITION_VARIABLE and HANDLE, without
+	// pulling <windows.h> into every file that needs a lock
+	typedef struct {
+		void *		ptr;
+	} mmd_mutex;
+
+	typedef struct {
+		void *		ptr;
+	} mmd_cond;
+
+	typedef void * mmd_thread;
+
+	#define kMutexInitializer	{ NULL }	//!< Static initializer for mmd_mutex
+#else
+	#include <pthread.h>
+
+	typedef pthread_mutex_t mmd_mutex;
+	typedef pthread_cond_t mmd_cond;
+	typedef pthread_t mmd_thread;
+
+	#define kMutexInitializer	PTHREAD_MUTEX_INITIALIZER	//!< Static initializer for mmd_mutex
+#endif
+
+#if defined(_MSC_VER)
+	#define kThreadLocal __declspec(thread)		//!< Storage class for per-thread variables
+#else
+	#define kThreadLocal __thread				//!< Storage class for per-thread variables
+#endif
+
+
+/// Initialize a mutex
+void mmd_mutex_init(
+	mmd_mutex * m							//!< Mutex to initialize
+);
+
+
+/// Release resources used by a mutex
+void mmd_mutex_destroy(
+	mmd_mutex * m							//!< Mutex to destroy
+);
+
+
+/// Lock a mutex
+void mmd_mutex_lock(
+	mmd_mutex * m							//!< Mutex to lock
+);
+
+
+/// Unlock a mutex
+void mmd_mutex_unlock(
+	mmd_mutex * m							//!< Mutex to unlock
+);
+
+
+/// Initialize a condition variable
+void mmd_cond_init(
+	mmd_cond * c							//!< Condition variable to initialize
+);
+
+
+/// Release resources used by a condition variable
+void mmd_cond_destroy(
+	mmd_cond * c							//!< Condition variable to destroy
+);
+
+
+/// Wait on a condition variable (the mutex must be locked)
+void mmd_cond_wait(
+	mmd_cond * c,							//!< Condition variable to wait on
+	mmd_mutex * m							//!< Mutex to release while waiting
+);
+
+
+/// Wake all threads waiting on a condition variable
+void mmd_cond_broadcast(
+	mmd_cond * c							//!< Condition variable to signal
+);
+
+
+/// Start a new thread, returning false if that wasn't possible.  Per-thread
+/// state the library creates (e.g. a fallback token pool) is released when
+/// `start` returns.
+bool mmd_thread_create(
+	mmd_thread * t,							//!< Handle for the new thread
+	size_t stack_size,						//!< Stack size (0 for the default)
+	void * (* start)(void *),				//!< Function to run
+	void * arg								//!< Argument for function
+);
+
+
+/// Wait for a thread to finish
+void mmd_thread_join(
+	mmd_thread t							//!< Thread to wait for
+);
+
+
+/// Number of processors available (at least 1)
+int mmd_processor_count(void);
+
+
+/// Seconds elapsed on a monotonic clock, for measuring intervals
+double mmd_clock_seconds(void);
+
+#endif
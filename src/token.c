@@ -60,6 +60,7 @@
 #include <stdlib.h>
 
 #include "char.h"
+#include "thread.h"
 #include "token.h"
 
 
@@ -69,11 +70,15 @@
 
 #include "object_pool.h"
 
-static pool * token_pool = NULL;		//!< Pointer to our object pool
+/// Pool currently in use on this thread (e.g. the pool owned by an mmd_engine)
+static kThreadLocal pool * token_pool_active = NULL;
 
-/// Count number of uses of this pool to allow us know
+/// Fallback pool for tokens created outside of an engine
+static kThreadLocal pool * token_pool = NULL;
+
+/// Count number of uses of the fallback pool to allow us know
 /// when it's safe to drain the pool
-static short token_pool_count = 0;
+static kThreadLocal short token_pool_count = 0;
 
 /// Intialize object pool for token allocation
 void token_pool_init(void) {
@@ -108,6 +113,43 @@ void token_pool_free(void) {
 	}
 }
 
+
+/// Free this thread's fallback pool, whether or not it is still counted as
+/// in use -- nothing else can reach it once the thread is gone
+void token_pool_thread_exit(void) {
+	if (token_pool) {
+		pool_free(token_pool);
+		token_pool = NULL;
+	}
+
+	token_pool_count = 0;
+}
+
+
+/// Use the specified pool for token allocation on this thread.
+/// Returns the previously active pool so that it can be restored.
+struct pool * token_pool_swap(struct pool * p) {
+	pool * previous = token_pool_active;
+
+	token_pool_active = p;
+
+	return previous;
+}
+
+
+/// Get the pool to be used for the next token allocation
+static pool * token_pool_current(void) {
+	if (token_pool_active) {
+		return token_pool_active;
+	}
+
+	if (token_pool == NULL) {
+		token_pool = pool_new(sizeof(token));
+	}
+
+	return token_pool;
+}
+
 #endif
 
 
@@ -116,7 +158,7 @@ token * token_new(unsigned short type, size_t start, size_t len) {
 
 
 #ifdef kUseObjectPool
-	token * t = pool_allocate_object(token_pool);
+	token * t = pool_allocate_object(token_pool_current());
 #else
 	token * t = malloc(sizeof(token));
 #endif
@@ -139,6 +181,8 @@ token * token_new(unsigned short type, size_t start, size_t len) {
 		t->can_close = true;		//!< unless specified otherwise (e.g. for ambidextrous tokens)
 		t->unmatched = true;
 
+		t->type_mask = 0;
+
 		t->mate = NULL;
 	}
 
@@ -149,7 +193,7 @@ token * token_new(unsigned short type, size_t start, size_t len) {
 /// Duplicate an existing token
 token * token_copy(token * original) {
 #ifdef kUseObjectPool
-	token * t = pool_allocate_object(token_pool);
+	token * t = pool_allocate_object(token_pool_current());
 #else
 	token * t = malloc(sizeof(token));
 #endif
@@ -316,7 +360,11 @@ void token_pop_link_from_chain(token * t) {
 	if (prev) {
 		prev->next = next;
 
-		fix_token_chain_tail(prev);
+		// Tail only changes if we removed it (walking the chain every time
+		// is quadratic for deeply nested emphasis)
+		if (next == NULL) {
+			fix_token_chain_tail(prev);
+		}
 	}
 
 	if (next) {
@@ -337,7 +385,10 @@ void tokens_prune(token * first, token * last) {
 	if (prev != NULL) {
 		prev->next = next;
 
-		fix_token_chain_tail(prev);
+		// Tail only changes if we removed it
+		if (next == NULL) {
+			fix_token_chain_tail(prev);
+		}
 	}
 
 	if (next != NULL) {
@@ -458,9 +509,9 @@ void print_token(token * t, unsigned short depth, const char * string) {
 		}
 
 		if (string == NULL) {
-			fprintf(stderr, "* (%d) %lu:%lu\n", t->type, t->start, t->len);
+			fprintf(stderr, "* (%d) %lu:%lu\n", t->type, (unsigned long) t->start, (unsigned long) t->len);
 		} else {
-			fprintf(stderr, "* (%d) %lu:%lu\t'%.*s'\n", t->type, t->start, t->len, (int)t->len, &string[t->start]);
+			fprintf(stderr, "* (%d) %lu:%lu\t'%.*s'\n", t->type, (unsigned long) t->start, (unsigned long) t->len, (int)t->len, &string[t->start]);
 		}
 
 		if (t->child != NULL) {
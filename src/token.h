@@ -57,6 +57,9 @@
 #ifndef TOKEN_PARSER_TEMPLATE_H
 #define TOKEN_PARSER_TEMPLATE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 
 #ifdef DISABLE_OBJECT_POOL
 	#undef kUseObjectPool
@@ -67,20 +70,46 @@
 //!< performance in memory allocation. Frees all
 //!< tokens at once, however, at end of parsing.
 
-/// Should call init() once per thread/use, and drain() once per thread/use.
-/// This allows us to know when the pool is no longer being used and it is safe
-/// to free.
+/// Each `mmd_engine` owns its own pool, and makes it the active pool for the
+/// current thread while it is parsing or exporting.  All of the engine's
+/// tokens are released at once by `mmd_engine_reset()` or `mmd_engine_free()`,
+/// so engines can be used safely on separate threads.
+
+/// Tokens created outside of an engine (e.g. when using the token functions
+/// directly) come from a fallback pool that belongs to the current thread.
+/// Call init() once per use, and drain() once per use, on that thread.
+/// This allows us to know when the fallback pool is no longer being used and
+/// it is safe to free.
+
+#ifdef COMPACT_TOKENS
+	#define kUseCompactTokens 1
+#endif
+//!< Store token offsets in 32 bits, making tokens smaller
+//!< (64 bytes instead of 80 on 64-bit platforms) at the
+//!< cost of limiting documents to 4 GB.
+
+#ifdef kUseCompactTokens
+	typedef uint32_t token_offset;
+	#define kTokenOffsetMax UINT32_MAX
+#else
+	typedef size_t token_offset;
+	#define kTokenOffsetMax SIZE_MAX
+#endif
 
-/// This is easy with a command line utility, but complex in a multithreaded
-/// application.  Unless you *really* know what you're doing, fully understand
-/// threads and C memory management, you should probably disable object pools
-/// when creating a long-running GUI application.  (I disable them in
-/// MultiMarkdown Composer, for example.)
 
 #ifdef kUseObjectPool
-	void token_pool_init(void);			//!< Initialize object pool for allocating tokens
-	void token_pool_drain(void);		//!< Drain pool to free memory when parse complete
-	void token_pool_free(void);			//!< Free the token object pool
+	struct pool;
+
+	void token_pool_init(void);			//!< Initialize fallback object pool for allocating tokens
+	void token_pool_drain(void);		//!< Drain fallback pool to free memory when parse complete
+	void token_pool_free(void);			//!< Free the fallback token object pool
+	void token_pool_thread_exit(void);	//!< Free this thread's fallback pool as the thread finishes
+
+	/// Use the specified pool for token allocation on the current thread
+	/// (NULL to use the fallback pool).  Returns the previously active pool.
+	struct pool * token_pool_swap(
+		struct pool * p					//!< Pool to be used
+	);
 #endif
 
 
@@ -89,15 +118,17 @@
 /// source string.
 struct token {
 	unsigned short		type;			//!< Type for the token
-	short				can_open;		//!< Can token open a matched pair?
-	short				can_close;		//!< Can token close a matched pair?
-	short				unmatched;		//!< Has token been matched yet?
+	unsigned short		can_open : 1;	//!< Can token open a matched pair?
+	unsigned short		can_close : 1;	//!< Can token close a matched pair?
+	unsigned short		unmatched : 1;	//!< Has token been matched yet?
+
+	uint32_t			type_mask;		//!< Which kinds of tokens lines/blocks contain (0 if not known)
 
-	size_t				start;			//!< Starting offset in the source string
-	size_t				len;			//!< Length of the token in the source string
+	token_offset		start;			//!< Starting offset in the source string
+	token_offset		len;			//!< Length of the token in the source string
 
-	size_t				out_start;
-	size_t				out_len;
+	token_offset		out_start;
+	token_offset		out_len;
 
 	struct token 	*	next;			//!< Pointer to next token in the chain
 	struct token 	*	prev;			//!< Pointer to previous marker in the chain
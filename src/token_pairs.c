@@ -65,21 +65,8 @@
 
 /// Create a new token pair engine
 token_pair_engine * token_pair_engine_new(void) {
-	token_pair_engine * e = malloc(sizeof(token_pair_engine));
-
-	if (e) {
-		unsigned short empty[kMaxTokenTypes] = {0};
-		unsigned short empty2[kMaxTokenTypes][kMaxTokenTypes] = {{0}};
-
-		memcpy(e->can_open_pair, empty, sizeof(unsigned short) * kMaxTokenTypes);
-		memcpy(e->can_close_pair, empty, sizeof(unsigned short) * kMaxTokenTypes);
-
-		memcpy(e->pair_type, empty2, sizeof(unsigned short) * kMaxTokenTypes * kMaxTokenTypes);
-
-		memcpy(e->empty_allowed, empty, sizeof(unsigned short) * kMaxTokenTypes);
-		memcpy(e->match_len, empty, sizeof(unsigned short) * kMaxTokenTypes);
-		memcpy(e->should_prune, empty, sizeof(unsigned short) * kMaxTokenTypes);
-	}
+	// All tables start empty
+	token_pair_engine * e = calloc(1, sizeof(token_pair_engine));
 
 	return e;
 }
@@ -132,116 +119,393 @@ void token_pair_mate(token * a, token * b) {
 }
 
 
-/// Search a token's childen for matching pairs
-void token_pairs_match_pairs_inside_token(token * parent, token_pair_engine * e, stack * s, unsigned short depth) {
+/// Pairing state for one level of the token tree
+struct pair_level {
+	token *			parent;
+	token *			walker;				//!< Current token in the parent's child chain
+	bool			descended;			//!< Have the walker's children been paired yet?
+	size_t			start_counter;		//!< We're sharing one stack, so any opener earlier than this belongs to a parent
+};
 
-	// Avoid stack overflow in "pathologic" input
-	if (depth == kMaxPairRecursiveDepth) {
-		return;
+typedef struct pair_level pair_level;
+
+
+/// Openers on the stack, linked together by type, so that a large stack can
+/// be searched for a usable opener without looking at any of the others.
+/// Positions are stored plus one, so that 0 means there are no more.
+struct opener_index {
+	size_t			top[kMaxTokenTypes];		//!< Last opener of each type
+	size_t	*		below;						//!< Previous opener of the same type, by stack position
+	size_t			capacity;
+
+	unsigned short	types[kMaxTokenTypes];		//!< Opener types that have been on the stack
+	unsigned short	type_count;
+	bool			seen[kMaxTokenTypes];
+};
+
+typedef struct opener_index opener_index;
+
+
+/// Add opener at this stack position to the index
+static void opener_index_push(opener_index * x, token * t, size_t position) {
+	if (position >= x->capacity) {
+		while (position >= x->capacity) {
+			x->capacity *= 2;
+		}
+
+		x->below = realloc(x->below, sizeof(size_t) * x->capacity);
+	}
+
+	if (!x->seen[t->type]) {
+		x->seen[t->type] = true;
+		x->types[x->type_count++] = t->type;
+	}
+
+	x->below[position] = x->top[t->type];
+	x->top[t->type] = position + 1;
+}
+
+
+/// Remove opener at this stack position (the last of its type) from the index
+static void opener_index_pop(opener_index * x, token * t, size_t position) {
+	x->top[t->type] = x->below[position];
+}
+
+
+/// Index the openers already on the stack
+static opener_index * opener_index_new(stack * s, size_t start) {
+	opener_index * x = calloc(1, sizeof(opener_index));
+
+	x->capacity = (s->size > kLargeStackThreshold) ? s->size : kLargeStackThreshold;
+	x->below = malloc(sizeof(size_t) * x->capacity);
+
+	for (size_t i = start; i < s->size; ++i) {
+		opener_index_push(x, s->element[i], i);
+	}
+
+	return x;
+}
+
+
+static void opener_index_free(opener_index * x) {
+	if (x) {
+		free(x->below);
+		free(x);
+	}
+}
+
+
+/// Can this opener be paired with this closer?  Returns 1 if so, 0 if not,
+/// and -1 if the closer can't be paired with anything at all.
+static int pair_opener_fits(const token_pair_engine * e, token * opener, token * closer) {
+	unsigned short pair_type = e->pair_type[opener->type][closer->type];
+
+	if (!e->empty_allowed[pair_type]) {
+		// Make sure they aren't consecutive tokens
+		if ((opener->next == closer) &&
+				(opener->start + opener->len == closer->start)) {
+			// In this situation, we can't use this token as a closer
+			return -1;
+		}
+	}
+
+	if (e->match_len[pair_type]) {
+		// Lengths must match
+		if (opener->len != closer->len) {
+			return 0;
+		}
 	}
 
-	// Walk the child chain
-	token * walker = parent->child;
+	return 1;
+}
 
-	// Counter
-	size_t start_counter = s->size;
-	size_t i;				// We're sharing one stack, so any opener earlier than this belongs to a parent
 
+/// Find the nearest usable opener at this level by searching back through
+/// the stack.  Returns its position plus one, or 0 if there isn't one.
+static size_t pair_level_find_opener(pair_level * l, const token_pair_engine * e, stack * s, token * closer) {
 	token * peek;
-	unsigned short pair_type;
+	size_t i = s->size;
 
-	unsigned int opener_count[kMaxTokenTypes] = {0};	// Keep track of which token types are on the stack
+	while (i > l->start_counter) {
+		peek = stack_peek_index(s, i - 1);
 
-	while (walker != NULL) {
+		if (e->pair_type[peek->type][closer->type]) {
+			switch (pair_opener_fits(e, peek, closer)) {
+				case 1:
+					return i;
 
-		if (walker->child) {
-			token_pairs_match_pairs_inside_token(walker, e, s, depth + 1);
+				case -1:
+					return 0;
+			}
 		}
 
-		// Is this a closer?
-		if (walker->can_close && e->can_close_pair[walker->type] && walker->unmatched ) {
-			i = s->size;
-
-			// Do we even have a valid opener in the stack?
-			// It's only worth checking if the stack is beyond a certain size
-			if (i > start_counter + kLargeStackThreshold) {
-				for (int j = 0; j < kMaxTokenTypes; ++j) {
-					if (opener_count[j]) {
-						if (e->pair_type[j][walker->type]) {
-							goto close;
-						}
-					}
+		i--;
+	}
+
+	return 0;
+}
+
+
+/// Find the nearest usable opener at this level, using the index to only
+/// consider openers of types that can be paired with this closer
+static size_t pair_level_find_indexed_opener(pair_level * l, const token_pair_engine * e, stack * s, opener_index * x, token * closer) {
+	size_t next[kMaxTokenTypes];
+	unsigned short types = 0;
+	size_t best;
+	unsigned short best_type;
+
+	for (unsigned short j = 0; j < x->type_count; ++j) {
+		if (e->pair_type[x->types[j]][closer->type] && (x->top[x->types[j]] > l->start_counter)) {
+			next[types++] = x->top[x->types[j]];
+		}
+	}
+
+	// Work back through those openers, nearest first
+	while (types) {
+		best_type = 0;
+
+		for (unsigned short j = 1; j < types; ++j) {
+			if (next[j] > next[best_type]) {
+				best_type = j;
+			}
+		}
+
+		best = next[best_type];
+
+		switch (pair_opener_fits(e, s->element[best - 1], closer)) {
+			case 1:
+				return best;
+
+			case -1:
+				return 0;
+		}
+
+		next[best_type] = x->below[best - 1];
+
+		if (next[best_type] <= l->start_counter) {
+			next[best_type] = next[--types];
+		}
+	}
+
+	return 0;
+}
+
+
+/// Pair the current token at this level with an opener, if it is a closer,
+/// or add it to the stack, if it is an opener.  Once the stack gets large,
+/// an index of the openers is used to search it.
+static void pair_level_match_token(pair_level * l, const token_pair_engine * e, stack * s, opener_index ** index, size_t start) {
+	token * walker = l->walker;
+	token * peek;
+	unsigned short pair_type;
+	size_t i;
+
+	// Is this a closer?
+	if (walker->can_close && e->can_close_pair[walker->type] && walker->unmatched ) {
+		if ((*index == NULL) && (s->size > l->start_counter + kLargeStackThreshold)) {
+			*index = opener_index_new(s, start);
+		}
+
+		if (*index) {
+			i = pair_level_find_indexed_opener(l, e, s, *index, walker);
+		} else {
+			i = pair_level_find_opener(l, e, s, walker);
+		}
+
+		if (i) {
+			peek = stack_peek_index(s, i - 1);
+			pair_type = e->pair_type[peek->type][walker->type];
+
+			token_pair_mate(peek, walker);
+
+			// Clear portion of stack between opener and closer as they are now unavailable for mating
+			while (s->size > (i - 1)) {
+				peek = stack_pop(s);
+
+				if (*index) {
+					opener_index_pop(*index, peek, s->size);
 				}
+			}
 
-				// No opener available for this as closer
-				goto open;
+			// Prune matched section
+
+			if (e->should_prune[pair_type]) {
+				if (peek->prev == NULL) {
+					walker = token_prune_graft(peek, walker, pair_type);
+					l->parent->child = walker;
+				} else {
+					walker = token_prune_graft(peek, walker, pair_type);
+				}
+
+				l->walker = walker;
 			}
+		}
+	}
+
+	// Is this an opener?
+	if (walker->can_open && e->can_open_pair[walker->type] && walker->unmatched) {
+		stack_push(s, walker);
 
-close:
-
-			// Find matching opener for this closer
-			while (i > start_counter) {
-				peek = stack_peek_index(s, i - 1);
-
-				pair_type = e->pair_type[peek->type][walker->type];
-
-				if (pair_type) {
-					if (!e->empty_allowed[pair_type]) {
-						// Make sure they aren't consecutive tokens
-						if ((peek->next == walker) &&
-								(peek->start + peek->len == walker->start)) {
-							// i--;
-							i = start_counter;	// In this situation, we can't use this token as a closer
-							continue;
-						}
-					}
-
-					if (e->match_len[pair_type]) {
-						// Lengths must match
-						if (peek->len != walker->len) {
-							i--;
-							continue;
-						}
-					}
-
-					token_pair_mate(peek, walker);
-
-
-					// Clear portion of stack between opener and closer as they are now unavailable for mating
-					while (s->size > (i - 1)) {
-						peek = stack_pop(s);
-						opener_count[peek->type]--;
-					}
-
-					// Prune matched section
-
-					if (e->should_prune[pair_type]) {
-						if (peek->prev == NULL) {
-							walker = token_prune_graft(peek, walker, e->pair_type[peek->type][walker->type]);
-							parent->child = walker;
-						} else {
-							walker = token_prune_graft(peek, walker, e->pair_type[peek->type][walker->type]);
-						}
-					}
-
-					break;
+		if (*index) {
+			opener_index_push(*index, walker, s->size - 1);
+		}
+	}
+}
+
+
+/// Search a token's childen for matching pairs.  Nested children are
+/// searched first, using a list of levels rather than recursion, so that
+/// deeply nested input is fully paired without risking stack overflow.
+void token_pairs_match_pairs_inside_token(token * parent, const token_pair_engine * e, stack * s) {
+	size_t levels_size = 16;
+	pair_level * levels = malloc(sizeof(pair_level) * levels_size);
+	size_t depth = 0;
+	pair_level * l = &levels[0];
+
+	l->parent = parent;
+	l->walker = parent->child;
+	l->descended = false;
+	l->start_counter = s->size;
+
+	opener_index * index = NULL;
+
+	while (true) {
+		if (l->walker == NULL) {
+			// Remove unused tokens from stack and return to parent
+			if (index) {
+				while (s->size > l->start_counter) {
+					opener_index_pop(index, stack_pop(s), s->size);
 				}
+			}
 
-				i--;
+			s->size = l->start_counter;
+
+			if (depth == 0) {
+				break;
 			}
+
+			l = &levels[--depth];
+			continue;
 		}
 
-open:
+		if (l->walker->child && !l->descended) {
+			// Pair the walker's children first
+			l->descended = true;
 
-		// Is this an opener?
-		if (walker->can_open && e->can_open_pair[walker->type] && walker->unmatched) {
-			stack_push(s, walker);
-			opener_count[walker->type]++;
+			if (depth + 1 == levels_size) {
+				levels_size *= 2;
+				levels = realloc(levels, sizeof(pair_level) * levels_size);
+			}
+
+			l = &levels[++depth];
+			l->parent = levels[depth - 1].walker;
+			l->walker = l->parent->child;
+			l->descended = false;
+			l->start_counter = s->size;
+			continue;
 		}
 
-		walker = walker->next;
+		pair_level_match_token(l, e, s, &index, levels[0].start_counter);
+
+		l->walker = l->walker->next;
+		l->descended = false;
+	}
+
+	opener_index_free(index);
+	free(levels);
+}
+
+
+#ifdef TEST
+enum test_token_types {
+	TEST_BLOCK = 1,
+	TEST_OPEN,
+	TEST_TEXT,
+	TEST_CLOSE,
+	TEST_PAIR,
+	TEST_OTHER_OPEN,
+	TEST_OTHER_CLOSE,
+	TEST_OTHER_PAIR,
+};
+
+
+void Test_token_pairs_match_pairs_inside_token(CuTest * tc) {
+	token_pair_engine * e = token_pair_engine_new();
+	token_pair_engine_add_pairing(e, TEST_OPEN, TEST_CLOSE, TEST_PAIR, PAIRING_PRUNE_MATCH);
+
+	// Nest a pair deeper than recursion would safely allow
+	size_t depth = 100000;
+	token ** levels = malloc(sizeof(token *) * (depth + 1));
+
+	levels[0] = token_new(TEST_BLOCK, 0, 0);
+
+	for (size_t i = 1; i <= depth; ++i) {
+		levels[i] = token_new(TEST_BLOCK, 0, 0);
+		token_append_child(levels[i - 1], levels[i]);
+	}
+
+	token * parent = levels[depth];
+
+	token_append_child(parent, token_new(TEST_OPEN, 0, 1));
+	token_append_child(parent, token_new(TEST_TEXT, 1, 3));
+	token_append_child(parent, token_new(TEST_CLOSE, 4, 1));
+
+	stack * s = stack_new(0);
+	token_pairs_match_pairs_inside_token(levels[0], e, s);
+
+	CuAssertIntEquals(tc, 0, s->size);
+	CuAssertIntEquals(tc, TEST_PAIR, parent->child->type);
+	CuAssertPtrEquals(tc, NULL, parent->child->next);
+	CuAssertIntEquals(tc, TEST_OPEN, parent->child->child->type);
+	CuAssertIntEquals(tc, TEST_CLOSE, parent->child->child->mate->type);
+
+	// Free from the bottom up, detaching each level first, to avoid
+	// recursing through (or revisiting) the whole tree
+	token_tree_free(parent->child);
+
+	for (size_t i = depth + 1; i-- > 0;) {
+		levels[i]->child = NULL;
+		token_free(levels[i]);
 	}
 
-	// Remove unused tokens from stack and return to parent
-	s->size = start_counter;
+	free(levels);
+	stack_free(s);
+	token_pair_engine_free(e);
+}
+
+
+void Test_token_pairs_large_stack(CuTest * tc) {
+	token_pair_engine * e = token_pair_engine_new();
+	token_pair_engine_add_pairing(e, TEST_OPEN, TEST_CLOSE, TEST_PAIR, PAIRING_MATCH_LENGTH);
+	token_pair_engine_add_pairing(e, TEST_OTHER_OPEN, TEST_OTHER_CLOSE, TEST_OTHER_PAIR, 0);
+
+	// The closer has to skip past the nearer opener of the wrong length, and
+	// lots of openers of the wrong type
+	token * parent = token_new(TEST_BLOCK, 0, 0);
+	token * opener = token_new(TEST_OPEN, 0, 1);
+	token * wrong_length = token_new(TEST_OPEN, 1, 2);
+	token * closer = token_new(TEST_CLOSE, 10000, 1);
+
+	token_append_child(parent, opener);
+	token_append_child(parent, wrong_length);
+
+	for (int i = 0; i < 5000; ++i) {
+		token_append_child(parent, token_new(TEST_OTHER_OPEN, 3 + i, 1));
+	}
+
+	token_append_child(parent, closer);
+	token_append_child(parent, token_new(TEST_OTHER_CLOSE, 10001, 1));
+
+	stack * s = stack_new(0);
+	token_pairs_match_pairs_inside_token(parent, e, s);
+
+	CuAssertIntEquals(tc, 0, s->size);
+	CuAssertPtrEquals(tc, closer, opener->mate);
+	CuAssertTrue(tc, wrong_length->unmatched);
+	CuAssertTrue(tc, closer->next->unmatched);
+
+	token_tree_free(parent);
+	stack_free(s);
+	token_pair_engine_free(e);
 }
+#endif
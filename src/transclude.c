@@ -53,12 +53,37 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "d_string.h"
 #include "file.h"
 #include "libMultiMarkdown.h"
+#include "thread.h"
 #include "transclude.h"
+#include "uthash.h"
+
+#ifdef TEST
+	#include "CuTest.h"
+
+	// Tests write files to a temporary folder
+	#if (defined(_WIN32) || defined(__WIN32__))
+		#include <direct.h>
+		#include <io.h>
+		#include <sys/utime.h>
+
+		#define test_mkdir(path) _mkdir(path)
+	#else
+		#include <sys/stat.h>
+		#include <unistd.h>
+		#include <utime.h>
+
+		#define test_mkdir(path) mkdir(path, 0700)
+	#endif
+#endif
+
+#define kTranscludePrefetchThreads	4		//!< Files read at once when transcluding
 
 
 /// strdup() not available on all platforms
@@ -73,11 +98,659 @@ static char * my_strdup(const char * source) {
 }
 
 
+/// A slice of the source text, or of an included file
+struct segment {
+	const char 	*		str;
+	size_t				len;
+};
+
+typedef struct segment segment;
+
+
+/// Transcluded text is collected as a list of segments, and copied into place
+/// once at the end -- editing the source in place would move the rest of the
+/// text for every `{{file}}`
+struct rope {
+	segment 	*		segments;
+	size_t				count;
+	size_t				size;			//!< Segments allocated
+	size_t				len;			//!< Total length of text
+	stack 		*		buffers;		//!< Included files, freed with the rope
+};
+
+typedef struct rope rope;
+
+
+static void rope_init(rope * r) {
+	r->segments = NULL;
+	r->count = 0;
+	r->size = 0;
+	r->len = 0;
+	r->buffers = stack_new(0);
+}
+
+
+static void rope_append(rope * r, const char * str, size_t len) {
+	if (len == 0) {
+		return;
+	}
+
+	if (r->count == r->size) {
+		r->size = (r->size) ? r->size * 2 : 64;
+		r->segments = realloc(r->segments, sizeof(segment) * r->size);
+	}
+
+	r->segments[r->count].str = str;
+	r->segments[r->count].len = len;
+	r->count++;
+	r->len += len;
+}
+
+
+/// Replace contents of `target` with the text of the rope
+static void rope_materialize(rope * r, DString * target) {
+	char * str = malloc(r->len + 1);
+	char * cur = str;
+
+	for (size_t i = 0; i < r->count; ++i) {
+		memcpy(cur, r->segments[i].str, r->segments[i].len);
+		cur += r->segments[i].len;
+	}
+
+	*cur = '\0';
+
+	d_string_adopt(target, str, r->len, r->len + 1);
+}
+
+
+static void rope_free(rope * r) {
+	while (r->buffers->size) {
+		d_string_free(stack_pop(r->buffers), true);
+	}
+
+	stack_free(r->buffers);
+	free(r->segments);
+}
+
+
+/// A file to be transcluded, along with what we need to know about it
+struct transclusion_file {
+	char 		*		path;			//!< Canonical path, when cached
+	DString 	*		text;			//!< File contents (not transcluded)
+	size_t				meta_end;		//!< End of metadata (0 if none)
+	char 		*		base;			//!< "Transclude Base" metadata, if any
+	bool				has_markers;	//!< Are there `{{` after the metadata?
+	bool				cached;			//!< Owned by the cache (don't free)?
+	time_t				mtime;
+	off_t				size;
+	UT_hash_handle		hh;
+};
+
+typedef struct transclusion_file transclusion_file;
+
+
+/// Files are cached (when enabled) until the cache is cleared.  Entries that
+/// go stale are retired rather than freed, since other threads may still be
+/// using their text.
+static bool transclusion_cache_enabled = false;
+static transclusion_file * transclusion_cache = NULL;
+static stack * transclusion_cache_retired = NULL;
+static mmd_mutex transclusion_cache_lock = kMutexInitializer;
+
+
+/// Get metadata end and transclude base for text
+static void transclusion_scan_metadata(DString * text, size_t * meta_end, char ** base) {
+	mmd_engine * e = mmd_engine_create_with_dstring(text, EXT_TRANSCLUDE);
+	char * temp;
+
+	*meta_end = 0;
+
+	if (base) {
+		*base = NULL;
+	}
+
+	if (mmd_engine_has_metadata(e, meta_end)) {
+		if (base) {
+			temp = mmd_engine_metavalue_for_key(e, "transclude base");
+
+			if (temp) {
+				*base = my_strdup(temp);
+			}
+		}
+	} else {
+		*meta_end = 0;
+	}
+
+	mmd_engine_free(e, false);
+}
+
+
+/// Read a file to be transcluded, which takes ownership of `key` (the path
+/// used by the cache, if any).  Returns NULL if it can't be read.
+static transclusion_file * transclusion_file_load(const char * path, char * key, struct stat * st) {
+	DString * text = scan_file(path);
+
+	if (text == NULL) {
+		free(key);
+		return NULL;
+	}
+
+	transclusion_file * f = malloc(sizeof(transclusion_file));
+
+	f->path = (key) ? key : my_strdup(path);
+	f->text = text;
+	f->mtime = (st) ? st->st_mtime : 0;
+	f->size = (st) ? st->st_size : 0;
+	f->cached = false;
+
+	transclusion_scan_metadata(text, &f->meta_end, &f->base);
+
+	f->has_markers = (strstr(&text->str[f->meta_end], "{{") != NULL);
+
+	return f;
+}
+
+
+static void transclusion_file_free(transclusion_file * f) {
+	if (f) {
+		free(f->path);
+		free(f->base);
+		d_string_free(f->text, true);
+		free(f);
+	}
+}
+
+
+/// Canonical path of a file, so that the cache holds one copy of it however
+/// it is reached (e.g. `a/x.txt` and `a/sub/../x.txt`).  Returns NULL if the
+/// file doesn't exist.
+static char * transclusion_cache_key(const char * path) {
+#if (defined(_WIN32) || defined(__WIN32__))
+	return _fullpath(NULL, path, 0);
+#else
+	return realpath(path, NULL);
+#endif
+}
+
+
+/// Look for file in the cache.  Returns false if the file doesn't exist;
+/// otherwise `st` is filled in, and `f` is set to the cached copy if it
+/// hasn't changed since it was read (NULL if it has).  If `key` isn't NULL,
+/// it is set to the cache key, to be freed by the caller.
+static bool transclusion_cache_find(const char * path, struct stat * st, transclusion_file ** f, char ** key) {
+	char * k;
+
+	*f = NULL;
+
+	if (stat(path, st) != 0) {
+		return false;
+	}
+
+	k = transclusion_cache_key(path);
+
+	if (k == NULL) {
+		return false;
+	}
+
+	mmd_mutex_lock(&transclusion_cache_lock);
+	HASH_FIND_STR(transclusion_cache, k, *f);
+	mmd_mutex_unlock(&transclusion_cache_lock);
+
+	if (*f && ((*f)->mtime != st->st_mtime || (*f)->size != st->st_size)) {
+		*f = NULL;
+	}
+
+	if (key) {
+		*key = k;
+	} else {
+		free(k);
+	}
+
+	return true;
+}
+
+
+/// Get file to be transcluded, from the cache if possible.  Files that aren't
+/// `cached` must be freed with `transclusion_file_free()`.
+static transclusion_file * transclusion_file_open(const char * path) {
+	if (!transclusion_cache_enabled) {
+		return transclusion_file_load(path, NULL, NULL);
+	}
+
+	transclusion_file * f;
+	transclusion_file * found;
+	struct stat st;
+	char * key;
+
+	if (!transclusion_cache_find(path, &st, &f, &key)) {
+		return NULL;
+	}
+
+	if (f) {
+		free(key);
+		return f;
+	}
+
+	// Read the file without holding the lock
+	f = transclusion_file_load(path, key, &st);
+
+	if (f == NULL) {
+		return NULL;
+	}
+
+	mmd_mutex_lock(&transclusion_cache_lock);
+	HASH_FIND_STR(transclusion_cache, f->path, found);
+
+	if (found && (found->mtime == f->mtime) && (found->size == f->size)) {
+		// Another thread beat us to it
+		transclusion_file_free(f);
+		f = found;
+	} else {
+		if (found) {
+			HASH_DEL(transclusion_cache, found);
+			stack_push(transclusion_cache_retired, found);
+		}
+
+		f->cached = true;
+		HASH_ADD_KEYPTR(hh, transclusion_cache, f->path, strlen(f->path), f);
+	}
+
+	mmd_mutex_unlock(&transclusion_cache_lock);
+
+	return f;
+}
+
+
+/// Keep transcluded files in memory, and share them between documents
+void mmd_transclusion_cache_enable(bool enable) {
+	mmd_mutex_lock(&transclusion_cache_lock);
+
+	if (enable && (transclusion_cache_retired == NULL)) {
+		transclusion_cache_retired = stack_new(0);
+	}
+
+	transclusion_cache_enabled = enable;
+
+	mmd_mutex_unlock(&transclusion_cache_lock);
+}
+
+
+static void prefetch_pool_stop(void);
+
+
+/// Free all cached transcluded files, and stop the threads that read them
+void mmd_transclusion_cache_clear(void) {
+	transclusion_file * f, * f_tmp;
+
+	prefetch_pool_stop();
+
+	mmd_mutex_lock(&transclusion_cache_lock);
+
+	HASH_ITER(hh, transclusion_cache, f, f_tmp) {
+		HASH_DEL(transclusion_cache, f);
+		transclusion_file_free(f);
+	}
+
+	if (transclusion_cache_retired) {
+		while (transclusion_cache_retired->size) {
+			transclusion_file_free(stack_pop(transclusion_cache_retired));
+		}
+	}
+
+	mmd_mutex_unlock(&transclusion_cache_lock);
+}
+
+
+/// Path of file to be transcluded, given the text between `{{` and `}}`
+static DString * transclusion_file_path(const char * text, size_t len, const char * search_folder, short format) {
+	DString * file_path;
+
+	// Is this an absolute path or relative path?
+	if (is_separator(text[0])) {
+		// Absolute path
+		file_path = d_string_new(text);
+	} else {
+		// Relative path
+		file_path = d_string_new(search_folder);
+
+		// Ensure that search_folder ends in separator
+		add_trailing_sep(file_path);
+
+		d_string_append(file_path, text);
+	}
+
+	// Adjust file wildcard extension for output format
+	// e.g. `foo.*`
+	if ((len > 1) && (format != FORMAT_MMD) && strncmp(&text[len - 2], ".*", 2) == 0) {
+		// Trim '.*'
+		d_string_erase(file_path, file_path->currentStringLength - 2, 2);
+
+		switch (format) {
+			case FORMAT_HTML:
+			case FORMAT_HTML_WITH_ASSETS:
+			case FORMAT_EPUB:
+				d_string_append(file_path, ".html");
+				break;
+
+			case FORMAT_LATEX:
+			case FORMAT_BEAMER:
+			case FORMAT_MEMOIR:
+				d_string_append(file_path, ".tex");
+				break;
+
+			case FORMAT_FODT:
+			case FORMAT_ODT:
+				// `.fodt` is the extension for historical reasons
+				d_string_append(file_path, ".fodt");
+				break;
+
+			default:
+				d_string_append(file_path, ".txt");
+				break;
+
+		}
+	}
+
+	return file_path;
+}
+
+
+/// A file read ahead of time, while the other files at the same level of
+/// transclusion are being read
+struct prefetch {
+	char 		*		path;
+	transclusion_file *	file;			//!< NULL if file couldn't be read
+	UT_hash_handle		hh;
+};
+
+typedef struct prefetch prefetch;
+
+
+/// Files waiting to be read by the prefetch pool
+struct prefetch_queue {
+	stack 		*		items;
+	size_t				next;			//!< Next item to be claimed by a thread
+	size_t				done;			//!< Items finished
+	struct prefetch_queue * queued;		//!< Next queue waiting for the pool
+};
+
+typedef struct prefetch_queue prefetch_queue;
+
+
+/// Threads that read files for every document, started at first use and
+/// kept until mmd_transclusion_cache_clear().  The thread that asks for
+/// files helps read them, so progress doesn't depend on the pool.
+static mmd_mutex prefetch_pool_lock = kMutexInitializer;
+static mmd_cond prefetch_pool_work;			//!< Queue added, or pool stopping
+static mmd_cond prefetch_pool_done;			//!< Item finished
+static prefetch_queue * prefetch_pool_queues = NULL;
+static bool prefetch_pool_started = false;
+static bool prefetch_pool_stopping = false;
+static mmd_thread prefetch_pool_threads[kTranscludePrefetchThreads];
+static int prefetch_pool_thread_count = 0;
+
+
+/// Claim the next item in a queue (lock must be held)
+static prefetch * prefetch_queue_claim(prefetch_queue * q) {
+	if (q->next >= q->items->size) {
+		return NULL;
+	}
+
+	prefetch * p = stack_peek_index(q->items, q->next++);
+
+	if (q->next == q->items->size) {
+		// Nothing left for the pool
+		prefetch_queue ** walk = &prefetch_pool_queues;
+
+		while (*walk && (*walk != q)) {
+			walk = &(*walk)->queued;
+		}
+
+		if (*walk) {
+			*walk = q->queued;
+		}
+	}
+
+	return p;
+}
+
+
+/// Read a claimed item (lock must be held, and is released while reading)
+static void prefetch_queue_read(prefetch_queue * q, prefetch * p) {
+	mmd_mutex_unlock(&prefetch_pool_lock);
+	p->file = transclusion_file_open(p->path);
+	mmd_mutex_lock(&prefetch_pool_lock);
+
+	q->done++;
+	mmd_cond_broadcast(&prefetch_pool_done);
+}
+
+
+static void * prefetch_worker(void * arg) {
+	prefetch_queue * q;
+	prefetch * p;
+
+	mmd_mutex_lock(&prefetch_pool_lock);
+
+	while (true) {
+		q = prefetch_pool_queues;
+
+		if (q == NULL) {
+			if (prefetch_pool_stopping) {
+				break;
+			}
+
+			mmd_cond_wait(&prefetch_pool_work, &prefetch_pool_lock);
+			continue;
+		}
+
+		p = prefetch_queue_claim(q);
+		prefetch_queue_read(q, p);
+	}
+
+	mmd_mutex_unlock(&prefetch_pool_lock);
+
+	return NULL;
+}
+
+
+/// Read all items in queue, using the pool (lock must not be held)
+static void prefetch_pool_run(prefetch_queue * q) {
+	prefetch * p;
+
+	mmd_mutex_lock(&prefetch_pool_lock);
+
+	if (!prefetch_pool_started) {
+		mmd_cond_init(&prefetch_pool_work);
+		mmd_cond_init(&prefetch_pool_done);
+		prefetch_pool_started = true;
+
+		// This thread reads files too
+		while (prefetch_pool_thread_count < kTranscludePrefetchThreads - 1) {
+			if (!mmd_thread_create(&prefetch_pool_threads[prefetch_pool_thread_count], 0, prefetch_worker, NULL)) {
+				break;
+			}
+
+			prefetch_pool_thread_count++;
+		}
+	}
+
+	q->queued = prefetch_pool_queues;
+	prefetch_pool_queues = q;
+	mmd_cond_broadcast(&prefetch_pool_work);
+
+	while ((p = prefetch_queue_claim(q))) {
+		prefetch_queue_read(q, p);
+	}
+
+	while (q->done < q->items->size) {
+		mmd_cond_wait(&prefetch_pool_done, &prefetch_pool_lock);
+	}
+
+	mmd_mutex_unlock(&prefetch_pool_lock);
+}
+
+
+/// Stop the pool's threads and wait for them to finish (lock must not be
+/// held).  The pool starts again if needed.
+static void prefetch_pool_stop(void) {
+	mmd_mutex_lock(&prefetch_pool_lock);
+
+	if (!prefetch_pool_started) {
+		mmd_mutex_unlock(&prefetch_pool_lock);
+		return;
+	}
+
+	prefetch_pool_stopping = true;
+	mmd_cond_broadcast(&prefetch_pool_work);
+	mmd_mutex_unlock(&prefetch_pool_lock);
+
+	for (int i = 0; i < prefetch_pool_thread_count; ++i) {
+		mmd_thread_join(prefetch_pool_threads[i]);
+	}
+
+	mmd_mutex_lock(&prefetch_pool_lock);
+
+	mmd_cond_destroy(&prefetch_pool_work);
+	mmd_cond_destroy(&prefetch_pool_done);
+
+	prefetch_pool_thread_count = 0;
+	prefetch_pool_stopping = false;
+	prefetch_pool_started = false;
+
+	mmd_mutex_unlock(&prefetch_pool_lock);
+}
+
+
+/// Free prefetched files (cached files belong to the cache)
+static void transclusion_prefetch_free(prefetch * files) {
+	prefetch * p, * p_tmp;
+
+	HASH_ITER(hh, files, p, p_tmp) {
+		HASH_DEL(files, p);
+
+		if (p->file && !p->file->cached) {
+			transclusion_file_free(p->file);
+		}
+
+		free(p->path);
+		free(p);
+	}
+}
+
+
+/// Find the files transcluded by source text (at this level only), and read
+/// them on several threads at once, since reading them one at a time can be
+/// slow (e.g. on network file systems).  Files are not recursed into, and
+/// files already being transcluded, or cached and unchanged, are not read.
+static prefetch * transclusion_prefetch(DString * source, size_t offset, const char * search_folder, short format, stack * parse_stack) {
+	prefetch * files = NULL;
+	prefetch * p;
+	DString * file_path;
+	stack * items = stack_new(0);
+	struct stat st;
+	char text[1100];
+	char * start, * stop;
+	bool skip;
+
+	// Every `{{` the transclusion loop could stop at
+	start = strstr(&source->str[offset], "{{");
+
+	while (start != NULL) {
+		stop = strstr(start, "}}");
+
+		if (stop == NULL) {
+			break;
+		}
+
+		if ((stop - start < 1000) && (stop - start > 2)) {
+			strncpy(text, start + 2, stop - start - 2);
+			text[stop - start - 2] = '\0';
+
+			if (strcmp("TOC", text) != 0) {
+				file_path = transclusion_file_path(text, stop - start - 2, search_folder, format);
+
+				skip = false;
+
+				for (int i = 0; i < parse_stack->size; ++i) {
+					if (strcmp(file_path->str, stack_peek_index(parse_stack, i)) == 0) {
+						skip = true;
+						break;
+					}
+				}
+
+				HASH_FIND_STR(files, file_path->str, p);
+
+				if (!skip && !p) {
+					p = malloc(sizeof(prefetch));
+					p->path = d_string_free(file_path, false);
+					p->file = NULL;
+					HASH_ADD_KEYPTR(hh, files, p->path, strlen(p->path), p);
+
+					// Files that are missing, or already cached, aren't read
+					if (!transclusion_cache_enabled || (transclusion_cache_find(p->path, &st, &p->file, NULL) && !p->file)) {
+						stack_push(items, p);
+					}
+				} else {
+					d_string_free(file_path, true);
+				}
+			}
+		}
+
+		start = strstr(start + 1, "{{");
+	}
+
+	if (HASH_COUNT(files) < 2) {
+		// Nothing to be gained
+		transclusion_prefetch_free(files);
+		stack_free(items);
+		return NULL;
+	}
+
+	if (items->size == 1) {
+		p = stack_peek_index(items, 0);
+		p->file = transclusion_file_open(p->path);
+	} else if (items->size > 1) {
+		prefetch_queue q = {
+			.items = items,
+			.next = 0,
+			.done = 0,
+			.queued = NULL,
+		};
+
+		prefetch_pool_run(&q);
+	}
+
+	stack_free(items);
+
+	return files;
+}
+
+
+/// Transclude source text, where metadata (if any) has already been checked
+static void transclude_text(DString * source, size_t offset, const char * base, const char * search_path, const char * source_path, short format, stack * parsed, stack * manifest);
+
+
 /// Recursively transclude source text, given a search directory.
 /// Track files to prevent infinite recursive loops
 void mmd_transclude_source(DString * source, const char * search_path, const char * source_path, short format, stack * parsed, stack * manifest) {
+	size_t offset;
+	char * base;
+
+	transclusion_scan_metadata(source, &offset, &base);
+
+	transclude_text(source, offset, base, search_path, source_path, format, parsed, manifest);
+
+	free(base);
+}
+
+
+static void transclude_text(DString * source, size_t offset, const char * base, const char * search_path, const char * source_path, short format, stack * parsed, stack * manifest) {
 	DString * file_path;
 	DString * buffer;
+	transclusion_file * file;
+	prefetch * prefetched = NULL;
+	prefetch * p;
 
 	// Ensure search_folder is tidied up
 	char * search_folder = path_from_dir_base(search_path, NULL);
@@ -91,29 +764,23 @@ void mmd_transclude_source(DString * source, const char * search_path, const cha
 
 	char * temp;
 
-	size_t offset = 0;
 	size_t last_match;
+	size_t copied = 0;			// Source text before this is already in output
 
-	mmd_engine * e = mmd_engine_create_with_dstring(source, EXT_TRANSCLUDE);
+	rope output;
+	rope_init(&output);
 
-	if (mmd_engine_has_metadata(e, &offset)) {
+	if (base) {
+		// The new file overrides the search path
+		free(search_folder);
 
-		temp = mmd_engine_metavalue_for_key(e, "transclude base");
-
-		if (temp) {
-			// The new file overrides the search path
-			free(search_folder);
-
-			// Calculate new search path relative to source document
-			search_folder = path_from_dir_base(source_folder, temp);
-		}
+		// Calculate new search path relative to source document
+		search_folder = path_from_dir_base(source_folder, base);
 	}
 
 	free(source_folder);
 	free(source_file);
 
-	mmd_engine_free(e, false);
-
 	if (search_folder == NULL) {
 		// We don't have anywhere to search, so nothing to do
 		goto exit;
@@ -130,6 +797,9 @@ void mmd_transclude_source(DString * source, const char * search_path, const cha
 	// Remember where we currently are in the stack
 	size_t stack_depth = parse_stack->size;
 
+	// Read files for this level ahead of time
+	prefetched = transclusion_prefetch(source, offset, search_folder, format, parse_stack);
+
 	// Iterate through source text, looking for `{{foo}}`
 
 	start = strstr(&source->str[offset], "{{");
@@ -156,51 +826,7 @@ void mmd_transclude_source(DString * source, const char * search_path, const cha
 				continue;
 			}
 
-			// Is this an absolute path or relative path?
-			if (is_separator(text[0])) {
-				// Absolute path
-				file_path = d_string_new(text);
-			} else {
-				// Relative path
-				file_path = d_string_new(search_folder);
-
-				// Ensure that search_folder ends in separator
-				add_trailing_sep(file_path);
-
-				d_string_append(file_path, text);
-			}
-
-			// Adjust file wildcard extension for output format
-			// e.g. `foo.*`
-			if ((stop - start > 3) && (format != FORMAT_MMD) && strncmp(&text[stop - start - 4], ".*", 2) == 0) {
-				// Trim '.*'
-				d_string_erase(file_path, file_path->currentStringLength - 2, 2);
-
-				switch (format) {
-					case FORMAT_HTML:
-					case FORMAT_HTML_WITH_ASSETS:
-					case FORMAT_EPUB:
-						d_string_append(file_path, ".html");
-						break;
-
-					case FORMAT_LATEX:
-					case FORMAT_BEAMER:
-					case FORMAT_MEMOIR:
-						d_string_append(file_path, ".tex");
-						break;
-
-					case FORMAT_FODT:
-					case FORMAT_ODT:
-						// `.fodt` is the extension for historical reasons
-						d_string_append(file_path, ".fodt");
-						break;
-
-					default:
-						d_string_append(file_path, ".txt");
-						break;
-
-				}
-			}
+			file_path = transclusion_file_path(text, stop - start - 2, search_folder, format);
 
 			// Prevent infinite recursive loops
 			for (int i = 0; i < stack_depth; ++i) {
@@ -235,34 +861,41 @@ void mmd_transclude_source(DString * source, const char * search_path, const cha
 				}
 			}
 
-			// Read the file
-			buffer = scan_file(file_path->str);
-
-			// Substitue buffer for transclusion token
-			if (buffer) {
-				// Erase transclusion token from current source
-				d_string_erase(source, start - source->str, 2 + stop - start);
-
-				// Recursively check this file for transclusions
-				mmd_transclude_source(buffer, search_folder, file_path->str, format, parse_stack, manifest);
-
-				// Strip metadata from buffer now that we have parsed it
-				e = mmd_engine_create_with_dstring(buffer, EXT_TRANSCLUDE);
-
-				if (mmd_engine_has_metadata(e, &offset)) {
-					d_string_erase(buffer, 0, offset);
+			// Read the file (unless it has been already)
+			HASH_FIND_STR(prefetched, file_path->str, p);
+			file = (p) ? p->file : transclusion_file_open(file_path->str);
+
+			// Substitue file text for transclusion token
+			if (file) {
+				// Source text up to the transclusion token
+				// (source is not modified until the end, so start/stop stay valid)
+				rope_append(&output, &source->str[copied], last_match - copied);
+
+				if (file->has_markers) {
+					// Recursively transclude a copy of the file text
+					buffer = d_string_new_borrowed(file->text->str, file->text->currentStringLength);
+					transclude_text(buffer, file->meta_end, file->base, search_folder, file_path->str, format, parse_stack, manifest);
+
+					// Strip metadata from buffer now that we have parsed it
+					transclusion_scan_metadata(buffer, &offset, NULL);
+
+					rope_append(&output, &buffer->str[offset], buffer->currentStringLength - offset);
+					stack_push(output.buffers, buffer);
+				} else {
+					// Nothing to transclude, so file text can be used as is
+					rope_append(&output, &file->text->str[file->meta_end], file->text->currentStringLength - file->meta_end);
 				}
 
-				mmd_engine_free(e, false);
-
-				// Insert file text -- this may cause d_string to reallocate the
-				// character buffer, meaning start/stop are no longer valid
-				d_string_insert(source, start - source->str, buffer->str);
-
-				// Shift search point
-				last_match += buffer->currentStringLength;
+				if (!file->cached && !p) {
+					// Keep text until output is assembled
+					stack_push(output.buffers, file->text);
+					file->text = NULL;
+					transclusion_file_free(file);
+				}
 
-				d_string_free(buffer, true);
+				// Skip transclusion token
+				copied = last_match + 2 + stop - start;
+				last_match = copied;
 			} else {
 				// Skip over marker
 				last_match += 2;
@@ -283,7 +916,15 @@ finish_file:
 		start = strstr(source->str + last_match, "{{");
 	}
 
+	if (copied) {
+		// Remainder of source text
+		rope_append(&output, &source->str[copied], source->currentStringLength - copied);
+		rope_materialize(&output, source);
+	}
+
 exit:
+	rope_free(&output);
+	transclusion_prefetch_free(prefetched);
 
 	if (parsed == NULL) {
 		// Free temp stack
@@ -298,6 +939,351 @@ exit:
 
 
 
+#ifdef TEST
+/// Files written by a test, removed by `transclude_test_cleanup()`
+static char transclude_test_dir[1024];
+static stack * transclude_test_files = NULL;
+
+
+static void transclude_test_setup(void) {
+#if (defined(_WIN32) || defined(__WIN32__))
+	snprintf(transclude_test_dir, sizeof(transclude_test_dir), "%s\\mmd-transclude-XXXXXX", getenv("TEMP"));
+	_mktemp_s(transclude_test_dir, strlen(transclude_test_dir) + 1);
+	test_mkdir(transclude_test_dir);
+#else
+	strcpy(transclude_test_dir, "/tmp/mmd-transclude-XXXXXX");
+	mkdtemp(transclude_test_dir);
+#endif
+
+	transclude_test_files = stack_new(0);
+}
+
+
+/// Write file with name relative to test folder, and return its full path
+static const char * transclude_test_write(const char * name, const char * text) {
+	char * path = path_from_dir_base(transclude_test_dir, name);
+	FILE * f = fopen(path, "wb");
+
+	fputs(text, f);
+	fclose(f);
+
+	// Only remember each path once
+	for (int i = 0; i < transclude_test_files->size; ++i) {
+		if (strcmp(path, stack_peek_index(transclude_test_files, i)) == 0) {
+			free(path);
+			return stack_peek_index(transclude_test_files, i);
+		}
+	}
+
+	stack_push(transclude_test_files, path);
+
+	return path;
+}
+
+
+static void transclude_test_cleanup(void) {
+	// Files are removed in reverse order, so folders are empty when removed
+	while (transclude_test_files->size) {
+		char * path = stack_pop(transclude_test_files);
+		unlink(path);
+		rmdir(path);
+		free(path);
+	}
+
+	stack_free(transclude_test_files);
+	rmdir(transclude_test_dir);
+}
+
+
+/// Transclude text, as though it were a document in the test folder
+static char * transclude_test_run(const char * text, short format, stack * manifest) {
+	DString * source = d_string_new(text);
+	char * source_path = path_from_dir_base(transclude_test_dir, "main.txt");
+
+	mmd_transclude_source(source, transclude_test_dir, source_path, format, NULL, manifest);
+
+	free(source_path);
+
+	return d_string_free(source, false);
+}
+
+
+void Test_mmd_transclude_source(CuTest * tc) {
+	char * out;
+
+	transclude_test_setup();
+
+	transclude_test_write("a.txt", "A {{b.txt}} A");
+	transclude_test_write("b.txt", "B {{c.txt}}");
+	transclude_test_write("c.txt", "C");
+
+	// No transclusion markers
+	out = transclude_test_run("Plain text", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "Plain text", out);
+	free(out);
+
+	// Nested transclusion
+	out = transclude_test_run("x {{a.txt}} y", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "x A B C A y", out);
+	free(out);
+
+	// Missing files, and `{{TOC}}`, are left alone
+	out = transclude_test_run("x {{missing.txt}} {{TOC}} {{c.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "x {{missing.txt}} {{TOC}} C", out);
+	free(out);
+
+	// Recursion loops stop at the first file transcluded twice
+	transclude_test_write("loop1.txt", "1 {{loop2.txt}}");
+	transclude_test_write("loop2.txt", "2 {{loop1.txt}}");
+	transclude_test_write("self.txt", "S {{self.txt}}");
+
+	out = transclude_test_run("{{loop1.txt}} | {{self.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "1 2 {{loop1.txt}} | S {{self.txt}}", out);
+	free(out);
+
+	// The same file may be used more than once, if not recursively
+	out = transclude_test_run("{{c.txt}}{{c.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "CC", out);
+	free(out);
+
+	transclude_test_cleanup();
+}
+
+
+void Test_transclusion_file_path(CuTest * tc) {
+	char * out;
+
+	transclude_test_setup();
+
+	transclude_test_write("w.html", "html");
+	transclude_test_write("w.tex", "tex");
+	transclude_test_write("w.fodt", "fodt");
+	transclude_test_write("w.txt", "txt");
+
+	out = transclude_test_run("{{w.*}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "html", out);
+	free(out);
+
+	out = transclude_test_run("{{w.*}}", FORMAT_EPUB, NULL);
+	CuAssertStrEquals(tc, "html", out);
+	free(out);
+
+	out = transclude_test_run("{{w.*}}", FORMAT_LATEX, NULL);
+	CuAssertStrEquals(tc, "tex", out);
+	free(out);
+
+	out = transclude_test_run("{{w.*}}", FORMAT_MEMOIR, NULL);
+	CuAssertStrEquals(tc, "tex", out);
+	free(out);
+
+	out = transclude_test_run("{{w.*}}", FORMAT_ODT, NULL);
+	CuAssertStrEquals(tc, "fodt", out);
+	free(out);
+
+	out = transclude_test_run("{{w.*}}", FORMAT_OPML, NULL);
+	CuAssertStrEquals(tc, "txt", out);
+	free(out);
+
+	// MMD output keeps the wildcard
+	out = transclude_test_run("{{w.*}}", FORMAT_MMD, NULL);
+	CuAssertStrEquals(tc, "{{w.*}}", out);
+	free(out);
+
+	transclude_test_cleanup();
+}
+
+
+void Test_mmd_transclude_source_metadata(CuTest * tc) {
+	char * out;
+	char * path;
+
+	transclude_test_setup();
+
+	path = path_from_dir_base(transclude_test_dir, "sub");
+	test_mkdir(path);
+	stack_push(transclude_test_files, path);
+
+	transclude_test_write("sub/inner.txt", "inner");
+	transclude_test_write("inner.txt", "outer");
+
+	// Metadata in transcluded files is stripped (up to the blank line)
+	transclude_test_write("meta.txt", "Title: Fragment\n\nbody");
+
+	out = transclude_test_run("{{meta.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "\nbody", out);
+	free(out);
+
+	// Transclude Base in the document changes the search folder
+	out = transclude_test_run("Transclude Base: sub\n\n{{inner.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "Transclude Base: sub\n\ninner", out);
+	free(out);
+
+	// Markers in the document's metadata are left alone
+	out = transclude_test_run("Title: {{inner.txt}}\n\n{{inner.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "Title: {{inner.txt}}\n\nouter", out);
+	free(out);
+
+	// Transclude Base in a transcluded file applies to its own markers
+	transclude_test_write("based.txt", "Transclude Base: sub\n\n{{inner.txt}}");
+
+	out = transclude_test_run("{{based.txt}} {{inner.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "\ninner outer", out);
+	free(out);
+
+	transclude_test_cleanup();
+}
+
+
+void Test_mmd_transclude_source_manifest(CuTest * tc) {
+	char * out;
+	stack * manifest = stack_new(0);
+
+	transclude_test_setup();
+
+	const char * a = transclude_test_write("a.txt", "A {{b.txt}} {{c.txt}}");
+	const char * b = transclude_test_write("b.txt", "B {{c.txt}}");
+	const char * c = transclude_test_write("c.txt", "C");
+
+	out = transclude_test_run("{{a.txt}} {{b.txt}} {{missing.txt}}", FORMAT_HTML, manifest);
+	CuAssertStrEquals(tc, "A B C C B C {{missing.txt}}", out);
+	free(out);
+
+	// Each file once, in the order first used (missing files included)
+	CuAssertIntEquals(tc, 4, manifest->size);
+	CuAssertStrEquals(tc, a, stack_peek_index(manifest, 0));
+	CuAssertStrEquals(tc, b, stack_peek_index(manifest, 1));
+	CuAssertStrEquals(tc, c, stack_peek_index(manifest, 2));
+
+	while (manifest->size) {
+		free(stack_pop(manifest));
+	}
+
+	stack_free(manifest);
+
+	transclude_test_cleanup();
+}
+#endif
+
+
+#ifdef TEST
+void Test_mmd_transclusion_cache(CuTest * tc) {
+	char * out;
+	struct utimbuf times;
+
+	transclude_test_setup();
+
+	mmd_transclusion_cache_enable(true);
+
+	const char * a = transclude_test_write("a.txt", "one");
+	transclude_test_write("b.txt", "B {{a.txt}}");
+
+	out = transclude_test_run("{{b.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "B one", out);
+	free(out);
+
+	// Size changes
+	transclude_test_write("a.txt", "three");
+
+	out = transclude_test_run("{{b.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "B three", out);
+	free(out);
+
+	// Same size, but modification time changes
+	transclude_test_write("a.txt", "seven");
+	times.actime = 1000000;
+	times.modtime = 1000000;
+	utime(a, &times);
+
+	out = transclude_test_run("{{b.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "B seven", out);
+	free(out);
+
+	// Unchanged files come from the cache, even if their contents changed
+	transclude_test_write("a.txt", "eight");
+	utime(a, &times);
+
+	out = transclude_test_run("{{b.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "B seven", out);
+	free(out);
+
+	// Other paths to the same file share its entry
+	char * sub = path_from_dir_base(transclude_test_dir, "sub");
+	test_mkdir(sub);
+	stack_push(transclude_test_files, sub);
+
+	out = transclude_test_run("{{sub/../a.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "seven", out);
+	free(out);
+
+	// Disabling the cache doesn't affect files it already holds
+	mmd_transclusion_cache_enable(false);
+
+	out = transclude_test_run("{{b.txt}}", FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, "B eight", out);
+	free(out);
+
+	mmd_transclusion_cache_clear();
+
+	transclude_test_cleanup();
+}
+#endif
+
+
+#ifdef TEST
+void Test_transclusion_prefetch(CuTest * tc) {
+	char * out;
+	char name[20];
+	DString * source = d_string_new("");
+	DString * expected = d_string_new("");
+
+	transclude_test_setup();
+
+	// Enough files to be read on several threads, some used twice, one
+	// missing, and one nested
+	for (int i = 0; i < 10; ++i) {
+		sprintf(name, "f%d.txt", i);
+		transclude_test_write(name, (i == 5) ? "[{{f6.txt}}]" : name);
+	}
+
+	for (int i = 0; i < 12; ++i) {
+		d_string_append_printf(source, "{{f%d.txt}} ", i % 11);
+
+		if (i % 11 == 10) {
+			d_string_append(expected, "{{f10.txt}} ");
+		} else if (i % 11 == 5) {
+			d_string_append(expected, "[f6.txt] ");
+		} else {
+			d_string_append_printf(expected, "f%d.txt ", i % 11);
+		}
+	}
+
+	// Without the cache, then with it (empty, and full)
+	for (int pass = 0; pass < 3; ++pass) {
+		mmd_transclusion_cache_enable(pass > 0);
+
+		out = transclude_test_run(source->str, FORMAT_HTML, NULL);
+		CuAssertStrEquals(tc, expected->str, out);
+		free(out);
+	}
+
+	mmd_transclusion_cache_clear();
+	mmd_transclusion_cache_enable(false);
+
+	// Clearing the cache stops the pool, which starts again when needed
+	out = transclude_test_run(source->str, FORMAT_HTML, NULL);
+	CuAssertStrEquals(tc, expected->str, out);
+	free(out);
+
+	mmd_transclusion_cache_clear();
+
+	d_string_free(source, true);
+	d_string_free(expected, true);
+
+	transclude_test_cleanup();
+}
+#endif
+
+
 /// If MMD Header metadata used, insert it into appropriate place
 void mmd_prepend_mmd_header(DString * source) {
 	size_t end;
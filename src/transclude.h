@@ -56,6 +56,8 @@
 #ifndef TRANSCLUDE_MULTIMARKDOWN_6_H
 #define TRANSCLUDE_MULTIMARKDOWN_6_H
 
+#include <stdbool.h>
+
 #include "stack.h"
 
 #ifdef TEST
@@ -68,6 +70,19 @@
 void mmd_transclude_source(DString * source, const char * search_path, const char * source_path, short format, stack * parsed, stack * manifest);
 
 
+/// Keep transcluded files in memory, and share them between all documents
+/// transcluded until the cache is cleared (e.g. when converting many files
+/// that include the same fragments).  Cached files are read again if their
+/// size or modification time changes.
+void mmd_transclusion_cache_enable(bool enable);
+
+
+/// Free all cached transcluded files, and stop the threads used to read
+/// transcluded files -- must not be called while transclusion is in
+/// progress on another thread
+void mmd_transclusion_cache_clear(void);
+
+
 /// If MMD Header metadata used, insert it into appropriate place
 void mmd_prepend_mmd_header(DString * source);
 
@@ -74,6 +74,7 @@
 #include "parser.h"
 #include "scanners.h"
 #include "stack.h"
+#include "thread.h"
 #include "token.h"
 #include "uuid.h"
 #include "writer.h"
@@ -159,6 +160,7 @@ scratch_pad * scratch_pad_new(mmd_engine * e, short format) {
 		p->opml_item_closed = 1;
 
 		p->recurse_depth = 0;
+		p->recurse_depth_max = 0;
 
 		p->base_header_level = 1;
 
@@ -177,6 +179,7 @@ scratch_pad * scratch_pad_new(mmd_engine * e, short format) {
 		}
 
 		p->label_counter = 0;
+		p->obfuscate_counter = 0;
 
 		// Store links in a hash for rapid retrieval when exporting
 		p->link_hash = NULL;
@@ -260,6 +263,10 @@ scratch_pad * scratch_pad_new(mmd_engine * e, short format) {
 		p->remember_assets = 0;
 
 		p->critic_stack = e->critic_stack;
+
+		p->sink = NULL;
+		p->sink_depth = -1;
+		p->out_flushed = 0;
 	}
 
 	return p;
@@ -362,6 +369,146 @@ void pad(DString * d, short num, scratch_pad * scratch) {
 }
 
 
+/// Pass finished output along to the sink (if any).  Writers may still
+/// revise the end of the buffer while inside a block, so unless `force` is
+/// set this should only be called between top level blocks.
+void mmd_export_flush(DString * out, scratch_pad * scratch, bool force) {
+	if (scratch->sink == NULL) {
+		return;
+	}
+
+	if (!force && (out->currentStringLength < scratch->sink->flush_threshold)) {
+		return;
+	}
+
+	if (out->currentStringLength) {
+		scratch->sink->write(out->str, out->currentStringLength, scratch->sink->context);
+		scratch->out_flushed += out->currentStringLength;
+		d_string_erase(out, 0, -1);
+	}
+}
+
+
+#ifdef TEST
+/// Do two token trees have the same output offsets?
+static bool token_tree_offsets_match(token * a, token * b) {
+	while (a && b) {
+		if ((a->type != b->type) || (a->start != b->start) || (a->len != b->len) ||
+				(a->out_start != b->out_start) || (a->out_len != b->out_len)) {
+			return false;
+		}
+
+		if (!token_tree_offsets_match(a->child, b->child)) {
+			return false;
+		}
+
+		a = a->next;
+		b = b->next;
+	}
+
+	return (a == NULL) && (b == NULL);
+}
+
+
+/// Sink that collects output in the DString passed as context
+static void sink_write_to_d_string(const char * data, size_t len, void * context) {
+	d_string_append_c_array((DString *) context, data, len);
+}
+
+
+/// Export to a sink that flushes after every block, and check that output
+/// offsets match an export to a single buffer
+void Test_mmd_export_flush(CuTest * tc) {
+	DString * source = d_string_new("");
+
+	for (int i = 0; i < 300; ++i) {
+		d_string_append_printf(source, "Some *text* %d.\n\n* one\n* two\n\n> quote\n\n", i);
+	}
+
+	mmd_engine * s = mmd_engine_create_with_string(source->str, EXT_SMART | EXT_NOTES);
+	mmd_engine * k = mmd_engine_create_with_string(source->str, EXT_SMART | EXT_NOTES);
+	DString * s_out = d_string_new("");
+	DString * k_out = d_string_new("");
+
+	mmd_sink sink = {
+		.write = sink_write_to_d_string,
+		.context = k_out,
+		.flush_threshold = 0,
+	};
+
+	mmd_engine_parse_string(s);
+	mmd_engine_parse_string(k);
+
+	mmd_engine_export_token_tree(s_out, s, FORMAT_HTML);
+	mmd_engine_export_token_tree_to_sink(&sink, k, FORMAT_HTML);
+
+	CuAssertStrEquals(tc, s_out->str, k_out->str);
+	CuAssertIntEquals(tc, k_out->currentStringLength, k->root->out_len);
+	CuAssertTrue(tc, token_tree_offsets_match(s->root, k->root));
+
+	d_string_free(s_out, true);
+	d_string_free(k_out, true);
+	mmd_engine_free(s, true);
+	mmd_engine_free(k, true);
+	d_string_free(source, true);
+}
+
+
+static const char * kTestEmailSource = "Mail <fletcher@example.com> or <mailto:someone@example.net>.\n";
+
+
+/// Export a document with obfuscated email addresses into the DString
+/// passed as argument
+static void * export_email_run(void * arg) {
+	DString * out = arg;
+
+	for (int i = 0; i < 200; ++i) {
+		mmd_engine * e = mmd_engine_create_with_string(kTestEmailSource, EXT_SMART);
+		mmd_engine_parse_string(e);
+
+		d_string_erase(out, 0, -1);
+		mmd_engine_export_token_tree(out, e, FORMAT_HTML);
+
+		mmd_engine_free(e, true);
+	}
+
+	return NULL;
+}
+
+
+/// Exports running at the same time must obfuscate email addresses the same
+/// way as an export on its own
+void Test_mmd_export_obfuscate_threads(CuTest * tc) {
+	DString * serial = d_string_new("");
+	DString * a = d_string_new("");
+	DString * b = d_string_new("");
+	mmd_thread t;
+
+	export_email_run(serial);
+	CuAssertPtrNotNull(tc, strstr(serial->str, "&#"));
+
+	bool threaded = mmd_thread_create(&t, 0, export_email_run, a);
+
+	if (!threaded) {
+		export_email_run(a);
+	}
+
+	export_email_run(b);
+
+	if (threaded) {
+		mmd_thread_join(t);
+	}
+
+	CuAssertStrEquals(tc, serial->str, a->str);
+	CuAssertStrEquals(tc, serial->str, b->str);
+
+	d_string_free(serial, true);
+	d_string_free(a, true);
+	d_string_free(b, true);
+}
+#endif
+
+
 void print_token_raw(DString * out, const char * source, token * t) {
 	if (t) {
 		switch (t->type) {
@@ -465,6 +612,21 @@ char * label_from_token(const char * source, token * t) {
 }
 
 
+short random_label_number(int seed) {
+	// Hash the seed instead of using srand()/rand(), which share state
+	// across threads
+	uint32_t x = (uint32_t) seed;
+
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+
+	return (short)(x % 32000 + 1);
+}
+
+
 char * label_from_header(const char * source, token * t, scratch_pad * scratch) {
 	char * result;
 	short temp_short;
@@ -475,8 +637,7 @@ char * label_from_header(const char * source, token * t, scratch_pad * scratch)
 		result = label_from_token(source, temp_token);
 	} else {
 		if (scratch->extensions & EXT_RANDOM_LABELS) {
-			srand(scratch->random_seed_base_labels + scratch->label_counter);
-			temp_short = rand() % 32000 + 1;
+			temp_short = random_label_number(scratch->random_seed_base_labels + scratch->label_counter);
 			result = malloc(sizeof(char) * 6);
 			sprintf(result, "%d", temp_short);
 
@@ -1941,19 +2102,33 @@ void identify_global_search_terms(mmd_engine * e, scratch_pad * scratch) {
 }
 
 
-void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
+/// Export parsed token tree, passing finished output to sink if there is one
+static void export_token_tree(DString * out, mmd_engine * e, short format, mmd_sink * sink) {
+
+	// Any tokens created during export belong to this engine
+	struct pool * previous_pool = mmd_engine_pool_enter(e);
+
+	// The token tree is modified from here on
+	e->root_exported = true;
+
+	size_t reallocations = d_string_reallocations();
+	double lap = mmd_stats_clock(e);
 
 	// Process potential reference definitions
 	process_definition_stack(e);
+	lap = mmd_stats_lap(e, PHASE_DEFINITIONS, lap);
 
 	// Process headers for potential cross-reference targets
 	process_header_stack(e);
+	lap = mmd_stats_lap(e, PHASE_HEADERS, lap);
 
 	// Process tables for potential cross-reference targets
 	process_table_stack(e);
+	lap = mmd_stats_lap(e, PHASE_TABLES, lap);
 
 	// Create scratch pad
 	scratch_pad * scratch = scratch_pad_new(e, format);
+	scratch->sink = sink;
 
 	// Process metadata
 	process_metadata_stack(e, scratch);
@@ -1963,6 +2138,7 @@ void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
 		identify_global_search_terms(e, scratch);
 	}
 
+	lap = mmd_stats_lap(e, PHASE_SEARCH_TERMS, lap);
 
 	switch (scratch->output_format) {
 		case FORMAT_BEAMER:
@@ -2067,6 +2243,18 @@ void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
 			break;
 	}
 
+	// Pass along whatever is left
+	mmd_export_flush(out, scratch, true);
+	mmd_stats_lap(e, PHASE_WRITER, lap);
+
+	if (e->stats) {
+		e->stats->string_reallocations += d_string_reallocations() - reallocations;
+
+		if (scratch->recurse_depth_max > e->stats->export_depth_max) {
+			e->stats->export_depth_max = scratch->recurse_depth_max;
+		}
+	}
+
 	// Preserve asset_hash for possible use in export
 	e->asset_hash = scratch->asset_hash;
 
@@ -2074,6 +2262,31 @@ void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
 	e->random_seed_base_labels = scratch->random_seed_base_labels;
 
 	scratch_pad_free(scratch);
+
+	mmd_engine_pool_exit(previous_pool);
+}
+
+
+/// Export parsed token tree to output format
+void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
+	export_token_tree(out, e, format, NULL);
+}
+
+
+/// Export parsed token tree to output format, passing output to the sink as
+/// it is finished
+void mmd_engine_export_token_tree_to_sink(mmd_sink * sink, mmd_engine * e, short format) {
+	DString * out = d_string_new("");
+
+	export_token_tree(out, e, format, sink);
+
+	d_string_free(out, true);
+}
+
+
+/// Sink callback that writes to the `FILE *` passed as context
+void mmd_sink_write_to_file(const char * data, size_t len, void * context) {
+	fwrite(data, len, 1, (FILE *) context);
 }
 
 
@@ -96,6 +96,7 @@ typedef struct {
 	short				footnote_being_printed;
 
 	int 				random_seed_base;
+	int 				obfuscate_counter;	//!< Advances per character of an obfuscated email address
 
 	int 				random_seed_base_labels;
 	int 				label_counter;
@@ -126,6 +127,7 @@ typedef struct {
 	short				opml_item_closed;
 
 	short				recurse_depth;
+	short				recurse_depth_max;		//!< Deepest recursion reached, for stats
 
 	short				in_table_header;
 	short				table_column_count;
@@ -139,6 +141,10 @@ typedef struct {
 	short				remember_assets;
 
 	stack 		*		critic_stack;
+
+	mmd_sink 	*		sink;
+	short				sink_depth;		//!< Recursion depth of top level blocks, when output can be flushed
+	size_t				out_flushed;	//!< Output already passed to the sink, so offsets stay absolute
 } scratch_pad;
 
 
@@ -195,6 +201,7 @@ struct meta {
 	char 		*		value;
 	size_t				start;
 	UT_hash_handle		hh;
+	UT_hash_handle		engine_hh;		//!< For mmd_engine metadata index
 };
 
 typedef struct meta meta;
@@ -219,6 +226,10 @@ void scratch_pad_free(scratch_pad * scratch);
 /// Ensure at least num newlines at end of output buffer
 void pad(DString * d, short num, scratch_pad * scratch);
 
+
+/// Pass finished output along to the sink (if any)
+void mmd_export_flush(DString * out, scratch_pad * scratch, bool force);
+
 link * explicit_link(scratch_pad * scratch, token * label, token * url, const char * source);
 
 /// Find link based on label
@@ -233,6 +244,10 @@ void footnote_free(footnote * f);
 char * label_from_token(const char * source, token * t);
 char * label_from_header(const char * source, token * t, scratch_pad * scratch);
 
+/// Pseudo-random number (1-32000) for a footnote anchor or header label.
+/// Depends only on seed, so it is safe to call from several threads.
+short random_label_number(int seed);
+
 void parse_brackets(const char * source, scratch_pad * scratch, token * bracket, link ** link, short * skip_token, bool * free_link);
 
 
@@ -0,0 +1,50 @@
+# Convert a file onto itself, both with -o and in batch mode, and check that
+# the result matches converting a copy.
+#
+#	cmake -DMMD=path/to/multimarkdown -DSOURCE=input.text -DWORK=dir -P same-file.cmake
+
+file(REMOVE_RECURSE "${WORK}")
+file(MAKE_DIRECTORY "${WORK}")
+
+configure_file("${SOURCE}" "${WORK}/reference.text" COPYONLY)
+configure_file("${SOURCE}" "${WORK}/same.text" COPYONLY)
+configure_file("${SOURCE}" "${WORK}/same.html" COPYONLY)
+
+execute_process(COMMAND "${MMD}" -o reference.html reference.text
+	WORKING_DIRECTORY "${WORK}" RESULT_VARIABLE result)
+
+if (NOT result EQUAL 0)
+	message(FATAL_ERROR "Converting reference copy failed: ${result}")
+endif ()
+
+# Output file given with -o
+execute_process(COMMAND "${MMD}" -o same.text same.text
+	WORKING_DIRECTORY "${WORK}" RESULT_VARIABLE result)
+
+if (NOT result EQUAL 0)
+	message(FATAL_ERROR "multimarkdown -o same.text same.text failed: ${result}")
+endif ()
+
+execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files reference.html same.text
+	WORKING_DIRECTORY "${WORK}" RESULT_VARIABLE result)
+
+if (NOT result EQUAL 0)
+	message(FATAL_ERROR "Output written over the input with -o doesn't match")
+endif ()
+
+# Batch mode output name is the same as the input
+execute_process(COMMAND "${MMD}" -b same.html
+	WORKING_DIRECTORY "${WORK}" RESULT_VARIABLE result)
+
+if (NOT result EQUAL 0)
+	message(FATAL_ERROR "multimarkdown -b same.html failed: ${result}")
+endif ()
+
+execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files reference.html same.html
+	WORKING_DIRECTORY "${WORK}" RESULT_VARIABLE result)
+
+if (NOT result EQUAL 0)
+	message(FATAL_ERROR "Output written over the input in batch mode doesn't match")
+endif ()
+
+file(REMOVE_RECURSE "${WORK}")